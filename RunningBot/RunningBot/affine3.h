@@ -0,0 +1,211 @@
+#ifndef AFFINE3_H
+#define AFFINE3_H
+
+#include <cassert>
+#include <cmath>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "quat.h"
+
+// An affine transform stored as the top 3 rows of a 4x4 matrix, the last row
+// being the implicit [0,0,0,1]. Every transform of the bot hierarchy is affine,
+// so composing two of them costs 36 multiply-adds instead of the 64 of a full
+// Matrix4 product, and inverting one never has to check isAffine.
+// Conversion to a full matrix only happens when the data is uploaded.
+// To get the element at ith row and jth column, use a(i,j)
+class Affine3 {
+  float d_[12]; // layout is row-major
+
+public:
+  float &operator () (const int row, const int col) {
+    return d_[(row << 2) + col];
+  }
+
+  const float &operator () (const int row, const int col) const {
+    return d_[(row << 2) + col];
+  }
+
+  float& operator [] (const int i) {
+    return d_[i];
+  }
+
+  const float& operator [] (const int i) const {
+    return d_[i];
+  }
+
+  Affine3() {
+    for (int i = 0; i < 12; ++i) {
+      d_[i] = 0;
+    }
+    for (int i = 0; i < 3; ++i) {
+      (*this)(i,i) = 1;
+    }
+  }
+
+  explicit Affine3(const Matrix4& m) {
+    assert(isAffine(m));
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        (*this)(i,j) = float(m(i,j));
+      }
+    }
+  }
+
+  Matrix4 toMatrix4() const {
+    Matrix4 r;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        r(i,j) = (*this)(i,j);
+      }
+    }
+    return r;
+  }
+
+  Matrix4f toMatrix4f() const {
+    Matrix4f r;
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        r(i,j) = (*this)(i,j);
+      }
+    }
+    return r;
+  }
+
+  // Writes the full 4x4 matrix, e.g. for glUniformMatrix4fv
+  template <class T>
+  void writeToColumnMajorMatrix(T m[]) const {
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 3; ++i) {
+        m[(j << 2) + i] = T((*this)(i,j));
+      }
+      m[(j << 2) + 3] = T(j == 3 ? 1 : 0);
+    }
+  }
+
+  // Writes the full 4x4 matrix row by row, which is also the column-major
+  // layout of its transpose
+  template <class T>
+  void writeToRowMajorMatrix(T m[]) const {
+    for (int i = 0; i < 12; ++i) {
+      m[i] = T(d_[i]);
+    }
+    m[12] = m[13] = m[14] = T(0);
+    m[15] = T(1);
+  }
+
+  Affine3& operator *= (const Affine3& a) {
+    return *this = *this * a;
+  }
+
+  // this * a, the implicit last rows are never multiplied
+  Affine3 operator * (const Affine3& a) const {
+    Affine3 r;
+    for (int i = 0; i < 3; ++i) {
+      const float* row = &d_[i << 2];
+      for (int j = 0; j < 4; ++j) {
+        r(i,j) = row[0] * a(0,j) + row[1] * a(1,j) + row[2] * a(2,j);
+      }
+      r(i,3) += row[3];
+    }
+    return r;
+  }
+
+  Cvec3f transformPoint(const Cvec3f& p) const {
+    return Cvec3f(d_[0] * p[0] + d_[1] * p[1] + d_[2]  * p[2] + d_[3],
+                  d_[4] * p[0] + d_[5] * p[1] + d_[6]  * p[2] + d_[7],
+                  d_[8] * p[0] + d_[9] * p[1] + d_[10] * p[2] + d_[11]);
+  }
+
+  // Applies the linear part only, as for directions
+  Cvec3f transformVector(const Cvec3f& v) const {
+    return Cvec3f(d_[0] * v[0] + d_[1] * v[1] + d_[2]  * v[2],
+                  d_[4] * v[0] + d_[5] * v[1] + d_[6]  * v[2],
+                  d_[8] * v[0] + d_[9] * v[1] + d_[10] * v[2]);
+  }
+
+  static Affine3 makeTranslation(const Cvec3& t) {
+    Affine3 r;
+    for (int i = 0; i < 3; ++i) {
+      r(i,3) = float(t[i]);
+    }
+    return r;
+  }
+
+  static Affine3 makeScale(const Cvec3& s) {
+    Affine3 r;
+    for (int i = 0; i < 3; ++i) {
+      r(i,i) = float(s[i]);
+    }
+    return r;
+  }
+
+  static Affine3 makeRotation(const Quat& q) {
+    Affine3 r;
+    const double n = norm2(q);
+    if (n < CS175_EPS2) {
+      r(0,0) = r(1,1) = r(2,2) = 0;
+      return r;
+    }
+
+    const double two_over_n = 2/n;
+    r(0, 0) -= float((q(2)*q(2) + q(3)*q(3)) * two_over_n);
+    r(0, 1) += float((q(1)*q(2) - q(0)*q(3)) * two_over_n);
+    r(0, 2) += float((q(1)*q(3) + q(2)*q(0)) * two_over_n);
+    r(1, 0) += float((q(1)*q(2) + q(0)*q(3)) * two_over_n);
+    r(1, 1) -= float((q(1)*q(1) + q(3)*q(3)) * two_over_n);
+    r(1, 2) += float((q(2)*q(3) - q(1)*q(0)) * two_over_n);
+    r(2, 0) += float((q(1)*q(3) - q(2)*q(0)) * two_over_n);
+    r(2, 1) += float((q(2)*q(3) + q(1)*q(0)) * two_over_n);
+    r(2, 2) -= float((q(1)*q(1) + q(2)*q(2)) * two_over_n);
+    return r;
+  }
+};
+
+inline Affine3 inv(const Affine3& m) {
+  Affine3 r;
+  const float det = m(0,0)*(m(1,1)*m(2,2) - m(1,2)*m(2,1)) +
+                    m(0,1)*(m(1,2)*m(2,0) - m(1,0)*m(2,2)) +
+                    m(0,2)*(m(1,0)*m(2,1) - m(1,1)*m(2,0));
+
+  // check non-singular matrix
+  assert(std::abs(det) > CS175_EPS3);
+  const float invDet = 1.0f / det;
+
+  // "rotation part"
+  r(0,0) =  (m(1,1) * m(2,2) - m(1,2) * m(2,1)) * invDet;
+  r(1,0) = -(m(1,0) * m(2,2) - m(1,2) * m(2,0)) * invDet;
+  r(2,0) =  (m(1,0) * m(2,1) - m(1,1) * m(2,0)) * invDet;
+  r(0,1) = -(m(0,1) * m(2,2) - m(0,2) * m(2,1)) * invDet;
+  r(1,1) =  (m(0,0) * m(2,2) - m(0,2) * m(2,0)) * invDet;
+  r(2,1) = -(m(0,0) * m(2,1) - m(0,1) * m(2,0)) * invDet;
+  r(0,2) =  (m(0,1) * m(1,2) - m(0,2) * m(1,1)) * invDet;
+  r(1,2) = -(m(0,0) * m(1,2) - m(0,2) * m(1,0)) * invDet;
+  r(2,2) =  (m(0,0) * m(1,1) - m(0,1) * m(1,0)) * invDet;
+
+  // "translation part" - multiply the translation (on the left) by the inverse linear part
+  r(0,3) = -(m(0,3) * r(0,0) + m(1,3) * r(0,1) + m(2,3) * r(0,2));
+  r(1,3) = -(m(0,3) * r(1,0) + m(1,3) * r(1,1) + m(2,3) * r(1,2));
+  r(2,3) = -(m(0,3) * r(2,0) + m(1,3) * r(2,1) + m(2,3) * r(2,2));
+  return r;
+}
+
+// Transposed inverse of the linear part with no translation, as
+// normalMatrix(const Matrix4&)
+inline Affine3 normalMatrix(const Affine3& m) {
+  const Affine3 invm = inv(m);
+  Affine3 r;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      r(i,j) = invm(j,i);
+    }
+  }
+  return r;
+}
+
+inline Cvec3f transformNormal(const Affine3& m, const Cvec3f& n) {
+  return normalMatrix(m).transformVector(n);
+}
+
+#endif
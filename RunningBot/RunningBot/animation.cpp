@@ -0,0 +1,95 @@
+#include <math.h>
+#include "animation.h"
+
+AnimationClip::AnimationClip(int numJoints, int numKeys, float duration)
+    : numJoints_(numJoints), jointStride_((numJoints + QUAT_BATCH_WIDTH - 1) / QUAT_BATCH_WIDTH * QUAT_BATCH_WIDTH),
+      numKeys_(numKeys), duration_(duration), interpolation_(LINEAR_INTERPOLATION),
+      rotationW_(numKeys * jointStride_, 1.0f), rotationX_(numKeys * jointStride_, 0.0f),
+      rotationY_(numKeys * jointStride_, 0.0f), rotationZ_(numKeys * jointStride_, 0.0f),
+      translationX_(numKeys, 0.0f), translationY_(numKeys, 0.0f), translationZ_(numKeys, 0.0f) {
+    assert(numJoints > 0 && numJoints <= MAX_CLIP_JOINTS && numKeys > 0 && duration > 0);
+}
+
+void AnimationClip::setRotation(int key, int joint, const Quat &rotation) {
+    const int i = key * jointStride_ + joint;
+    rotationW_[i] = float(rotation[0]);
+    rotationX_[i] = float(rotation[1]);
+    rotationY_[i] = float(rotation[2]);
+    rotationZ_[i] = float(rotation[3]);
+}
+
+void AnimationClip::setRootTranslation(int key, const Cvec3 &translation) {
+    translationX_[key] = float(translation[0]);
+    translationY_[key] = float(translation[1]);
+    translationZ_[key] = float(translation[2]);
+}
+
+Quat AnimationClip::rotation(int key, int joint) const {
+    const int i = key * jointStride_ + joint;
+    return Quat(rotationW_[i], rotationX_[i], rotationY_[i], rotationZ_[i]);
+}
+
+ConstQuatArrays AnimationClip::keyRotations(int key) const {
+    const int i = key * jointStride_;
+    return ConstQuatArrays(&rotationW_[i], &rotationX_[i], &rotationY_[i], &rotationZ_[i]);
+}
+
+ConstQuatArrays AnimationClip::controlPoints(int key, int point) const {
+    const int i = (2 * key + point) * jointStride_;
+    return ConstQuatArrays(&controlW_[i], &controlX_[i], &controlY_[i], &controlZ_[i]);
+}
+
+void AnimationClip::setInterpolation(Interpolation interpolation) {
+    interpolation_ = interpolation;
+    if(interpolation != CATMULL_ROM_INTERPOLATION)
+        return;
+
+    // the two inner control points of the segment from every key to the next one,
+    // with the keys wrapping around since the clip loops
+    controlW_.assign(2 * numKeys_ * jointStride_, 1.0f);
+    controlX_.assign(controlW_.size(), 0.0f);
+    controlY_.assign(controlW_.size(), 0.0f);
+    controlZ_.assign(controlW_.size(), 0.0f);
+    const QuatArrays control = {&controlW_[0], &controlX_[0], &controlY_[0], &controlZ_[0]};
+    for(int k=0; k<numKeys_; k++) {
+        const int k0 = (k + numKeys_ - 1) % numKeys_, k2 = (k + 1) % numKeys_, k3 = (k + 2) % numKeys_;
+        for(int j=0; j<numJoints_; j++) {
+            Quat d, e;
+            catmullRomControlPoints(rotation(k0, j), rotation(k, j), rotation(k2, j), rotation(k3, j), d, e);
+            storeQuat(control, 2 * k * jointStride_ + j, d);
+            storeQuat(control, (2 * k + 1) * jointStride_ + j, e);
+        }
+    }
+}
+
+void AnimationClip::sample(float time, const QuatArrays &rotations, Cvec3 &rootTranslation) const {
+    float keyPosition = fmodf(time, duration_) * numKeys_ / duration_;
+    if(keyPosition < 0)
+        keyPosition += numKeys_;
+    const int key0 = std::min((int)keyPosition, numKeys_ - 1);
+    const int key1 = (key0 + 1) % numKeys_;
+    const float t = keyPosition - key0;
+
+    // all the joints of the clip at once, 4 or 8 per SIMD operation
+    if(interpolation_ == CATMULL_ROM_INTERPOLATION) {
+        float scratch[4][3 * MAX_CLIP_JOINTS];
+        const QuatArrays scratchArrays = {scratch[0], scratch[1], scratch[2], scratch[3]};
+        bezierQuats(keyRotations(key0), controlPoints(key0, 0), controlPoints(key0, 1), keyRotations(key1),
+                    t, rotations, scratchArrays, jointStride_);
+    }
+    else {
+        slerpQuats(keyRotations(key0), keyRotations(key1), t, rotations, jointStride_);
+    }
+
+    rootTranslation = Cvec3(translationX_[key0] + (translationX_[key1] - translationX_[key0]) * t,
+                            translationY_[key0] + (translationY_[key1] - translationY_[key0]) * t,
+                            translationZ_[key0] + (translationZ_[key1] - translationZ_[key0]) * t);
+}
+
+void AnimationClip::sample(float time, Quat rotations[], Cvec3 &rootTranslation) const {
+    float sampled[4][MAX_CLIP_JOINTS];
+    const QuatArrays sampledArrays = {sampled[0], sampled[1], sampled[2], sampled[3]};
+    sample(time, sampledArrays, rootTranslation);
+    for(int j=0; j<numJoints_; j++)
+        rotations[j] = Quat(sampled[0][j], sampled[1][j], sampled[2][j], sampled[3][j]);
+}
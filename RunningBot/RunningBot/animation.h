@@ -0,0 +1,94 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "quat.h"
+#include "quatbatch.h"
+
+// Upper bound of the joints of a clip, for the scratch space of AnimationClip::sample
+const int MAX_CLIP_JOINTS = 64;
+
+/**
+ * A looping keyframed animation of the joints of a skeleton. Keys are evenly spaced
+ * over the duration of the clip, every key holds a rotation for each joint and a
+ * translation of the root. The data is kept in structure of arrays layout, one
+ * float stream per quaternion component with the joints of a key next to each
+ * other, so that sampling walks two short runs of memory and is easy to vectorize.
+ *
+ * Rotations are slerped between neighbouring keys, or follow a Catmull-Rom spline
+ * through the keys for smoother motion from fewer keys. The spline control points
+ * only depend on the keys and are computed once by setInterpolation().
+ *
+ * Clips carry no code of their own, a new gait is just another set of keys
+ *
+ * Structure: AnimationClip
+ */
+class AnimationClip {
+public:
+    enum Interpolation {
+        LINEAR_INTERPOLATION,
+        CATMULL_ROM_INTERPOLATION
+    };
+
+    AnimationClip() : numJoints_(0), jointStride_(0), numKeys_(0), duration_(0.0f), interpolation_(LINEAR_INTERPOLATION) {}
+    AnimationClip(int numJoints, int numKeys, float duration);
+
+    int numJoints() const {
+        return numJoints_;
+    }
+
+    // Joints rounded up to QUAT_BATCH_WIDTH. The keys are padded with identity
+    // rotations to this many joints so that sampling never leaves the SIMD path,
+    // the destinations of sample() need room for as many
+    int jointStride() const {
+        return jointStride_;
+    }
+
+    int numKeys() const {
+        return numKeys_;
+    }
+
+    float duration() const {
+        return duration_;
+    }
+
+    Interpolation interpolation() const {
+        return interpolation_;
+    }
+
+    // Time of a key, keys are duration / numKeys apart starting at 0
+    float keyTime(int key) const {
+        return key * duration_ / numKeys_;
+    }
+
+    void setRotation(int key, int joint, const Quat &rotation);
+    void setRootTranslation(int key, const Cvec3 &translation);
+    Quat rotation(int key, int joint) const;
+
+    // Switches between slerp and the Catmull-Rom spline, call it after the keys are
+    // set since the spline control points are computed from them here
+    void setInterpolation(Interpolation interpolation);
+
+    // Samples the clip at the given time, wrapped around the duration, by
+    // interpolating between the neighbouring keys. rotations receives one entry
+    // per joint, the arrays version jointStride() entries
+    void sample(float time, Quat rotations[], Cvec3 &rootTranslation) const;
+    void sample(float time, const QuatArrays &rotations, Cvec3 &rootTranslation) const;
+
+private:
+    int numJoints_;
+    int jointStride_;
+    int numKeys_;
+    float duration_;
+    Interpolation interpolation_;
+    std::vector<float> rotationW_, rotationX_, rotationY_, rotationZ_;   // [key * jointStride + joint]
+    std::vector<float> controlW_, controlX_, controlY_, controlZ_;       // [(2 * key + {0, 1}) * jointStride + joint]
+    std::vector<float> translationX_, translationY_, translationZ_;      // [key]
+
+    ConstQuatArrays keyRotations(int key) const;
+    ConstQuatArrays controlPoints(int key, int point) const;
+};
+
+#endif
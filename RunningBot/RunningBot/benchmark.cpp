@@ -0,0 +1,420 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "benchmark.h"
+#include "bot.h"
+#include "crowd.h"
+#include "frameclock.h"
+#include "frustum.h"
+#include "geometrymaker.h"
+#include "meshoptimizer.h"
+#include "spherelod.h"
+#include "vertexformat.h"
+#include "jobsystem.h"
+#include "matrix4.h"
+#include "matrix4f.h"
+#include "quat.h"
+
+// Matrices cycled through by every benchmark, few enough to stay in the L1 cache
+static const int BENCH_MATRICES = 64;
+static const int BENCH_ITERATIONS = 2000000;
+
+// Results are accumulated here so that the compiler cannot drop the work
+static volatile double benchSink;
+
+// Every update of the crowd benchmarks stands for a 60 Hz frame, two animation steps
+// of a 120 Hz FrameClock, posed halfway between the last two
+static const int CROWD_FRAME_STEPS = 2;
+static const float CROWD_FRAME_INTERPOLATION = 0.5f;
+
+// Largest relative error of a Matrix4f operation against Matrix4 that still passes
+static const double MATRIX4F_TOLERANCE = 1e-5;
+
+static double randomInRange(double low, double high) {
+    return low + (high - low) * (rand() / double(RAND_MAX));
+}
+
+/**
+ * Function to build a random affine transform of the kind used by the bot hierarchy,
+ * a translation, a rotation and a non uniform scale
+ *
+ * Function: randomAffineMatrix
+ */
+static Matrix4 randomAffineMatrix() {
+    Quat rotation = normalize(Quat(randomInRange(-1, 1), randomInRange(-1, 1),
+                                   randomInRange(-1, 1), randomInRange(-1, 1)));
+    return Matrix4::makeTranslation(Cvec3(randomInRange(-10, 10), randomInRange(-10, 10), randomInRange(-10, 10))) *
+           quatToMatrix(rotation) *
+           Matrix4::makeScale(Cvec3(randomInRange(0.1, 3), randomInRange(0.1, 3), randomInRange(0.1, 3)));
+}
+
+/**
+ * Function to time an operation over the benchmark matrices
+ *
+ * Function: nanosecondsPerOp
+ *           op - Callable taking the index of the matrix to operate on
+ */
+template <class Op>
+static double nanosecondsPerOp(Op op) {
+    // warm up
+    for(int i=0; i<BENCH_ITERATIONS/10; i++)
+        op(i % BENCH_MATRICES);
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<BENCH_ITERATIONS; i++)
+        op(i % BENCH_MATRICES);
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / BENCH_ITERATIONS;
+}
+
+static void printResult(const char *name, double doubleNs, double floatNs) {
+    printf("%-28s %12.2f %12.2f %9.2fx\n", name, doubleNs, floatNs, doubleNs / floatNs);
+}
+
+/**
+ * Function to get the largest difference between the entries of a Matrix4f and the
+ * Matrix4 it stands in for, relative to the size of the entry
+ *
+ * Function: relativeError
+ */
+static double relativeError(const Matrix4f &f, const Matrix4 &d) {
+    double error = 0;
+    for(int i=0; i<4; i++) {
+        for(int j=0; j<4; j++)
+            error = std::max(error, std::abs(f(i,j) - d(i,j)) / std::max(1.0, std::abs(d(i,j))));
+    }
+    return error;
+}
+
+/**
+ * Function to print the largest relative error of an operation over the benchmark
+ * matrices. Returns whether it is within MATRIX4F_TOLERANCE
+ *
+ * Function: checkAccuracy
+ *           op - Callable taking the index of the matrix, returning the error there
+ */
+template <class Op>
+static bool checkAccuracy(const char *name, Op op) {
+    double error = 0;
+    for(int i=0; i<BENCH_MATRICES; i++)
+        error = std::max(error, op(i));
+    const bool passed = error <= MATRIX4F_TOLERANCE;
+    printf("%-28s %12.3g%s\n", name, error, passed ? "" : "  FAILED");
+    return passed;
+}
+
+int runMatrixBenchmarks() {
+    std::vector<Matrix4> a(BENCH_MATRICES), b(BENCH_MATRICES), r(BENCH_MATRICES);
+    std::vector<Matrix4f> af(BENCH_MATRICES), bf(BENCH_MATRICES), rf(BENCH_MATRICES);
+    for(int i=0; i<BENCH_MATRICES; i++) {
+        a[i] = randomAffineMatrix();
+        b[i] = randomAffineMatrix();
+        af[i] = Matrix4f(a[i]);
+        bf[i] = Matrix4f(b[i]);
+    }
+    float glmatrix[16];
+
+#if defined(MATRIX4F_AVX)
+    const char *simd = "AVX";
+#elif defined(MATRIX4F_SSE2)
+    const char *simd = "SSE2";
+#else
+    const char *simd = "scalar";
+#endif
+    printf("Matrix4 (double, row-major) vs Matrix4f (float, column-major, %s)\n", simd);
+    printf("%d iterations per operation, ns/op\n\n", BENCH_ITERATIONS);
+    printf("%-28s %12s %12s %10s\n", "operation", "Matrix4", "Matrix4f", "speedup");
+
+    double doubleNs = nanosecondsPerOp([&](int i) { r[i] = a[i] * b[i]; });
+    double floatNs = nanosecondsPerOp([&](int i) { rf[i] = af[i] * bf[i]; });
+    printResult("multiply", doubleNs, floatNs);
+
+    doubleNs = nanosecondsPerOp([&](int i) { r[i] = inv(a[i]); });
+    floatNs = nanosecondsPerOp([&](int i) { rf[i] = inv(af[i]); });
+    printResult("inv", doubleNs, floatNs);
+
+    doubleNs = nanosecondsPerOp([&](int i) { r[i] = transpose(a[i]); });
+    floatNs = nanosecondsPerOp([&](int i) { rf[i] = transpose(af[i]); });
+    printResult("transpose", doubleNs, floatNs);
+
+    doubleNs = nanosecondsPerOp([&](int i) { r[i] = normalMatrix(a[i]); });
+    floatNs = nanosecondsPerOp([&](int i) { rf[i] = normalMatrix(af[i]); });
+    printResult("normalMatrix", doubleNs, floatNs);
+
+    doubleNs = nanosecondsPerOp([&](int i) { a[i].writeToColumnMajorMatrix(glmatrix); benchSink = benchSink + glmatrix[i & 15]; });
+    floatNs = nanosecondsPerOp([&](int i) { af[i].writeToColumnMajorMatrix(glmatrix); benchSink = benchSink + glmatrix[i & 15]; });
+    printResult("writeToColumnMajorMatrix", doubleNs, floatNs);
+
+    // What the renderer does per body part: accumulate the model view matrix, derive
+    // the normal matrix and write both out for the upload
+    doubleNs = nanosecondsPerOp([&](int i) {
+        r[i] = a[i] * b[i];
+        r[i].writeToColumnMajorMatrix(glmatrix);
+        transpose(inv(r[i])).writeToColumnMajorMatrix(glmatrix);
+        benchSink = benchSink + glmatrix[i & 15];
+    });
+    floatNs = nanosecondsPerOp([&](int i) {
+        rf[i] = af[i] * bf[i];
+        rf[i].writeToColumnMajorMatrix(glmatrix);
+        transpose(inv(rf[i])).writeToColumnMajorMatrix(glmatrix);
+        benchSink = benchSink + glmatrix[i & 15];
+    });
+    printResult("per part (mul+inv+upload)", doubleNs, floatNs);
+
+    for(int i=0; i<BENCH_MATRICES; i++)
+        benchSink = benchSink + r[i][0] + rf[i][0];
+
+    // Matrix4f has to give the same results as Matrix4 up to float precision
+    printf("\nlargest relative error of Matrix4f against Matrix4 over %d random matrices (tolerance %g)\n",
+           BENCH_MATRICES, MATRIX4F_TOLERANCE);
+    bool passed = checkAccuracy("multiply", [&](int i) { return relativeError(af[i] * bf[i], a[i] * b[i]); });
+    passed &= checkAccuracy("inv", [&](int i) { return relativeError(inv(af[i]), inv(a[i])); });
+    passed &= checkAccuracy("transpose", [&](int i) { return relativeError(transpose(af[i]), transpose(a[i])); });
+    passed &= checkAccuracy("normalMatrix", [&](int i) { return relativeError(normalMatrix(af[i]), normalMatrix(a[i])); });
+    return passed ? 0 : 1;
+}
+
+int runCrowdScalingBenchmark(int numBots) {
+    const int numUpdates = 20;
+    RunningBot bot;
+    bot.build();
+    Crowd crowd;
+    crowd.spawn(bot, std::min(std::max(numBots, 1), MAX_CROWD_SIZE), 12.0f, 1);
+    std::vector<PartInstance> instances(crowd.size() * bot.skeleton.size());
+    const Affine3 viewMatrix(inv(Matrix4::makeTranslation(Cvec3(0.0, 0.0, 30.0 + crowd.extent))));
+    const Affine3 viewNormalMatrix = normalMatrix(viewMatrix);
+    const Cvec3 eyePosition(0.0, 0.0, 30.0 + crowd.extent);
+    // every bot at full detail, the levels of detail are timed on their own below
+    for(int i=0; i<NUM_BOT_LODS - 1; i++)
+        crowd.lodDistances[i] = 1e30f;
+
+    const int numCores = std::max(1, (int)std::thread::hardware_concurrency());
+    printf("Crowd update of %d bots, %d cores, %d updates per thread count\n\n", crowd.size(), numCores, numUpdates);
+    printf("%8s %12s %10s %11s\n", "threads", "ms/update", "speedup", "efficiency");
+
+    double singleThreadMs = 0.0;
+    for(int threads=1; threads<=numCores; threads++) {
+        JobSystem jobSystem(threads);
+        // warm up the threads and the caches
+        crowd.update(jobSystem, bot, 0, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                     Cvec3(), eyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        for(int i=0; i<numUpdates; i++)
+            crowd.update(jobSystem, bot, CROWD_FRAME_STEPS, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                         Cvec3(), eyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+        std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(end - start).count() / numUpdates;
+
+        if(threads == 1)
+            singleThreadMs = ms;
+        printf("%8d %12.3f %9.2fx %10.0f%%\n", threads, ms, singleThreadMs / ms, 100.0 * singleThreadMs / ms / threads);
+    }
+
+    // The same on one thread with every bot in the middle of a cross-fade between
+    // all three gait clips. The fades are frozen by updating without any steps
+    JobSystem jobSystem(1);
+    const int fadeGaits[] = {RUN_GAIT, WALK_GAIT, IDLE_GAIT};
+    for(int i=0; i<3; i++) {
+        crowd.setGait(fadeGaits[i]);
+        crowd.update(jobSystem, bot, 1, i == 0 ? GAIT_FADE_TIME : GAIT_FADE_TIME / 2, CROWD_FRAME_INTERPOLATION,
+                     Cvec3(), eyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+    }
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<numUpdates; i++)
+        crowd.update(jobSystem, bot, 0, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                     Cvec3(), eyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+    printf("\n%8d %12.3f ms/update blending 3 gait clips\n", 1,
+           std::chrono::duration<double, std::milli>(end - start).count() / numUpdates);
+
+    // And with the default levels of detail, seen from where the crowd mode puts the
+    // eye, 30 degrees above the crowd
+    for(int i=0; i<NUM_BOT_LODS - 1; i++)
+        crowd.lodDistances[i] = DEFAULT_LOD_DISTANCES[i];
+    const Cvec3 crowdEyePosition(0.0, (30.0 + crowd.extent) * 0.5, (30.0 + crowd.extent) * 0.866);
+    crowd.update(jobSystem, bot, CROWD_FRAME_STEPS, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                 Cvec3(), crowdEyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+    start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<numUpdates; i++)
+        crowd.update(jobSystem, bot, CROWD_FRAME_STEPS, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                     Cvec3(), crowdEyePosition, viewMatrix, viewNormalMatrix, Frustum(), &instances[0]);
+    end = std::chrono::high_resolution_clock::now();
+    printf("%8d %12.3f ms/update with LOD, %d full, %d reduced, %d low rate, %d impostor bots\n", 1,
+           std::chrono::duration<double, std::milli>(end - start).count() / numUpdates,
+           crowd.counts.lodCounts[FULL_BOT_LOD], crowd.counts.lodCounts[REDUCED_BOT_LOD],
+           crowd.counts.lodCounts[LOW_RATE_BOT_LOD], crowd.counts.lodCounts[IMPOSTOR_BOT_LOD]);
+
+    // And culled against the frustum of the default window, looking down at the
+    // crowd from the same eye
+    const Matrix4 crowdEyeMatrix = Matrix4::makeTranslation(crowdEyePosition) * quatToMatrix(Quat::makeXRotation(-30.0));
+    const Affine3 crowdViewMatrix(inv(crowdEyeMatrix));
+    const Affine3 crowdViewNormalMatrix = normalMatrix(crowdViewMatrix);
+    const Frustum frustum(Matrix4::makeProjection(45.0, 1280.0 / 800.0, -0.5, -1000.0));
+    crowd.update(jobSystem, bot, CROWD_FRAME_STEPS, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                 Cvec3(), crowdEyePosition, crowdViewMatrix, crowdViewNormalMatrix,
+                 frustum, &instances[0]);
+    start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<numUpdates; i++) {
+        crowd.update(jobSystem, bot, CROWD_FRAME_STEPS, SIMULATION_STEP_MS, CROWD_FRAME_INTERPOLATION,
+                     Cvec3(), crowdEyePosition, crowdViewMatrix, crowdViewNormalMatrix,
+                     frustum, &instances[0]);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    printf("%8d %12.3f ms/update with LOD and culling, %d culled bots, %d drawn and %d culled parts\n", 1,
+           std::chrono::duration<double, std::milli>(end - start).count() / numUpdates,
+           crowd.counts.culledBots, crowd.counts.drawnParts, crowd.counts.culledParts);
+
+    benchSink = benchSink + instances[0].modelViewMatrix[12];
+    return 0;
+}
+
+// Position and normal of a vertex of the geometry makers, as the renderer keeps them
+struct BenchVertex {
+    Cvec3f p, n;
+
+    BenchVertex& operator = (const GenericVertex &v) {
+        p = v.pos;
+        n = v.normal;
+        return *this;
+    }
+};
+
+static void printMeshResult(const char *name, std::vector<BenchVertex> vertices, std::vector<unsigned short> indices) {
+    const int numVertices = vertices.size(), numIndices = indices.size();
+    std::vector<unsigned short> overdrawIndices = indices, timedIndices = indices;
+    std::vector<int> remap;
+    const MeshOptimizationReport report = optimizeMesh(&indices[0], numIndices, &vertices[0].p[0], sizeof(BenchVertex),
+                                                       numVertices, false, remap);
+    const MeshOptimizationReport overdrawReport = optimizeMesh(&overdrawIndices[0], numIndices, &vertices[0].p[0],
+                                                               sizeof(BenchVertex), numVertices, true, remap);
+
+    const int numRuns = 20;
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(int i=0; i<numRuns; i++) {
+        std::copy(timedIndices.begin(), timedIndices.end(), indices.begin());
+        optimizeMesh(&indices[0], numIndices, &vertices[0].p[0], sizeof(BenchVertex), numVertices, false, remap);
+    }
+    std::chrono::high_resolution_clock::time_point end = std::chrono::high_resolution_clock::now();
+
+    printf("%-13s %9d %7.3f -> %5.3f %7.3f -> %5.3f %10.3f %10.1f\n", name, numIndices / 3,
+           report.before.acmr, report.after.acmr, report.before.atvr, report.after.atvr, overdrawReport.after.acmr,
+           std::chrono::duration<double, std::micro>(end - start).count() / numRuns);
+}
+
+int runMeshBenchmark() {
+    printf("Vertex cache efficiency, FIFO cache of %d vertices\n\n", DEFAULT_STATS_CACHE_SIZE);
+    printf("%-13s %9s %16s %16s %10s %10s\n", "mesh", "triangles", "ACMR", "ATVR", "+overdraw", "us");
+    for(int i=0; i<NUM_SPHERE_LODS; i++) {
+        int vbLen, ibLen;
+        getSphereVbIbLen(SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, vbLen, ibLen);
+        std::vector<BenchVertex> vertices(vbLen);
+        std::vector<unsigned short> indices(ibLen);
+        makeSphere(BOT_PART_RADIUS, SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, vertices.begin(), indices.begin());
+        char name[32];
+        snprintf(name, sizeof(name), "sphere %dx%d", SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks);
+        printMeshResult(name, vertices, indices);
+    }
+    int vbLen, ibLen;
+    getCubeVbIbLen(vbLen, ibLen);
+    std::vector<BenchVertex> vertices(vbLen);
+    std::vector<unsigned short> indices(ibLen);
+    makeCube(1.0f, vertices.begin(), indices.begin());
+    printMeshResult("cube", vertices, indices);
+
+    // Size of every vertex format and the largest error its encoding makes on the
+    // vertices of all the levels of the sphere, decoded as the vertex shader does
+    std::vector<GenericVertex> sphereVertices;
+    for(int i=0; i<NUM_SPHERE_LODS; i++) {
+        getSphereVbIbLen(SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, vbLen, ibLen);
+        std::vector<GenericVertex> levelVertices(vbLen);
+        std::vector<unsigned short> levelIndices(ibLen);
+        makeSphere(BOT_PART_RADIUS, SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, levelVertices.begin(),
+                   levelIndices.begin());
+        sphereVertices.insert(sphereVertices.end(), levelVertices.begin(), levelVertices.end());
+    }
+    const int numVertices = sphereVertices.size();
+    const int floatBytes = VERTEX_FORMATS[VERTEX_FORMAT_FLOAT].stride + VERTEX_FORMATS[VERTEX_FORMAT_FLOAT].colorStride;
+    printf("\nVertex formats, %d sphere vertices\n\n", numVertices);
+    printf("%-13s %9s %9s %16s %16s\n", "format", "bytes", "vs float", "position error", "normal error deg");
+    for(int i=0; i<NUM_VERTEX_FORMATS; i++) {
+        const VertexFormat &format = VERTEX_FORMATS[i];
+        const float scale = vertexPositionScale(format, &sphereVertices[0], numVertices);
+        std::vector<unsigned char> encoded(format.stride * numVertices);
+        encodeVertices(format, &sphereVertices[0], numVertices, scale, &encoded[0]);
+        double positionError = 0.0, normalError = 0.0;
+        for(int j=0; j<numVertices; j++) {
+            Cvec3f position, normal;
+            decodeVertex(format, &encoded[format.stride * j], scale, position, normal);
+            positionError = std::max(positionError, (double)norm(position - sphereVertices[j].pos));
+            // The angle from its sine and cosine stays accurate when it is tiny
+            const Cvec3f a = normalize(normal), b = normalize(sphereVertices[j].normal);
+            normalError = std::max(normalError, atan2(norm(cross(a, b)), dot(a, b)) * 180.0 / M_PI);
+        }
+        const int bytes = format.stride + format.colorStride;
+        printf("%-13s %9d %8.2fx %16.6f %16.4f\n", format.name, bytes, double(floatBytes) / bytes, positionError,
+               normalError);
+    }
+    return 0;
+}
+
+/**
+ * Function to get the value below which the given fraction of the sorted samples
+ * fall, using the nearest rank
+ *
+ * Function: percentile
+ */
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    if(sorted.empty())
+        return 0.0;
+    size_t rank = (size_t)ceil(fraction * sorted.size());
+    return sorted[std::min(sorted.size(), std::max(rank, (size_t)1)) - 1];
+}
+
+/**
+ * Function to write a string as a JSON string literal
+ *
+ * Function: writeJsonString
+ */
+static void writeJsonString(FILE *file, const char *s) {
+    fputc('"', file);
+    for(; s && *s; s++) {
+        if(*s == '"' || *s == '\\')
+            fprintf(file, "\\%c", *s);
+        else if((unsigned char)*s < 0x20)
+            fprintf(file, "\\u%04x", *s);
+        else
+            fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+void writeBenchmarkJson(FILE *file, const char *renderer, int width, int height, double frameTime,
+                        const std::vector<StageTimings> &stages) {
+    size_t numFrames = stages.empty() ? 0 : stages[0].milliseconds.size();
+    
+    fprintf(file, "{\n  \"renderer\": ");
+    writeJsonString(file, renderer);
+    fprintf(file, ",\n  \"width\": %d,\n  \"height\": %d,\n", width, height);
+    fprintf(file, "  \"frames\": %zu,\n  \"frame_time_ms\": %.6f,\n", numFrames, frameTime);
+    fprintf(file, "  \"stages\": {");
+    for(size_t i=0; i<stages.size(); i++) {
+        std::vector<double> sorted = stages[i].milliseconds;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0.0;
+        for(size_t j=0; j<sorted.size(); j++)
+            sum += sorted[j];
+        
+        fprintf(file, "%s\n    ", i ? "," : "");
+        writeJsonString(file, stages[i].name);
+        fprintf(file, ": {\"min_ms\": %.6f, \"median_ms\": %.6f, \"p99_ms\": %.6f, \"mean_ms\": %.6f, \"max_ms\": %.6f}",
+                sorted.empty() ? 0.0 : sorted.front(), percentile(sorted, 0.5), percentile(sorted, 0.99),
+                sorted.empty() ? 0.0 : sum / sorted.size(), sorted.empty() ? 0.0 : sorted.back());
+    }
+    fprintf(file, "\n  }\n}\n");
+}
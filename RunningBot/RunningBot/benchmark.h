@@ -0,0 +1,60 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <cstdio>
+#include <vector>
+
+/**
+ * Microbenchmarks of the double precision, row-major Matrix4 against the SIMD
+ * Matrix4f for the operations the renderer performs per body part. Prints the time
+ * per operation of both and the speedup, then the largest relative error of the
+ * Matrix4f results. Returns the process exit code, nonzero when an error is too large
+ *
+ * Function: runMatrixBenchmarks
+ */
+int runMatrixBenchmarks();
+
+/**
+ * Scaling of the parallel crowd update: poses a crowd of the given size with 1 up
+ * to all the cores of the machine and prints the time per update, the speedup and
+ * the parallel efficiency of every thread count. Returns the process exit code
+ *
+ * Function: runCrowdScalingBenchmark
+ */
+int runCrowdScalingBenchmark(int numBots);
+
+/**
+ * Vertex cache efficiency of the meshes of the geometry makers, every level of the
+ * sphere and the cube, before and after the mesh optimization, with and without
+ * the overdraw order, and the time the optimization takes, then the size of every
+ * vertex format and the error its quantization makes. Returns the process exit code
+ *
+ * Function: runMeshBenchmark
+ */
+int runMeshBenchmark();
+
+/**
+ * The per frame timings of one stage of a frame benchmark, in milliseconds
+ *
+ * Structure: StageTimings
+ */
+struct StageTimings {
+    const char *name;
+    std::vector<double> milliseconds;
+};
+
+/**
+ * Function to write the min, median, p99, mean and max of every stage as a JSON
+ * object, so that results can be compared across builds by a script
+ *
+ * Function: writeBenchmarkJson
+ *           file - Where to write, e.g. stdout
+ *           renderer - GL_RENDERER string of the context the frames were rendered with
+ *           width, height - Framebuffer size
+ *           frameTime - Synthetic animation time step per frame in milliseconds
+ *           stages - Timings of every stage, all with one entry per frame
+ */
+void writeBenchmarkJson(FILE *file, const char *renderer, int width, int height, double frameTime,
+                        const std::vector<StageTimings> &stages);
+
+#endif
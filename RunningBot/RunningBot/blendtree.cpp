@@ -0,0 +1,104 @@
+#include <math.h>
+#include "blendtree.h"
+
+/**
+ * Function to start a cross-fade from the current blend of the clips to a gait
+ *
+ * Function: setGait
+ *           newGait - Gait to fade into
+ */
+void GaitState::setGait(int newGait) {
+    if(newGait == gait)
+        return;
+    weights(fadeWeights);
+    gait = newGait;
+    fade = 0.0f;
+}
+
+/**
+ * Function to get the weight of every gait clip, eased in and out over the fade
+ *
+ * Function: weights
+ *           gaitWeights - Destination, the weights add up to 1
+ */
+void GaitState::weights(float gaitWeights[NUM_GAITS]) const {
+    const float s = fade * fade * (3.0f - 2.0f * fade);
+    for(int i=0; i<NUM_GAITS; i++)
+        gaitWeights[i] = fadeWeights[i] * (1.0f - s) + (i == gait ? s : 0.0f);
+}
+
+/**
+ * Function to move a bot forward in its animation. The gait phase advances at the
+ * cycle rate of the blended clips, the fades at a fixed rate
+ *
+ * Function: advance
+ *           state - Animation state of the bot
+ *           elapsedTime - Animation time since the last advance in milliseconds
+ *           frameSpeed - Slowdown of the clips, as for the procedural animation
+ */
+void BlendTree::advance(GaitState &state, float elapsedTime, float frameSpeed) const {
+    float weights[NUM_GAITS];
+    state.weights(weights);
+    float cycleRate = 0.0f;
+    for(int i=0; i<NUM_GAITS; i++)
+        cycleRate += weights[i] / gaits[i].duration();
+    state.phase = fmodf(state.phase + elapsedTime / frameSpeed * cycleRate, 1.0f);
+
+    const float fadeStep = elapsedTime / GAIT_FADE_TIME;
+    state.fade = std::min(state.fade + fadeStep, 1.0f);
+    state.additiveWeight = state.additive ? std::min(state.additiveWeight + fadeStep, 1.0f) :
+                                            std::max(state.additiveWeight - fadeStep, 0.0f);
+    state.additiveTime = fmodf(state.additiveTime + elapsedTime / frameSpeed, additive.duration());
+}
+
+/**
+ * Function to blend the pose of a bot in a single pass over the joint arrays: every
+ * gait clip with a weight is sampled and accumulated into a weighted nlerp, then
+ * the additive layer, scaled by its weight, is applied on top
+ *
+ * Function: evaluate
+ *           state - Animation state of the bot
+ *           rotations - Destination, one rotation per joint padded to the joint
+ *                       stride of the clips
+ *           rootTranslation - Destination, the blended translation of the root
+ */
+void BlendTree::evaluate(const GaitState &state, const QuatArrays &rotations, Cvec3 &rootTranslation) const {
+    // the padding joints are blended too, which keeps every loop on the SIMD path
+    const int numJoints = gaits[0].jointStride();
+    for(int j=0; j<numJoints; j++) {
+        rotations.w[j] = rotations.x[j] = rotations.y[j] = rotations.z[j] = 0.0f;
+    }
+    rootTranslation = Cvec3();
+
+    float sampled[4][MAX_CLIP_JOINTS];
+    const QuatArrays sampledArrays = {sampled[0], sampled[1], sampled[2], sampled[3]};
+    Cvec3 translation;
+
+    float weights[NUM_GAITS];
+    state.weights(weights);
+    for(int i=0; i<NUM_GAITS; i++) {
+        if(weights[i] <= 0.0f)
+            continue;
+        gaits[i].sample(state.phase * gaits[i].duration(), sampledArrays, translation);
+        accumulateQuats(sampledArrays, weights[i], rotations, numJoints);
+        rootTranslation += translation * weights[i];
+    }
+    normalizeQuats(rotations, numJoints);
+
+    if(state.additiveWeight <= 0.0f)
+        return;
+
+    // nlerp of every additive rotation from the identity by the layer weight. The
+    // additive clip only adds rotations, its root translation is ignored
+    const float weight = state.additiveWeight;
+    additive.sample(state.additiveTime, sampledArrays, translation);
+    for(int j=0; j<numJoints; j++) {
+        const float w = sampled[0][j] < 0 ? -weight : weight;
+        sampled[0][j] = 1.0f - weight + w * sampled[0][j];
+        sampled[1][j] *= w;
+        sampled[2][j] *= w;
+        sampled[3][j] *= w;
+    }
+    normalizeQuats(sampledArrays, numJoints);
+    multiplyQuats(rotations, sampledArrays, rotations, numJoints);
+}
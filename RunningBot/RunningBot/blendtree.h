@@ -0,0 +1,66 @@
+#ifndef BLENDTREE_H
+#define BLENDTREE_H
+
+#include "cvec.h"
+#include "animation.h"
+#include "quatbatch.h"
+
+enum Gait {
+    IDLE_GAIT,
+    WALK_GAIT,
+    RUN_GAIT,
+    NUM_GAITS
+};
+
+// Length of the cross-fade from one gait to another and of fading the additive
+// layer in or out, in milliseconds of animation time
+const float GAIT_FADE_TIME = 300.0f;
+
+/**
+ * Where a bot is in its animation. All the gait clips are played at the same
+ * normalized phase, so the feet of a walk and a run fading into each other land
+ * together, and the phase advances at the weighted rate of the clips instead of
+ * being derived from the absolute time, so changing speed or gait never makes the
+ * pose jump.
+ *
+ * A change of gait cross-fades from the weights of the moment to the new gait, so
+ * a change in the middle of a fade continues smoothly as well, with up to all
+ * three clips blended at once
+ *
+ * Structure: GaitState
+ */
+struct GaitState {
+    int gait;                           // gait the bot is in or fading into
+    float fadeWeights[NUM_GAITS];       // weights when the fade into gait started
+    float fade;                         // progress of the fade into gait, 0 to 1
+    float phase;                        // normalized position in the gait cycle, 0 to 1
+    bool additive;                      // whether the additive layer is fading in or out
+    float additiveWeight;
+    float additiveTime;                 // clip time of the additive layer
+
+    GaitState() : gait(RUN_GAIT), fade(1.0f), phase(0.0f), additive(false), additiveWeight(0.0f), additiveTime(0.0f) {
+        for(int i=0; i<NUM_GAITS; i++)
+            fadeWeights[i] = 0.0f;
+    }
+
+    void setGait(int newGait);
+    void weights(float gaitWeights[NUM_GAITS]) const;
+};
+
+/**
+ * A fixed blend tree over the joints of a skeleton: the gait clips, blended by
+ * the weights of a GaitState, with a looping additive clip on top whose keys are
+ * rotations relative to the blended pose. Clips are played in units of
+ * time/frameSpeed like the procedural animation was
+ *
+ * Structure: BlendTree
+ */
+struct BlendTree {
+    AnimationClip gaits[NUM_GAITS];
+    AnimationClip additive;
+
+    void advance(GaitState &state, float elapsedTime, float frameSpeed) const;
+    void evaluate(const GaitState &state, const QuatArrays &rotations, Cvec3 &rootTranslation) const;
+};
+
+#endif
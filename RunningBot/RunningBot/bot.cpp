@@ -0,0 +1,437 @@
+#include <math.h>
+#include "bot.h"
+#include "quat.h"
+
+/**
+ * Function to restrict the motion of a body part to an angle and to perform the rotation
+ * cycles continuously rather than a sudden complete switch of the offset angle
+ *
+ * Function: calculateTimeAngle
+ * anglePerRev - Offset angle after which the motion repeats smoothly
+ * timeSinceStart - Variable which is applied as an angle
+ */
+float calculateTimeAngle(float anglePerRev, float timeSinceStart) {
+    float timeCrunch = timeSinceStart/anglePerRev;
+    float finalAngle = 0.0;
+    int revolution = floor(timeCrunch);
+    // revolution + 1 rather than ceil(timeCrunch), which is the same except at the
+    // turning points, where ceil() would drop the angle from anglePerRev to 0
+    if(revolution%2 == 0)
+        finalAngle = ((timeCrunch) - floor(timeCrunch))*anglePerRev;
+    else
+        finalAngle = (revolution + 1 - timeCrunch)*anglePerRev;
+    return finalAngle;
+}
+
+/**
+ * Function to add a swinging body part to the skeleton. The rotation is applied about
+ * the shifted axis, i.e. the node matrix is
+ * axisShift * preMatrix * rotation * postMatrix * inv(axisShift)
+ *
+ * Function: addJoint
+ *           skeleton - Scene graph the part is added to
+ *           joint - Joint to be filled in
+ *           parent - Immediate hierarchical parent
+ *           axis - Axis of the rotation, 0 - X, 1 - Y, 2 - Z
+ *           preMatrix, postMatrix - Constant transforms on either side of the rotation
+ *           axisShift - Y offset of the rotation axis from the center of the part
+ */
+static int addJoint(SceneGraph &skeleton, BotJoint &joint, int parent, int axis,
+                    const Matrix4 &preMatrix, const Matrix4 &postMatrix, double axisShift) {
+    const Matrix4 axisShiftMatrix = Matrix4::makeTranslation(Cvec3(0.0, axisShift, 0.0));
+    joint.axis = axis;
+    joint.preMatrix = Affine3(axisShiftMatrix * preMatrix);
+    joint.postMatrix = Affine3(postMatrix * inv(axisShiftMatrix));
+    joint.preNormalMatrix = normalMatrix(joint.preMatrix);
+    joint.postNormalMatrix = normalMatrix(joint.postMatrix);
+    joint.node = skeleton.addNode(parent, joint.preMatrix * joint.postMatrix);
+    return joint.node;
+}
+
+/**
+ * Function to add a body part that does not move with respect to its parent
+ *
+ * Function: addRigidPart
+ *           skeleton - Scene graph the part is added to
+ *           parent - Immediate hierarchical parent
+ *           objectMatrix - Object matrix with respect to the parent frame
+ *           axisShift - Y offset of the axis the part has been placed about
+ */
+static int addRigidPart(SceneGraph &skeleton, int parent, const Matrix4 &objectMatrix, double axisShift = 0.0) {
+    const Matrix4 axisShiftMatrix = Matrix4::makeTranslation(Cvec3(0.0, axisShift, 0.0));
+    return skeleton.addNode(parent, Affine3(axisShiftMatrix * objectMatrix * inv(axisShiftMatrix)));
+}
+
+void RunningBot::build() {
+    std::vector<int> details;
+
+    // ------------------------------- TRUNK -------------------------------
+    trunkNode = skeleton.addNode(-1, Affine3::makeScale(Cvec3(2.0, 3.0, 1.0)));
+
+    // ------------------------------- HEAD -------------------------------
+    int headNode = addJoint(skeleton, joints[HEAD_JOINT], trunkNode, 1,
+                            Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
+                            Matrix4::makeTranslation(Cvec3(0.0, 4.8, 0.0)),
+                            Matrix4::makeScale(Cvec3(1.0, 1.2, 1.0)), 0.0);
+
+    // ------------------------------ EYES -------------------------------
+    for(int i=0; i<2; i++) {
+        addRigidPart(skeleton, headNode,
+                     Matrix4::makeScale(Cvec3(1.0/1.0, 1.0/1.2, 1.0/1.0)) *
+                     Matrix4::makeTranslation(Cvec3(0.7 - (1.4*i), 0.4, 1.0)) *
+                     Matrix4::makeScale(Cvec3(1.0/5.0, 1.0/5.0, 1.0/5.0)));
+    }
+
+    // ------------------------------- ARMS -------------------------------
+    // i == 0 is the right arm, i == 1 the left arm
+    for(int i=0; i<2; i++) {
+        int armNode = addJoint(skeleton, joints[i == 0 ? RIGHT_ARM_JOINT : LEFT_ARM_JOINT], trunkNode, 0,
+                               Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
+                               Matrix4::makeTranslation(Cvec3(i == 0 ? 2.8 : -2.8, 5.0, 0.0)) *
+                               quatToMatrix(Quat::makeXRotation(180.0)),
+                               Matrix4::makeScale(Cvec3(1.0/1.8, 1.5, 1.0)), -1.0);
+
+        int elbowNode = addRigidPart(skeleton, armNode,
+                                     Matrix4::makeScale(Cvec3(1.8, 1.0/1.5, 1.0)) *
+                                     Matrix4::makeTranslation(Cvec3(0.001, 3.0, 0.0)) *
+                                     quatToMatrix(Quat::makeXRotation(-45.0)) *
+                                     Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0)), -1.0);
+
+        for(int j=0; j<4; j++) {
+            details.push_back(addRigidPart(skeleton, elbowNode,
+                                           Matrix4::makeScale(Cvec3(2.0, 1.0/1.5, 1.0)) *
+                                           Matrix4::makeTranslation(Cvec3(0.0, 1.6, 0.7-(0.5*j))) *
+                                           Matrix4::makeScale(Cvec3(1.0/5.0, 1.0/2.0, 1.0/5.0))));
+        }
+    }
+
+    // ------------------------------- LEGS -------------------------------
+    // i == 0 is the right leg, i == 1 the left leg
+    for(int i=0; i<2; i++) {
+        int thighNode = addJoint(skeleton, joints[i == 0 ? RIGHT_THIGH_JOINT : LEFT_THIGH_JOINT], trunkNode, 0,
+                                 Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
+                                 Matrix4::makeTranslation(Cvec3(i == 0 ? -1.5 : 1.5, -6.0, 0.0)),
+                                 Matrix4::makeScale(Cvec3(1.0/1.5, 1.5, 1.0)), 1.0);
+
+        int kneeNode = addJoint(skeleton, joints[i == 0 ? RIGHT_KNEE_JOINT : LEFT_KNEE_JOINT], thighNode, 0,
+                                Matrix4::makeScale(Cvec3(1.5, 1.0/1.5, 1.0)) *
+                                Matrix4::makeTranslation(Cvec3(0.001, -3.0, 0.0)),
+                                Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0)), 1.0);
+
+        for(int j=0; j<3; j++) {
+            details.push_back(addRigidPart(skeleton, kneeNode,
+                                           Matrix4::makeScale(Cvec3(2.0, 1/1.5, 1.0)) *
+                                           Matrix4::makeTranslation(Cvec3(0.4-(0.4*j), -1.8, 0.8)) *
+                                           Matrix4::makeScale(Cvec3(1.0/8.0, 1.0/8.0, 1.0/2.0))));
+        }
+    }
+
+    nodeJoints.assign(skeleton.size(), -1);
+    for(int i=0; i<NUM_BOT_JOINTS; i++)
+        nodeJoints[joints[i].node] = i;
+
+    // the fingers and toes are leaves, so leaving them out never orphans a node
+    detailNodes.assign(skeleton.size(), false);
+    for(size_t i=0; i<details.size(); i++)
+        detailNodes[details[i]] = true;
+    numCoarseNodes = skeleton.size() - (int)details.size();
+
+    // bounds of the parts of the bot standing at rest, the sphere of a part
+    // reaches BOT_PART_RADIUS times the length of a row of its matrix along
+    // that axis
+    skeleton.update(Affine3(), Affine3());
+    Cvec3 low(1e30, 1e30, 1e30), high(-1e30, -1e30, -1e30);
+    for(int i=0; i<skeleton.size(); i++) {
+        const Affine3 &m = skeleton[i].modelViewMatrix;
+        for(int k=0; k<3; k++) {
+            const double reach = BOT_PART_RADIUS * sqrt(m(k,0)*m(k,0) + m(k,1)*m(k,1) + m(k,2)*m(k,2));
+            low[k] = std::min(low[k], m(k,3) - reach);
+            high[k] = std::max(high[k], m(k,3) + reach);
+        }
+    }
+    impostorMatrix = Affine3::makeTranslation((low + high) * 0.5) *
+                     Affine3::makeScale((high - low) * (0.5 / BOT_PART_RADIUS));
+    impostorNormalMatrix = normalMatrix(impostorMatrix);
+
+    // the walk swings about half as far as the run, idling barely moves the arms
+    // and the head and only breathes
+    const float runScales[NUM_BOT_JOINTS] = {1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f, 1.0f};
+    const float walkScales[NUM_BOT_JOINTS] = {0.2f, 0.45f, 0.45f, 0.6f, 0.45f, 0.45f, 0.6f};
+    const float idleScales[NUM_BOT_JOINTS] = {0.1f, 0.06f, 0.0f, 0.0f, 0.06f, 0.0f, 0.0f};
+    animation.gaits[RUN_GAIT] = bakeGaitClip(RUN_CLIP_KEYS, RUN_CYCLE_LENGTH, runScales, 0.0f);
+    animation.gaits[WALK_GAIT] = bakeGaitClip(RUN_CLIP_KEYS, WALK_CYCLE_LENGTH, walkScales, 0.15f);
+    animation.gaits[IDLE_GAIT] = bakeGaitClip(RUN_CLIP_KEYS, IDLE_CYCLE_LENGTH, idleScales, 0.1f);
+    animation.additive = bakeWaveClip(WAVE_CLIP_KEYS);
+    boundingRadius = computeBoundingRadius();
+}
+
+/**
+ * Function to bound the parts of the bot in every key of every gait clip, with and
+ * without every key of the additive clip on top, by a sphere around the position
+ * of the bot
+ *
+ * Function: computeBoundingRadius
+ */
+float RunningBot::computeBoundingRadius() const {
+    const int jointStride = animation.gaits[0].jointStride();
+    float rotations[4][MAX_CLIP_JOINTS], additive[4][MAX_CLIP_JOINTS];
+    const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+    const QuatArrays additiveArrays = {additive[0], additive[1], additive[2], additive[3]};
+    std::vector<PartInstance> instances(skeleton.size());
+    float radius = 0.0f;
+    for(int g=0; g<NUM_GAITS; g++) {
+        const AnimationClip &clip = animation.gaits[g];
+        for(int k=0; k<clip.numKeys(); k++) {
+            for(int a=-1; a<animation.additive.numKeys(); a++) {
+                Cvec3 rootTranslation, additiveTranslation;
+                clip.sample(clip.keyTime(k), rotationArrays, rootTranslation);
+                if(a >= 0) {
+                    animation.additive.sample(animation.additive.keyTime(a), additiveArrays, additiveTranslation);
+                    multiplyQuats(rotationArrays, additiveArrays, rotationArrays, jointStride);
+                }
+                const int numInstances = writePoseInstances(rotationArrays, rootTranslation, Cvec3(), Affine3(), Affine3(),
+                                                            true, NULL, &instances[0]);
+                for(int i=0; i<numInstances; i++) {
+                    const float *m = instances[i].modelViewMatrix;
+                    Affine3 partMatrix;
+                    for(int r=0; r<3; r++) {
+                        for(int c=0; c<3; c++)
+                            partMatrix(r,c) = m[4*c + r];
+                    }
+                    radius = std::max(radius, sqrtf(m[12]*m[12] + m[13]*m[13] + m[14]*m[14]) + partBoundingRadius(partMatrix));
+                }
+            }
+        }
+    }
+    return radius * BOT_BOUNDS_MARGIN;
+}
+
+/**
+ * Function to compute the angle of every joint at the given time of the run cycle
+ *
+ * Function: calculateJointAngles
+ *           angles - Destination, one angle in degrees for every BotJointId
+ */
+static void calculateJointAngles(float timeSinceStart, float frameSpeed, float angles[NUM_BOT_JOINTS]) {
+    const float swingAngle = calculateTimeAngle(90, timeSinceStart/frameSpeed);
+    const float kneeAngle = calculateTimeAngle(45, timeSinceStart/frameSpeed);
+
+    angles[HEAD_JOINT] = 45 - swingAngle;
+    angles[RIGHT_ARM_JOINT] = 45 - swingAngle;
+    angles[RIGHT_THIGH_JOINT] = 45 - swingAngle;
+    angles[RIGHT_KNEE_JOINT] = 45 - kneeAngle;
+    angles[LEFT_ARM_JOINT] = swingAngle - 45;
+    angles[LEFT_THIGH_JOINT] = swingAngle - 45;
+    angles[LEFT_KNEE_JOINT] = 45 - kneeAngle;
+}
+
+/**
+ * Function to build the object matrix of a joint with the given rotation and its
+ * normal matrix
+ *
+ * Function: calculateJointMatrices
+ */
+static void calculateJointMatrices(const BotJoint &joint, const Quat &rotation, Affine3 &objectMatrix, Affine3 &objectNormalMatrix) {
+    const Affine3 rotationMatrix = Affine3::makeRotation(rotation);
+    objectMatrix = joint.preMatrix * rotationMatrix * joint.postMatrix;
+    objectNormalMatrix = joint.preNormalMatrix * rotationMatrix * joint.postNormalMatrix;
+}
+
+/**
+ * Function to get the rotation of a joint about its axis by the given angle
+ *
+ * Function: jointRotation
+ */
+static Quat jointRotation(const BotJoint &joint, float angle) {
+    return joint.axis == 0 ? Quat::makeXRotation(angle) :
+           joint.axis == 1 ? Quat::makeYRotation(angle) :
+                             Quat::makeZRotation(angle);
+}
+
+/**
+ * Function to bake a gait cycle into a clip: the run cycle stretched to cycleLength,
+ * with the swing of every joint scaled down, and the trunk bobbing up and down
+ * twice per cycle, once per step
+ *
+ * Function: bakeGaitClip
+ *           numKeys - Keys of the clip
+ *           cycleLength - Duration of the clip in units of timeSinceStart/frameSpeed
+ *           jointScales - Factor of the run angle of every joint
+ *           bob - Height of the bob of the trunk
+ */
+AnimationClip RunningBot::bakeGaitClip(int numKeys, float cycleLength, const float jointScales[NUM_BOT_JOINTS], float bob) const {
+    AnimationClip clip(NUM_BOT_JOINTS, numKeys, cycleLength);
+    for(int k=0; k<numKeys; k++) {
+        // the same phase of the run cycle, which runs at a frameSpeed of 1
+        const float phase = clip.keyTime(k) / cycleLength;
+        float angles[NUM_BOT_JOINTS];
+        calculateJointAngles(phase * RUN_CYCLE_LENGTH, 1.0f, angles);
+        for(int i=0; i<NUM_BOT_JOINTS; i++)
+            clip.setRotation(k, i, jointRotation(joints[i], angles[i] * jointScales[i]));
+        clip.setRootTranslation(k, Cvec3(0.0, bob * 0.5 * (1.0 - cos(4.0 * CS175_PI * phase)), 0.0));
+    }
+    return clip;
+}
+
+/**
+ * Function to bake the additive wave, the right arm raised sideways and swinging
+ * back and forth. Every other joint keeps the identity, which adds nothing
+ *
+ * Function: bakeWaveClip
+ *           numKeys - Keys of the clip
+ */
+AnimationClip RunningBot::bakeWaveClip(int numKeys) const {
+    AnimationClip clip(NUM_BOT_JOINTS, numKeys, WAVE_CYCLE_LENGTH);
+    for(int k=0; k<numKeys; k++)
+        clip.setRotation(k, RIGHT_ARM_JOINT, Quat::makeZRotation(-130.0 - calculateTimeAngle(30, clip.keyTime(k))));
+    return clip;
+}
+
+/**
+ * Function to evaluate the blend tree of a bot into its joint rotations
+ *
+ * Function: evaluatePose
+ *           rotations - Destination, room for animation.gaits[0].jointStride() joints
+ */
+void RunningBot::evaluatePose(const GaitState &state, const QuatArrays &rotations, Cvec3 &rootTranslation) const {
+    animation.evaluate(state, rotations, rootTranslation);
+}
+
+/**
+ * Function to evaluate the pose a bot is drawn with between two steps of its
+ * animation, slerping the joints and lerping the root from the pose of the state
+ * before the step to the pose of the state after it
+ *
+ * Function: evaluateBlendedPose
+ *           previous, current - Animation state before and after the last step
+ *           t - Fraction of the way from previous to current, 0 to 1
+ *           rotations - Destination, room for animation.gaits[0].jointStride() joints
+ */
+void RunningBot::evaluateBlendedPose(const GaitState &previous, const GaitState &current, float t,
+                                     const QuatArrays &rotations, Cvec3 &rootTranslation) const {
+    evaluatePose(previous, rotations, rootTranslation);
+    if(t <= 0.0f)
+        return;
+    float currentRotations[4][MAX_CLIP_JOINTS];
+    const QuatArrays currentArrays = {currentRotations[0], currentRotations[1], currentRotations[2], currentRotations[3]};
+    Cvec3 currentRootTranslation;
+    evaluatePose(current, currentArrays, currentRootTranslation);
+    slerpQuats(rotations, currentArrays, t, rotations, animation.gaits[0].jointStride());
+    rootTranslation = rootTranslation + (currentRootTranslation - rootTranslation) * t;
+}
+
+void RunningBot::pose(const GaitState &state, const Cvec3 &position) {
+    float rotations[4][MAX_CLIP_JOINTS];
+    const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+    Cvec3 rootTranslation;
+    evaluatePose(state, rotationArrays, rootTranslation);
+    pose(rotationArrays, rootTranslation, position);
+}
+
+void RunningBot::pose(const QuatArrays &rotations, const Cvec3 &rootTranslation, const Cvec3 &position) {
+    skeleton.setObjectMatrix(trunkNode,
+                             Affine3::makeTranslation(position + rootTranslation) * Affine3::makeScale(Cvec3(2.0, 3.0, 1.0)),
+                             Affine3::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)));
+
+    for(int i=0; i<NUM_BOT_JOINTS; i++) {
+        Affine3 objectMatrix, objectNormalMatrix;
+        calculateJointMatrices(joints[i], ConstQuatArrays(rotations)[i], objectMatrix, objectNormalMatrix);
+        skeleton.setObjectMatrix(joints[i].node, objectMatrix, objectNormalMatrix);
+    }
+}
+
+/**
+ * Function to get the number of instances a bot writes at a level of detail
+ *
+ * Function: numInstances
+ */
+int RunningBot::numInstances(int lod) const {
+    return lod == FULL_BOT_LOD ? skeleton.size() : lod == IMPOSTOR_BOT_LOD ? 1 : numCoarseNodes;
+}
+
+/**
+ * Function to write the instance of the impostor of a bot, which is not animated
+ *
+ * Function: writeImpostorInstance
+ */
+int RunningBot::writeImpostorInstance(const Cvec3 &position, const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                                      PartInstance *instances) const {
+    writePartInstance(viewMatrix * Affine3::makeTranslation(position) * impostorMatrix,
+                      viewNormalMatrix * impostorNormalMatrix, instances[0]);
+    return 1;
+}
+
+/**
+ * Function to write the instances of a bot in the given pose without changing the
+ * skeleton, so that one RunningBot can serve as the template of any number of bots
+ *
+ * Function: writePoseInstances
+ *           rotations - Rotation of every joint
+ *           details - Whether to write the detailNodes, which are skipped otherwise
+ *           frustum - Eye space frustum the parts are culled against, NULL when the
+ *                     whole bot is known to be inside
+ *           instances - Destination, must have room for numInstances() entries
+ */
+int RunningBot::writePoseInstances(const QuatArrays &rotations, const Cvec3 &rootTranslation, const Cvec3 &position,
+                                   const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                                   bool details, const Frustum *frustum, PartInstance *instances) const {
+    assert(skeleton.size() <= MAX_BOT_NODES);
+    int numInstances = 0;
+    int nodes[MAX_BOT_NODES];
+    int numNodes = 0;
+    // Eye space bounding spheres of the parts culled against the frustum
+    float x[MAX_BOT_NODES], y[MAX_BOT_NODES], z[MAX_BOT_NODES], radii[MAX_BOT_NODES];
+
+    // The same pass as SceneGraph::update, with the posed object matrices of the
+    // trunk and the joints substituted on the fly
+    Affine3 modelViewMatrices[MAX_BOT_NODES];
+    Affine3 normalMatrices[MAX_BOT_NODES];
+    for(int i=0; i<skeleton.size(); i++) {
+        if(!details && detailNodes[i])
+            continue;
+        const SceneNode &node = skeleton[i];
+        Affine3 objectMatrix, objectNormalMatrix;
+        if(i == trunkNode) {
+            objectMatrix = Affine3::makeTranslation(position + rootTranslation) * Affine3::makeScale(Cvec3(2.0, 3.0, 1.0));
+            objectNormalMatrix = Affine3::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0));
+        }
+        else if(nodeJoints[i] >= 0) {
+            const int joint = nodeJoints[i];
+            calculateJointMatrices(joints[joint], ConstQuatArrays(rotations)[joint], objectMatrix, objectNormalMatrix);
+        }
+        else {
+            objectMatrix = node.objectMatrix;
+            objectNormalMatrix = node.objectNormalMatrix;
+        }
+
+        if(node.parent < 0) {
+            modelViewMatrices[i] = viewMatrix * objectMatrix;
+            normalMatrices[i] = viewNormalMatrix * objectNormalMatrix;
+        }
+        else {
+            modelViewMatrices[i] = modelViewMatrices[node.parent] * objectMatrix;
+            normalMatrices[i] = normalMatrices[node.parent] * objectNormalMatrix;
+        }
+        if(frustum) {
+            const Affine3 &m = modelViewMatrices[i];
+            x[numNodes] = m(0,3);
+            y[numNodes] = m(1,3);
+            z[numNodes] = m(2,3);
+            radii[numNodes] = partBoundingRadius(m);
+            nodes[numNodes++] = i;
+        }
+        else
+            writePartInstance(modelViewMatrices[i], normalMatrices[i], instances[numInstances++]);
+    }
+    if(!frustum)
+        return numInstances;
+
+    // Only the parts whose bounding sphere reaches into the frustum are written
+    unsigned char visibility[MAX_BOT_NODES];
+    classifySpheres(*frustum, x, y, z, radii, numNodes, visibility);
+    for(int n=0; n<numNodes; n++) {
+        if(visibility[n] != SPHERE_OUTSIDE)
+            writePartInstance(modelViewMatrices[nodes[n]], normalMatrices[nodes[n]], instances[numInstances++]);
+    }
+    return numInstances;
+}
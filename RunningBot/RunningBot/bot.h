@@ -0,0 +1,177 @@
+#ifndef BOT_H
+#define BOT_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "affine3.h"
+#include "scenegraph.h"
+#include "partinstance.h"
+#include "animation.h"
+#include "blendtree.h"
+#include "frustum.h"
+#include "spherelod.h"
+
+// Upper bound of the nodes of a bot, for the scratch space of RunningBot::writePoseInstances
+const int MAX_BOT_NODES = 32;
+
+// Length of the run cycle in units of timeSinceStart/frameSpeed, the period of the
+// swing of the arms and legs
+const float RUN_CYCLE_LENGTH = 180.0f;
+// Keys of the baked gait cycles. The joint angles are triangle waves, so keys that
+// land on all their corners (every 45 units of the run) reproduce them exactly
+const int RUN_CLIP_KEYS = 16;
+// The walk and idle cycles in the same units. Each gait clip is a scaled down
+// copy of the run cycle, stretched to its own length
+const float WALK_CYCLE_LENGTH = 270.0f;
+const float IDLE_CYCLE_LENGTH = 600.0f;
+// Period of the waving right arm of the additive layer
+const float WAVE_CYCLE_LENGTH = 60.0f;
+const int WAVE_CLIP_KEYS = 8;
+
+// Radius of the sphere every body part is a scaled copy of
+const float BOT_PART_RADIUS = 1.3f;
+
+/**
+ * Level of detail a bot is drawn at, by distance from the eye
+ */
+enum BotLod {
+    FULL_BOT_LOD,                       // every part, posed every frame
+    REDUCED_BOT_LOD,                    // no fingers and toes
+    LOW_RATE_BOT_LOD,                   // no fingers and toes, posed every LOW_RATE_LOD_INTERVAL frames
+    IMPOSTOR_BOT_LOD,                   // a single sphere around the whole bot
+    NUM_BOT_LODS
+};
+
+/**
+ * What was drawn of the bots in a frame and what the frustum culling left out
+ *
+ * Structure: DrawCounts
+ */
+struct DrawCounts {
+    int lodCounts[NUM_BOT_LODS];        // bots drawn at every level of detail
+    int culledBots;                     // bots entirely outside the frustum
+    int drawnParts;                     // instances written
+    int culledParts;                    // parts of partly visible bots outside the frustum
+    int sphereLodCounts[NUM_SPHERE_LODS]; // parts drawn with every level of the sphere mesh
+
+    DrawCounts() {
+        reset();
+    }
+
+    void reset() {
+        for(int i=0; i<NUM_BOT_LODS; i++)
+            lodCounts[i] = 0;
+        for(int i=0; i<NUM_SPHERE_LODS; i++)
+            sphereLodCounts[i] = 0;
+        culledBots = drawnParts = culledParts = 0;
+    }
+};
+
+// Frames between the poses of a bot at LOW_RATE_BOT_LOD
+const int LOW_RATE_LOD_INTERVAL = 4;
+
+// Slack of the bounding sphere of a bot over the largest extent of the keys of its
+// clips, for the poses in between
+const float BOT_BOUNDS_MARGIN = 1.1f;
+
+/**
+ * Function to get the radius of the bounding sphere of a body part, BOT_PART_RADIUS
+ * scaled by the transform of the part. The Frobenius norm of the linear part bounds
+ * how far the transform stretches any direction
+ *
+ * Function: partBoundingRadius
+ */
+inline float partBoundingRadius(const Affine3 &m) {
+    float sum = 0.0f;
+    for(int i=0; i<3; i++) {
+        for(int j=0; j<3; j++)
+            sum += m(i,j) * m(i,j);
+    }
+    return BOT_PART_RADIUS * sqrtf(sum);
+}
+
+/**
+ * A body part that swings about a single axis. The object matrix of its node is
+ * rebuilt as preMatrix * rotation(angle) * postMatrix, where the constant scales,
+ * translations and axis shifts around the rotation are folded into preMatrix and
+ * postMatrix once when the bot is built. The normal matrices of pre and post are
+ * kept as well, so the normal matrix of the node is preNormalMatrix * rotation *
+ * postNormalMatrix and never needs an inverse
+ *
+ * Structure: BotJoint
+ */
+struct BotJoint {
+    int node;
+    int axis;                   // 0 - X, 1 - Y, 2 - Z
+    Affine3 preMatrix;
+    Affine3 postMatrix;
+    Affine3 preNormalMatrix;
+    Affine3 postNormalMatrix;
+};
+
+enum BotJointId {
+    HEAD_JOINT,
+    RIGHT_ARM_JOINT,
+    RIGHT_THIGH_JOINT,
+    RIGHT_KNEE_JOINT,
+    LEFT_ARM_JOINT,
+    LEFT_THIGH_JOINT,
+    LEFT_KNEE_JOINT,
+    NUM_BOT_JOINTS
+};
+
+/**
+ * The running bot as a persistent scene graph. All the body parts are created
+ * once by build(), after which pose() only updates the trunk position and the
+ * joint rotations for the given time.
+ *
+ * writePoseInstances() evaluates a posed copy of the skeleton straight into
+ * instance data without changing it, so that one RunningBot can serve as the
+ * template of any number of bots.
+ *
+ * The joint rotations come from the blend tree of idle, walk and run clips baked by
+ * build() from the procedural run cycle, with a waving arm as additive layer. The
+ * animation state of a bot is kept outside, in a GaitState.
+ *
+ * The reduced levels of detail leave out the detailNodes, the fingers and toes,
+ * which are all leaves of the skeleton. The impostor is a single sphere stretched
+ * over the bounds of the bot standing at rest.
+ *
+ * boundingRadius bounds every part of the bot in any pose of its clips, around the
+ * position the bot is placed at, for culling whole bots
+ *
+ * Structure: RunningBot
+ */
+struct RunningBot {
+    SceneGraph skeleton;
+    int trunkNode;
+    BotJoint joints[NUM_BOT_JOINTS];
+    std::vector<int> nodeJoints;        // joint of every node, -1 for rigid parts
+    std::vector<bool> detailNodes;      // whether a node is left out by the reduced LODs
+    int numCoarseNodes;                 // nodes that are not detailNodes
+    Affine3 impostorMatrix;
+    Affine3 impostorNormalMatrix;
+    float boundingRadius;
+    BlendTree animation;
+
+    void build();
+    void pose(const GaitState &state, const Cvec3 &position);
+    void pose(const QuatArrays &rotations, const Cvec3 &rootTranslation, const Cvec3 &position);
+    void evaluatePose(const GaitState &state, const QuatArrays &rotations, Cvec3 &rootTranslation) const;
+    void evaluateBlendedPose(const GaitState &previous, const GaitState &current, float t,
+                             const QuatArrays &rotations, Cvec3 &rootTranslation) const;
+    int writePoseInstances(const QuatArrays &rotations, const Cvec3 &rootTranslation, const Cvec3 &position,
+                           const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                           bool details, const Frustum *frustum, PartInstance *instances) const;
+    int writeImpostorInstance(const Cvec3 &position, const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                              PartInstance *instances) const;
+    int numInstances(int lod) const;
+    float computeBoundingRadius() const;
+    AnimationClip bakeGaitClip(int numKeys, float cycleLength, const float jointScales[NUM_BOT_JOINTS], float bob) const;
+    AnimationClip bakeWaveClip(int numKeys) const;
+};
+
+float calculateTimeAngle(float anglePerRev, float timeSinceStart);
+
+#endif
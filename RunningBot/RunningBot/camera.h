@@ -0,0 +1,36 @@
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include "matrix4.h"
+
+/**
+ * Projection shared by everything drawn in a frame, computed only when the viewport
+ * changes in reshape(), using its real aspect ratio. projectionChanged tells the
+ * renderer that the projection uniform has to be uploaded on the next program bind.
+ * pixelScale is how many pixels a unit of eye space covers at a distance of 1 from
+ * the eye, which sizes the parts on the screen for picking their mesh.
+ * The eye moves with the simulation, so its matrices are part of every FrameSnapshot
+ *
+ * Structure: Camera
+ */
+struct Camera {
+    double fovy, zNear, zFar;
+    Matrix4 projectionMatrix;
+    float glProjectionMatrix[16];       // column-major copy of projectionMatrix
+    double pixelScale;
+    bool projectionChanged;
+
+    Camera() : fovy(45.0), zNear(-0.5), zFar(-1000.0) {
+        setViewport(1280, 800);
+    }
+
+    void setViewport(int width, int height) {
+        const double aspectRatio = height > 0 ? double(width)/height : 1.0;
+        projectionMatrix = Matrix4::makeProjection(fovy, aspectRatio, zNear, zFar);
+        projectionMatrix.writeToColumnMajorMatrix(glProjectionMatrix);
+        pixelScale = 0.5 * height * projectionMatrix(1,1);
+        projectionChanged = true;
+    }
+};
+
+#endif
@@ -0,0 +1,282 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <climits>
+#include "crowd.h"
+
+static float randomInRange(float low, float high) {
+    return low + (high - low) * (rand() / float(RAND_MAX));
+}
+
+/**
+ * Function to place the bots on a square grid centered at the origin of the XZ
+ * plane, jittered so that the crowd does not look like a parade, with random
+ * gaits, phases and speeds so that they do not run in lockstep. One bot in eight
+ * waves
+ *
+ * Function: spawn
+ *           bot - Template the bots will be posed from
+ *           numBots - Number of bots, at most MAX_CROWD_SIZE
+ *           spacing - Distance between neighbouring grid cells
+ *           seed - Seed of the random layout, the same seed gives the same crowd
+ */
+void Crowd::spawn(const RunningBot &bot, int numBots, float spacing, unsigned int seed) {
+    assert(numBots >= 0 && numBots <= MAX_CROWD_SIZE);
+    srand(seed);
+
+    const int side = (int)ceil(sqrt((double)numBots));
+    extent = side * spacing;
+    positions.resize(numBots);
+    gaits.resize(numBots);
+    frameSpeeds.resize(numBots);
+    for(int i=0; i<numBots; i++) {
+        const float x = ((i % side) + 0.5f) * spacing - extent / 2;
+        const float z = ((i / side) + 0.5f) * spacing - extent / 2;
+        positions[i] = Cvec3(x + randomInRange(-0.25f, 0.25f) * spacing, 0.0,
+                             z + randomInRange(-0.25f, 0.25f) * spacing);
+        gaits[i] = GaitState();
+        gaits[i].gait = rand() % NUM_GAITS;
+        gaits[i].phase = randomInRange(0.0f, 1.0f);
+        gaits[i].additive = rand() % 8 == 0;
+        gaits[i].additiveWeight = gaits[i].additive ? 1.0f : 0.0f;
+        frameSpeeds[i] = randomInRange(7.0f, 13.0f);
+    }
+    previousGaits = gaits;
+
+    lods.assign(numBots, FULL_BOT_LOD);
+    visibility.assign(numBots, SPHERE_INSIDE);
+    instanceOffsets.assign(numBots, 0);
+    instanceCounts.assign(numBots, 0);
+    partialBots.reserve(numBots);
+    boundsX.resize(numBots);
+    boundsY.resize(numBots);
+    boundsZ.resize(numBots);
+    boundsRadii.assign(numBots, bot.boundingRadius);
+    jointStride = bot.animation.gaits[0].jointStride();
+    cachedPoses.resize(numBots * 2 * 4 * jointStride);
+    cachedRootTranslations.resize(numBots * 2);
+    // no cached pose is recent enough to be interpolated from
+    poseUpdates.assign(numBots, INT_MIN / 2);
+}
+
+/**
+ * Function to fade every bot into the same gait
+ *
+ * Function: setGait
+ */
+void Crowd::setGait(int gait) {
+    for(int i=0; i<size(); i++)
+        gaits[i].setGait(gait);
+}
+
+/**
+ * Function to fade the additive layer of every bot in or out
+ *
+ * Function: setAdditive
+ */
+void Crowd::setAdditive(bool additive) {
+    for(int i=0; i<size(); i++)
+        gaits[i].additive = additive;
+}
+
+/**
+ * Function to cull the bots against the view frustum, pick the level of detail of
+ * every visible bot by its distance from the eye and lay out their instances in
+ * the instance array. The bots entirely inside come first, bot after bot, then
+ * the bots partly inside with room for all their parts, which packPartialBots()
+ * closes the gaps of once they are written. Returns the number of instances
+ * reserved
+ *
+ * Function: selectLods
+ *           bot - Template all the bots are posed from
+ *           offset - Translation applied to the whole crowd
+ *           eyePosition - Position of the eye in world space
+ *           frustum - View frustum in world space
+ */
+int Crowd::selectLods(const RunningBot &bot, const Cvec3 &offset, const Cvec3 &eyePosition, const Frustum &frustum) {
+    float squaredDistances[NUM_BOT_LODS - 1];
+    for(int i=0; i<NUM_BOT_LODS - 1; i++)
+        squaredDistances[i] = lodDistances[i] * lodDistances[i];
+    counts.reset();
+    partialBots.clear();
+
+    for(int i=0; i<size(); i++) {
+        boundsX[i] = float(positions[i][0] + offset[0]);
+        boundsY[i] = float(positions[i][1] + offset[1]);
+        boundsZ[i] = float(positions[i][2] + offset[2]);
+    }
+    classifySpheres(frustum, &boundsX[0], &boundsY[0], &boundsZ[0], &boundsRadii[0], size(), &visibility[0]);
+
+    const Cvec3 eye = eyePosition - offset;
+    int numInstances = 0;
+    for(int i=0; i<size(); i++) {
+        if(visibility[i] == SPHERE_OUTSIDE) {
+            counts.culledBots++;
+            continue;
+        }
+        const float dx = float(positions[i][0] - eye[0]);
+        const float dy = float(positions[i][1] - eye[1]);
+        const float dz = float(positions[i][2] - eye[2]);
+        const float squaredDistance = dx * dx + dy * dy + dz * dz;
+        int lod = FULL_BOT_LOD;
+        while(lod < NUM_BOT_LODS - 1 && squaredDistance > squaredDistances[lod])
+            lod++;
+        lods[i] = (unsigned char)lod;
+        counts.lodCounts[lod]++;
+        // an impostor is a single instance, which is left to the clipper
+        if(visibility[i] == SPHERE_INTERSECTS && lod != IMPOSTOR_BOT_LOD) {
+            partialBots.push_back(i);
+            continue;
+        }
+        visibility[i] = SPHERE_INSIDE;
+        instanceOffsets[i] = numInstances;
+        numInstances += bot.numInstances(lod);
+    }
+    for(int j=0; j<(int)partialBots.size(); j++) {
+        const int i = partialBots[j];
+        instanceOffsets[i] = numInstances;
+        numInstances += bot.numInstances(lods[i]);
+    }
+    return numInstances;
+}
+
+/**
+ * Function to move the instances of the bots partly inside the frustum down over
+ * the room left by their culled parts. Returns the number of instances of the
+ * whole crowd
+ *
+ * Function: packPartialBots
+ *           numPacked - Instances of the bots entirely inside, which come first
+ *           instances - Instance array of the whole crowd
+ */
+int Crowd::packPartialBots(const RunningBot &bot, int numPacked, PartInstance *instances) {
+    int numInstances = numPacked;
+    for(int j=0; j<(int)partialBots.size(); j++) {
+        const int i = partialBots[j];
+        if(instanceOffsets[i] != numInstances)
+            memmove(instances + numInstances, instances + instanceOffsets[i], sizeof(PartInstance) * instanceCounts[i]);
+        counts.culledParts += bot.numInstances(lods[i]) - instanceCounts[i];
+        instanceOffsets[i] = numInstances;
+        numInstances += instanceCounts[i];
+    }
+    return numInstances;
+}
+
+/**
+ * Function to write the instances of bot i at LOW_RATE_BOT_LOD. Its cached poses
+ * are evaluated anew when it is its turn, or when it just dropped to this level
+ * and they are out of date, and interpolated otherwise
+ *
+ * Function: writeLowRateInstances
+ *           i - Index of the bot
+ *           position - Position of the bot including the offset of the crowd
+ *           frustum - Eye space frustum the parts are culled against, or NULL
+ */
+int Crowd::writeLowRateInstances(const RunningBot &bot, int i, const Cvec3 &position,
+                                 const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                                 const Frustum *frustum, PartInstance *instances) {
+    float *older = &cachedPoses[i * 2 * 4 * jointStride];
+    float *newer = older + 4 * jointStride;
+    const QuatArrays olderPose = {older, older + jointStride, older + 2 * jointStride, older + 3 * jointStride};
+    const QuatArrays newerPose = {newer, newer + jointStride, newer + 2 * jointStride, newer + 3 * jointStride};
+    Cvec3 *rootTranslations = &cachedRootTranslations[2 * i];
+
+    const int age = numUpdates - poseUpdates[i];
+    if(age > LOW_RATE_LOD_INTERVAL) {
+        bot.evaluatePose(gaits[i], newerPose, rootTranslations[1]);
+        memcpy(older, newer, sizeof(float) * 4 * jointStride);
+        rootTranslations[0] = rootTranslations[1];
+        poseUpdates[i] = numUpdates;
+    }
+    else if(age > 0 && (numUpdates + i) % LOW_RATE_LOD_INTERVAL == 0) {
+        memcpy(older, newer, sizeof(float) * 4 * jointStride);
+        rootTranslations[0] = rootTranslations[1];
+        bot.evaluatePose(gaits[i], newerPose, rootTranslations[1]);
+        poseUpdates[i] = numUpdates;
+    }
+
+    const float t = float(numUpdates - poseUpdates[i]) / LOW_RATE_LOD_INTERVAL;
+    float rotations[4][MAX_CLIP_JOINTS];
+    const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+    slerpQuats(olderPose, newerPose, t, rotationArrays, jointStride);
+    const Cvec3 rootTranslation = rootTranslations[0] + (rootTranslations[1] - rootTranslations[0]) * t;
+    return bot.writePoseInstances(rotationArrays, rootTranslation, position, viewMatrix, viewNormalMatrix,
+                                  false, frustum, instances);
+}
+
+/**
+ * Function to advance the animation of a range of bots, pose them and write the
+ * instance data of their visible parts at the level of detail, visibility and
+ * instance offset picked by the last selectLods()
+ *
+ * Function: update
+ *           bot - Template all the bots are posed from
+ *           steps - Number of animation steps to take
+ *           stepTime - Length of a step in milliseconds
+ *           interpolation - Fraction of the way from the state before the last step
+ *                           to the state after it the bots are posed at
+ *           offset - Translation applied to the whole crowd
+ *           frustum - View frustum in eye space, for the bots partly inside
+ *           firstBot, lastBot - Half open range of the bots to update
+ *           instances - Instance array of the whole crowd
+ */
+void Crowd::update(const RunningBot &bot, int steps, float stepTime, float interpolation, const Cvec3 &offset,
+                   const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix, const Frustum &frustum,
+                   int firstBot, int lastBot, PartInstance *instances) {
+    float rotations[4][MAX_CLIP_JOINTS];
+    const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+    for(int i=firstBot; i<lastBot; i++) {
+        for(int step=0; step<steps; step++) {
+            previousGaits[i] = gaits[i];
+            bot.animation.advance(gaits[i], stepTime, frameSpeeds[i]);
+        }
+        if(visibility[i] == SPHERE_OUTSIDE)
+            continue;
+        const Cvec3 position = positions[i] + offset;
+        PartInstance *botInstances = instances + instanceOffsets[i];
+        const Frustum *partFrustum = visibility[i] == SPHERE_INTERSECTS ? &frustum : NULL;
+        if(lods[i] == IMPOSTOR_BOT_LOD) {
+            instanceCounts[i] = bot.writeImpostorInstance(position, viewMatrix, viewNormalMatrix, botInstances);
+        }
+        else if(lods[i] == LOW_RATE_BOT_LOD) {
+            instanceCounts[i] = writeLowRateInstances(bot, i, position, viewMatrix, viewNormalMatrix,
+                                                      partFrustum, botInstances);
+        }
+        else {
+            Cvec3 rootTranslation;
+            bot.evaluateBlendedPose(previousGaits[i], gaits[i], interpolation, rotationArrays, rootTranslation);
+            instanceCounts[i] = bot.writePoseInstances(rotationArrays, rootTranslation, position, viewMatrix,
+                                                       viewNormalMatrix, lods[i] == FULL_BOT_LOD, partFrustum,
+                                                       botInstances);
+        }
+    }
+}
+
+/**
+ * Function to update the whole crowd on all the threads of a job system. The culling
+ * and the levels of detail are picked first, which tells each job where its bots go
+ * in the shared instance array, so the threads never write to the same memory. The
+ * bots partly inside the frustum are packed once all the bots are written. Returns
+ * the number of instances written
+ *
+ * Function: update
+ *           jobSystem - Threads to spread the bots over
+ *           eyePosition - Position of the eye in world space, the levels of detail
+ *                         are picked by the distance from it
+ *           frustum - View frustum in eye space, Frustum() draws every bot
+ *           instances - Destination, must have room for size() * bot.skeleton.size() entries
+ */
+int Crowd::update(JobSystem &jobSystem, const RunningBot &bot, int steps, float stepTime, float interpolation,
+                  const Cvec3 &offset, const Cvec3 &eyePosition, const Affine3 &viewMatrix,
+                  const Affine3 &viewNormalMatrix, const Frustum &frustum, PartInstance *instances) {
+    int numInstances = selectLods(bot, offset, eyePosition, frustum.transformed(viewMatrix));
+    jobSystem.parallelFor(size(), CROWD_GRAIN_SIZE, [&](int first, int last) {
+        update(bot, steps, stepTime, interpolation, offset, viewMatrix, viewNormalMatrix, frustum, first, last,
+               instances);
+    });
+    if(!partialBots.empty())
+        numInstances = packPartialBots(bot, instanceOffsets[partialBots[0]], instances);
+    counts.drawnParts = numInstances;
+    numUpdates++;
+    return numInstances;
+}
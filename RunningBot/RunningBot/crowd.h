@@ -0,0 +1,98 @@
+#ifndef CROWD_H
+#define CROWD_H
+
+#include <vector>
+
+#include "cvec.h"
+#include "affine3.h"
+#include "bot.h"
+#include "partinstance.h"
+#include "jobsystem.h"
+
+// Bots posed by one job of the parallel update
+const int CROWD_GRAIN_SIZE = 64;
+
+// Largest crowd that can be spawned
+const int MAX_CROWD_SIZE = 100000;
+
+// Distances from the eye beyond which bots drop to REDUCED_BOT_LOD, LOW_RATE_BOT_LOD
+// and IMPOSTOR_BOT_LOD. At the default 1280x800 and 45 degrees a bot is about 130,
+// 50 and 20 pixels tall at these distances
+const float DEFAULT_LOD_DISTANCES[NUM_BOT_LODS - 1] = {150.0f, 400.0f, 1000.0f};
+
+/**
+ * A crowd of bots sharing the skeleton and blend tree of one RunningBot. Every bot
+ * has its own position, animation state and frameSpeed, stored as parallel arrays
+ * so that a batch update streams through them. The update advances the animation
+ * of a bot by fixed steps and writes its instances in the same pass, posed between
+ * its state before and after the last step.
+ *
+ * Every update first picks the level of detail of each bot by its distance from
+ * the eye, which also fixes where its instances go. Bots at LOW_RATE_BOT_LOD keep
+ * their last two poses, evaluated every LOW_RATE_LOD_INTERVAL updates at staggered
+ * frames, and are drawn interpolating from the older to the newer one, which puts
+ * them one interval behind.
+ *
+ * The bots are culled against the view frustum by their bounding spheres in the
+ * same pass. Bots outside only have their animation advanced, and the parts of
+ * bots straddling the frustum are culled one by one while they are posed
+ *
+ * Structure: Crowd
+ */
+struct Crowd {
+    std::vector<Cvec3> positions;
+    std::vector<GaitState> gaits;
+    std::vector<GaitState> previousGaits;   // gaits before the last step
+    std::vector<float> frameSpeeds;
+    float extent;                       // side length of the square the bots stand in
+    float lodDistances[NUM_BOT_LODS - 1];
+
+    // Level of detail, SphereVisibility and first instance of every bot in the last
+    // update, and what was drawn
+    std::vector<unsigned char> lods;
+    std::vector<unsigned char> visibility;
+    std::vector<int> instanceOffsets;
+    DrawCounts counts;
+
+    // Bots partly inside the frustum, whose instances are packed after the update,
+    // and how many instances each of them wrote
+    std::vector<int> partialBots;
+    std::vector<int> instanceCounts;
+
+    // Scratch space for the bounding spheres of the bots
+    std::vector<float> boundsX, boundsY, boundsZ, boundsRadii;
+
+    // Poses of the bots at LOW_RATE_BOT_LOD, the older and the newer one of every
+    // bot as [bot][pose][component][joint], and the update the newer one is from
+    int jointStride;
+    std::vector<float> cachedPoses;
+    std::vector<Cvec3> cachedRootTranslations;
+    std::vector<int> poseUpdates;
+    int numUpdates;
+
+    Crowd() : extent(0.0f), jointStride(0), numUpdates(0) {
+        for(int i=0; i<NUM_BOT_LODS - 1; i++)
+            lodDistances[i] = DEFAULT_LOD_DISTANCES[i];
+    }
+
+    int size() const {
+        return (int)positions.size();
+    }
+
+    void spawn(const RunningBot &bot, int numBots, float spacing, unsigned int seed);
+    void setGait(int gait);
+    void setAdditive(bool additive);
+    int selectLods(const RunningBot &bot, const Cvec3 &offset, const Cvec3 &eyePosition, const Frustum &frustum);
+    void update(const RunningBot &bot, int steps, float stepTime, float interpolation, const Cvec3 &offset,
+                const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix, const Frustum &frustum,
+                int firstBot, int lastBot, PartInstance *instances);
+    int update(JobSystem &jobSystem, const RunningBot &bot, int steps, float stepTime, float interpolation,
+               const Cvec3 &offset, const Cvec3 &eyePosition, const Affine3 &viewMatrix,
+               const Affine3 &viewNormalMatrix, const Frustum &frustum, PartInstance *instances);
+    int writeLowRateInstances(const RunningBot &bot, int i, const Cvec3 &position,
+                              const Affine3 &viewMatrix, const Affine3 &viewNormalMatrix,
+                              const Frustum *frustum, PartInstance *instances);
+    int packPartialBots(const RunningBot &bot, int numPacked, PartInstance *instances);
+};
+
+#endif
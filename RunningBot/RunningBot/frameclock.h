@@ -0,0 +1,46 @@
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+// Length of a step of the animation, 120 steps per second
+const double SIMULATION_STEP_MS = 1000.0 / 120.0;
+
+/**
+ * Fixed timestep clock of the animation. The wall time of every frame goes into an
+ * accumulator that is used up in whole simulation steps, so the animation state
+ * always moves on by the same step however long the frames take. The caller keeps
+ * the state before and after the last step and draws the frame blended between
+ * the two by interpolation(), the part of a step left in the accumulator, which
+ * keeps the motion smooth when the frame rate and the step rate do not divide.
+ *
+ * Frames longer than maxFrameMs (a stall, the window being dragged) only count as
+ * maxFrameMs, so the simulation does not try to catch up with them in one go
+ *
+ * Structure: FrameClock
+ */
+struct FrameClock {
+    double stepMs;
+    double maxFrameMs;
+    double accumulatorMs;
+    
+    FrameClock(double stepMs = SIMULATION_STEP_MS, double maxFrameMs = 250.0)
+        : stepMs(stepMs), maxFrameMs(maxFrameMs), accumulatorMs(0.0) {}
+    
+    // Adds the wall time of a frame and returns the number of steps to simulate
+    int advance(double frameMs) {
+        accumulatorMs += frameMs < maxFrameMs ? frameMs : maxFrameMs;
+        int steps = 0;
+        while(accumulatorMs >= stepMs) {
+            accumulatorMs -= stepMs;
+            steps++;
+        }
+        return steps;
+    }
+    
+    // How far the frame is from the state before the last step to the state after
+    // it, 0 to 1
+    float interpolation() const {
+        return float(accumulatorMs / stepMs);
+    }
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <cmath>
+
+#include "matrix4.h"
+#include "affine3.h"
+
+// The batched sphere tests use SSE2 where available, define FRUSTUM_NO_SIMD to
+// force the scalar code
+#if !defined(FRUSTUM_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+  #define FRUSTUM_SSE2
+  #include <emmintrin.h>
+#endif
+
+enum SphereVisibility {
+    SPHERE_OUTSIDE,
+    SPHERE_INTERSECTS,
+    SPHERE_INSIDE
+};
+
+/**
+ * The six planes bounding what a projection can see. A point p is inside a plane
+ * when a*p[0] + b*p[1] + c*p[2] + d >= 0, and (a, b, c) is a unit vector so that
+ * the same expression is the signed distance that spheres are tested with. A
+ * default constructed frustum contains everything
+ *
+ * Structure: Frustum
+ */
+struct Frustum {
+    float planes[6][4];                 // a, b, c, d of every plane
+
+    Frustum() {
+        for(int i=0; i<6; i++) {
+            planes[i][0] = planes[i][1] = planes[i][2] = 0.0f;
+            planes[i][3] = 1e30f;
+        }
+    }
+
+    // The planes in eye space, extracted from the rows of the projection: a point
+    // is visible when -w <= x, y, z <= w after the projection
+    explicit Frustum(const Matrix4 &projection) {
+        for(int i=0; i<3; i++) {
+            for(int j=0; j<4; j++) {
+                planes[2*i][j] = float(projection(3,j) + projection(i,j));
+                planes[2*i + 1][j] = float(projection(3,j) - projection(i,j));
+            }
+        }
+        for(int i=0; i<6; i++)
+            normalizePlane(planes[i]);
+    }
+
+    // The planes in the space m maps from, e.g. the world space planes of an eye
+    // space frustum when m is the view matrix
+    Frustum transformed(const Affine3 &m) const {
+        Frustum r;
+        for(int i=0; i<6; i++) {
+            for(int j=0; j<4; j++) {
+                r.planes[i][j] = planes[i][0] * m(0,j) + planes[i][1] * m(1,j) + planes[i][2] * m(2,j) +
+                                 (j == 3 ? planes[i][3] : 0.0f);
+            }
+            normalizePlane(r.planes[i]);
+        }
+        return r;
+    }
+
+    static void normalizePlane(float plane[4]) {
+        const float length = std::sqrt(plane[0]*plane[0] + plane[1]*plane[1] + plane[2]*plane[2]);
+        if(length > 0.0f) {
+            for(int j=0; j<4; j++)
+                plane[j] /= length;
+        }
+    }
+};
+
+/**
+ * Function to test a bounding sphere against a frustum
+ *
+ * Function: classifySphere
+ */
+inline int classifySphere(const Frustum &frustum, float x, float y, float z, float radius) {
+    int visibility = SPHERE_INSIDE;
+    for(int i=0; i<6; i++) {
+        const float *p = frustum.planes[i];
+        const float distance = p[0] * x + p[1] * y + p[2] * z + p[3];
+        if(distance < -radius)
+            return SPHERE_OUTSIDE;
+        if(distance < radius)
+            visibility = SPHERE_INTERSECTS;
+    }
+    return visibility;
+}
+
+/**
+ * Function to test n bounding spheres against a frustum, four at a time with SSE2.
+ * The spheres are passed as structure of arrays
+ *
+ * Function: classifySpheres
+ *           x, y, z - Centers of the spheres
+ *           radii - Radii of the spheres
+ *           visibility - Destination, one SphereVisibility for every sphere
+ */
+inline void classifySpheres(const Frustum &frustum, const float x[], const float y[], const float z[],
+                            const float radii[], int n, unsigned char visibility[]) {
+    int i = 0;
+#if defined(FRUSTUM_SSE2)
+    for(; i + 4 <= n; i += 4) {
+        const __m128 vx = _mm_loadu_ps(x + i), vy = _mm_loadu_ps(y + i), vz = _mm_loadu_ps(z + i);
+        const __m128 radius = _mm_loadu_ps(radii + i);
+        const __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), radius);
+        __m128 outside = _mm_setzero_ps(), intersects = _mm_setzero_ps();
+        for(int j=0; j<6; j++) {
+            const float *p = frustum.planes[j];
+            const __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[0]), vx), _mm_mul_ps(_mm_set1_ps(p[1]), vy)),
+                                               _mm_add_ps(_mm_mul_ps(_mm_set1_ps(p[2]), vz), _mm_set1_ps(p[3])));
+            outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, negativeRadius));
+            intersects = _mm_or_ps(intersects, _mm_cmplt_ps(distance, radius));
+        }
+        const int outsideLanes = _mm_movemask_ps(outside), intersectsLanes = _mm_movemask_ps(intersects);
+        for(int j=0; j<4; j++) {
+            visibility[i + j] = (unsigned char)((outsideLanes >> j) & 1 ? SPHERE_OUTSIDE :
+                                                (intersectsLanes >> j) & 1 ? SPHERE_INTERSECTS : SPHERE_INSIDE);
+        }
+    }
+#endif
+    for(; i < n; i++)
+        visibility[i] = (unsigned char)classifySphere(frustum, x[i], y[i], z[i], radii[i]);
+}
+
+#endif
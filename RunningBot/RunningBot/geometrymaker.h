@@ -20,6 +20,8 @@ struct GenericVertex {
   Cvec2f tex;
   Cvec3f tangent, binormal;
 
+  GenericVertex() {}
+
   GenericVertex(
     float x, float y, float z,
     float nx, float ny, float nz,
@@ -3,8 +3,15 @@
 #include <string>
 #include <iostream>
 #include <stdexcept>
+#include <cassert>
+#include <cstring>
 
 #include "glsupport.h"
+#ifdef __APPLE__
+#include <OpenGL/OpenGL.h>
+#else
+#include <GL/glx.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -126,6 +133,486 @@ void readAndCompileShader(GLuint programHandle, const char * vertexShaderFileNam
   checkGlErrors(__FILE__, __LINE__);
 }
 
+void writeFramebufferPPM(const char *fileName, int width, int height) {
+  vector<unsigned char> pixels(width * height * 3);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+  checkGlErrors(__FILE__, __LINE__);
+
+  ofstream ofs(fileName, ios::binary);
+  if (!ofs)
+    throw runtime_error(string("Cannot open file ") + fileName);
+  ofs << "P6\n" << width << " " << height << "\n255\n";
+
+  // GL rows go bottom to top, PPM rows top to bottom
+  for (int y = height - 1; y >= 0; --y) {
+    ofs.write(reinterpret_cast<const char*>(&pixels[y * width * 3]), width * 3);
+  }
+}
+
+bool setSwapInterval(int interval) {
+#ifdef __APPLE__
+  const GLint value = interval;
+  return CGLSetParameter(CGLGetCurrentContext(), kCGLCPSwapInterval, &value) == kCGLNoError;
+#else
+  // GLX has no core entry point, try the extensions that need no drawable
+  typedef int (*SwapIntervalProc)(int);
+  SwapIntervalProc swapInterval =
+    (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalMESA");
+  if (!swapInterval)
+    swapInterval = (SwapIntervalProc)glXGetProcAddressARB((const GLubyte*)"glXSwapIntervalSGI");
+  return swapInterval && swapInterval(interval) == 0;
+#endif
+}
+
+bool hasGlExtension(const char *name) {
+  const char* extensions = (const char*)glGetString(GL_EXTENSIONS);
+  const size_t length = strlen(name);
+  // a name may be the prefix of another, so it has to end at a space
+  for (const char* found = extensions; found && (found = strstr(found, name)); found += length) {
+    if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+GpuTimers::GpuTimers() : frame_(0), enabled_(true), active_(false) {}
+
+GpuTimers::~GpuTimers() {
+  for (size_t i = 0; i < scopes_.size(); ++i) {
+    glDeleteQueries(RING_SIZE, scopes_[i].queries);
+  }
+}
+
+int GpuTimers::scope(const char *name) {
+  for (size_t i = 0; i < scopes_.size(); ++i) {
+    if (scopes_[i].name == name)
+      return (int)i;
+  }
+
+  Scope s;
+  s.name = name;
+  glGenQueries(RING_SIZE, s.queries);
+  checkGlErrors(__FILE__, __LINE__);
+  for (int i = 0; i < RING_SIZE; ++i) {
+    s.pending[i] = false;
+  }
+  s.numSamples = s.nextSample = 0;
+  s.issued = -1;
+  scopes_.push_back(s);
+  return (int)scopes_.size() - 1;
+}
+
+void GpuTimers::begin(int scope) {
+  assert(!active_);
+  Scope& s = scopes_[scope];
+  const int slot = frame_ % RING_SIZE;
+  // skip the frame rather than reuse a query the GPU has not finished
+  if (!enabled_ || s.pending[slot])
+    return;
+  glBeginQuery(GL_TIME_ELAPSED, s.queries[slot]);
+  s.issuedFrame[slot] = frame_;
+  s.issued = slot;
+  active_ = true;
+}
+
+void GpuTimers::end(int scope) {
+  Scope& s = scopes_[scope];
+  if (s.issued < 0)
+    return;
+  glEndQuery(GL_TIME_ELAPSED);
+  s.pending[s.issued] = true;
+  s.issued = -1;
+  active_ = false;
+}
+
+void GpuTimers::endFrame() {
+  for (size_t i = 0; i < scopes_.size(); ++i) {
+    Scope& s = scopes_[i];
+    // oldest first, so the samples stay in frame order
+    for (int j = 1; j <= RING_SIZE; ++j) {
+      const int slot = (frame_ + j) % RING_SIZE;
+      if (!s.pending[slot])
+        continue;
+      GLint available = 0;
+      glGetQueryObjectiv(s.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        continue;
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(s.queries[slot], GL_QUERY_RESULT, &elapsed);
+      s.pending[slot] = false;
+      // Some drivers (Mesa llvmpipe) return a bogus time for the first query of a
+      // context that does any work, so the first frame is never used
+      if (s.issuedFrame[slot] == 0)
+        continue;
+      s.samples[s.nextSample] = elapsed / 1000000.0;
+      s.nextSample = (s.nextSample + 1) % WINDOW_SIZE;
+      if (s.numSamples < WINDOW_SIZE)
+        ++s.numSamples;
+    }
+  }
+  ++frame_;
+}
+
+double GpuTimers::averageMilliseconds(int scope) const {
+  const Scope& s = scopes_[scope];
+  double sum = 0;
+  for (int i = 0; i < s.numSamples; ++i) {
+    sum += s.samples[i];
+  }
+  return s.numSamples ? sum / s.numSamples : 0;
+}
+
+void GpuTimers::dump(ostream& os) const {
+  for (size_t i = 0; i < scopes_.size(); ++i) {
+    os << scopes_[i].name << ": " << averageMilliseconds((int)i) << " ms" << endl;
+  }
+}
+
+GlStateCache::GlStateCache() : issued_(0), elided_(0), lastIssued_(0), lastElided_(0) {
+  invalidate();
+}
+
+void GlStateCache::invalidate() {
+  program_ = UNKNOWN;
+  vertexArray_ = UNKNOWN;
+  buffers_.clear();
+  indexedBuffers_.clear();
+  activeTexture_ = UNKNOWN;
+  for (int i = 0; i < MAX_TEXTURE_UNITS; ++i) {
+    textures_[i] = UNKNOWN;
+  }
+  capabilities_.clear();
+  blendSource_ = blendDestination_ = UNKNOWN;
+  depthFunc_ = UNKNOWN;
+  depthMask_ = -1;
+  clearColorKnown_ = false;
+}
+
+bool GlStateCache::changes(bool unchanged) {
+  if (unchanged) {
+    ++elided_;
+    return false;
+  }
+  ++issued_;
+  return true;
+}
+
+void GlStateCache::useProgram(GLuint program) {
+  if (changes(program_ == program)) {
+    glUseProgram(program);
+    program_ = program;
+  }
+}
+
+void GlStateCache::bindVertexArray(GLuint vertexArray) {
+  if (changes(vertexArray_ == vertexArray)) {
+    glBindVertexArray(vertexArray);
+    vertexArray_ = vertexArray;
+    for (size_t i = 0; i < buffers_.size(); ++i) {
+      if (buffers_[i].target == GL_ELEMENT_ARRAY_BUFFER) {
+        buffers_.erase(buffers_.begin() + i);
+        break;
+      }
+    }
+  }
+}
+
+void GlStateCache::bindBuffer(GLenum target, GLuint buffer) {
+  size_t i = 0;
+  while (i < buffers_.size() && buffers_[i].target != target)
+    ++i;
+  if (changes(i < buffers_.size() && buffers_[i].buffer == buffer)) {
+    glBindBuffer(target, buffer);
+    if (i == buffers_.size()) {
+      BufferBinding binding = {target, buffer};
+      buffers_.push_back(binding);
+    } else {
+      buffers_[i].buffer = buffer;
+    }
+  }
+}
+
+void GlStateCache::bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+  size_t i = 0;
+  while (i < indexedBuffers_.size() && (indexedBuffers_[i].target != target || indexedBuffers_[i].index != index))
+    ++i;
+  const bool unchanged = i < indexedBuffers_.size() && indexedBuffers_[i].buffer == buffer &&
+                         indexedBuffers_[i].offset == offset && indexedBuffers_[i].size == size;
+  if (!changes(unchanged))
+    return;
+  glBindBufferRange(target, index, buffer, offset, size);
+  IndexedBinding binding = {target, index, buffer, offset, size};
+  if (i == indexedBuffers_.size())
+    indexedBuffers_.push_back(binding);
+  else
+    indexedBuffers_[i] = binding;
+
+  // glBindBufferRange binds the generic target as well
+  size_t j = 0;
+  while (j < buffers_.size() && buffers_[j].target != target)
+    ++j;
+  if (j == buffers_.size()) {
+    BufferBinding generic = {target, buffer};
+    buffers_.push_back(generic);
+  } else {
+    buffers_[j].buffer = buffer;
+  }
+}
+
+void GlStateCache::activeTexture(GLenum unit) {
+  if (changes(activeTexture_ == unit)) {
+    glActiveTexture(unit);
+    activeTexture_ = unit;
+  }
+}
+
+void GlStateCache::bindTexture(GLenum target, GLuint texture) {
+  // only 2D textures of the first units on a known unit are tracked
+  const int unit = activeTexture_ == UNKNOWN ? -1 : (int)(activeTexture_ - GL_TEXTURE0);
+  const bool tracked = target == GL_TEXTURE_2D && unit >= 0 && unit < MAX_TEXTURE_UNITS;
+  if (changes(tracked && textures_[unit] == texture)) {
+    glBindTexture(target, texture);
+    if (tracked)
+      textures_[unit] = texture;
+  }
+}
+
+void GlStateCache::setEnabled(GLenum capability, bool enabled) {
+  size_t i = 0;
+  while (i < capabilities_.size() && capabilities_[i].capability != capability)
+    ++i;
+  if (changes(i < capabilities_.size() && capabilities_[i].enabled == enabled)) {
+    if (enabled)
+      glEnable(capability);
+    else
+      glDisable(capability);
+    if (i == capabilities_.size()) {
+      Capability c = {capability, enabled};
+      capabilities_.push_back(c);
+    } else {
+      capabilities_[i].enabled = enabled;
+    }
+  }
+}
+
+void GlStateCache::blendFunc(GLenum source, GLenum destination) {
+  if (changes(blendSource_ == source && blendDestination_ == destination)) {
+    glBlendFunc(source, destination);
+    blendSource_ = source;
+    blendDestination_ = destination;
+  }
+}
+
+void GlStateCache::depthFunc(GLenum func) {
+  if (changes(depthFunc_ == func)) {
+    glDepthFunc(func);
+    depthFunc_ = func;
+  }
+}
+
+void GlStateCache::depthMask(bool mask) {
+  if (changes(depthMask_ == (int)mask)) {
+    glDepthMask(mask ? GL_TRUE : GL_FALSE);
+    depthMask_ = mask;
+  }
+}
+
+void GlStateCache::clearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+  const bool unchanged = clearColorKnown_ && clearColor_[0] == r && clearColor_[1] == g &&
+                         clearColor_[2] == b && clearColor_[3] == a;
+  if (changes(unchanged)) {
+    glClearColor(r, g, b, a);
+    clearColor_[0] = r;
+    clearColor_[1] = g;
+    clearColor_[2] = b;
+    clearColor_[3] = a;
+    clearColorKnown_ = true;
+  }
+}
+
+void GlStateCache::endFrame() {
+  lastIssued_ = issued_;
+  lastElided_ = elided_;
+  issued_ = elided_ = 0;
+}
+
+UniformBufferRing::UniformBufferRing(GLsizeiptr frameSize, int numBlocks, GlStateCache& state)
+  : state_(state), region_(0), used_(0) {
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment_);
+  if (alignment_ < 1)
+    alignment_ = 1;
+  // every block may be padded by up to alignment_ - 1 bytes, and every region
+  // starts aligned
+  const GLsizeiptr padded = frameSize + (GLsizeiptr)numBlocks * (alignment_ - 1);
+  regionSize_ = (padded + alignment_ - 1) / alignment_ * alignment_;
+  staging_.resize(regionSize_);
+  glGenBuffers(1, &handle_);
+  state_.bindBuffer(GL_UNIFORM_BUFFER, handle_);
+  glBufferData(GL_UNIFORM_BUFFER, regionSize_ * RING_SIZE, NULL, GL_STREAM_DRAW);
+  checkGlErrors(__FILE__, __LINE__);
+}
+
+UniformBufferRing::~UniformBufferRing() {
+  glDeleteBuffers(1, &handle_);
+}
+
+void UniformBufferRing::beginFrame() {
+  region_ = (region_ + 1) % RING_SIZE;
+  used_ = 0;
+}
+
+GLintptr UniformBufferRing::push(const void* data, GLsizeiptr size) {
+  const GLsizeiptr offset = (used_ + alignment_ - 1) / alignment_ * alignment_;
+  assert(offset + size <= regionSize_);
+  memcpy(&staging_[offset], data, size);
+  used_ = offset + size;
+  return regionSize_ * region_ + offset;
+}
+
+void UniformBufferRing::upload() {
+  if (used_ == 0)
+    return;
+  state_.bindBuffer(GL_UNIFORM_BUFFER, handle_);
+  glBufferSubData(GL_UNIFORM_BUFFER, regionSize_ * region_, used_, &staging_[0]);
+  state_.countCalls(1);
+}
+
+StreamingBuffer::StreamingBuffer(GLenum target, GLsizeiptr regionSize, GlStateCache& state)
+  : state_(state), target_(target), regionSize_(regionSize), region_(RING_SIZE - 1),
+    persistent_(NULL), mapped_(NULL), waits_(0) {
+  for (int i = 0; i < RING_SIZE; ++i) {
+    fences_[i] = 0;
+  }
+#ifdef __APPLE__
+  // The legacy context has neither buffer storage nor map buffer range
+  mode_ = BUFFER_SUB_DATA;
+#else
+  if (hasGlExtension("GL_ARB_buffer_storage") && hasGlExtension("GL_ARB_sync"))
+    mode_ = PERSISTENT_MAPPING;
+  else if (hasGlExtension("GL_ARB_map_buffer_range"))
+    mode_ = UNSYNCHRONIZED_MAPPING;
+  else
+    mode_ = BUFFER_SUB_DATA;
+#endif
+
+  state_.bindBuffer(target_, buffer_);
+  if (mode_ == BUFFER_SUB_DATA) {
+    staging_.resize(regionSize_);
+    glBufferData(target_, regionSize_, NULL, GL_STREAM_DRAW);
+  }
+#ifndef __APPLE__
+  else if (mode_ == PERSISTENT_MAPPING) {
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(target_, regionSize_ * RING_SIZE, NULL, flags);
+    persistent_ = (unsigned char*)glMapBufferRange(target_, 0, regionSize_ * RING_SIZE, flags);
+    if (!persistent_)
+      throw runtime_error("glMapBufferRange fails on the streaming buffer");
+  } else {
+    glBufferData(target_, regionSize_ * RING_SIZE, NULL, GL_STREAM_DRAW);
+  }
+#endif
+  checkGlErrors(__FILE__, __LINE__);
+}
+
+StreamingBuffer::~StreamingBuffer() {
+#ifndef __APPLE__
+  for (int i = 0; i < RING_SIZE; ++i) {
+    if (fences_[i])
+      glDeleteSync(fences_[i]);
+  }
+  if (persistent_) {
+    state_.bindBuffer(target_, buffer_);
+    glUnmapBuffer(target_);
+  }
+#endif
+}
+
+const char* StreamingBuffer::modeName() const {
+  switch (mode_) {
+  case PERSISTENT_MAPPING:
+    return "persistent mapping";
+  case UNSYNCHRONIZED_MAPPING:
+    return "unsynchronized mapping";
+  default:
+    return "buffer sub data";
+  }
+}
+
+void* StreamingBuffer::map() {
+  assert(!mapped_);
+  region_ = (region_ + 1) % RING_SIZE;
+  if (mode_ == BUFFER_SUB_DATA) {
+    mapped_ = &staging_[0];
+    return mapped_;
+  }
+#ifndef __APPLE__
+  if (mode_ == PERSISTENT_MAPPING) {
+    GLsync& fence = fences_[region_];
+    if (fence) {
+      GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+      if (status == GL_TIMEOUT_EXPIRED) {
+        ++waits_;
+        while (status == GL_TIMEOUT_EXPIRED)
+          status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+      }
+      glDeleteSync(fence);
+      fence = 0;
+      state_.countCalls(2);
+    }
+    mapped_ = persistent_ + regionSize_ * region_;
+    return mapped_;
+  }
+
+  // Once the ring wraps, the regions of earlier frames are only released by
+  // orphaning the buffer
+  state_.bindBuffer(target_, buffer_);
+  if (region_ == 0) {
+    glBufferData(target_, regionSize_ * RING_SIZE, NULL, GL_STREAM_DRAW);
+    state_.countCalls(1);
+  }
+  const GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT |
+                            GL_MAP_FLUSH_EXPLICIT_BIT;
+  mapped_ = (unsigned char*)glMapBufferRange(target_, regionSize_ * region_, regionSize_, access);
+  state_.countCalls(1);
+  if (!mapped_)
+    throw runtime_error("glMapBufferRange fails on the streaming buffer");
+#endif
+  return mapped_;
+}
+
+GLintptr StreamingBuffer::commit(GLsizeiptr size) {
+  assert(mapped_ && size <= regionSize_);
+  mapped_ = NULL;
+  if (mode_ == BUFFER_SUB_DATA) {
+    // Orphaning first lets the driver put the data in fresh storage
+    state_.bindBuffer(target_, buffer_);
+    glBufferData(target_, regionSize_, NULL, GL_STREAM_DRAW);
+    glBufferSubData(target_, 0, size, &staging_[0]);
+    state_.countCalls(2);
+    return 0;
+  }
+#ifndef __APPLE__
+  if (mode_ == UNSYNCHRONIZED_MAPPING) {
+    state_.bindBuffer(target_, buffer_);
+    glFlushMappedBufferRange(target_, 0, size);
+    glUnmapBuffer(target_);
+    state_.countCalls(2);
+  }
+#endif
+  // a coherent mapping needs nothing, its writes are seen by later commands
+  return regionSize_ * region_;
+}
+
+void StreamingBuffer::endFrame() {
+#ifndef __APPLE__
+  if (mode_ == PERSISTENT_MAPPING) {
+    fences_[region_] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    state_.countCalls(1);
+  }
+#endif
+}
+
 GLuint loadGLTexture(const char *filePath) {
     int w,h,comp;
     unsigned char* image = stbi_load(filePath, &w, &h, &comp, STBI_rgb_alpha);
@@ -3,9 +3,27 @@
 
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <vector>
 
 #ifdef __APPLE__
     #include <glut.h>
+    #include <OpenGL/glext.h>
+
+    // The legacy OS X context only exposes instancing through the ARB extensions
+    #define glVertexAttribDivisor glVertexAttribDivisorARB
+    #define glDrawElementsInstanced glDrawElementsInstancedARB
+    // and timer queries through EXT_timer_query
+    #define GL_TIME_ELAPSED GL_TIME_ELAPSED_EXT
+    #define glGetQueryObjectui64v glGetQueryObjectui64vEXT
+    // and vertex array objects through APPLE_vertex_array_object
+    #define glGenVertexArrays glGenVertexArraysAPPLE
+    #define glBindVertexArray glBindVertexArrayAPPLE
+    #define glDeleteVertexArrays glDeleteVertexArraysAPPLE
+    // and half float vertex attributes through ARB_half_float_vertex
+    #ifndef GL_HALF_FLOAT
+        #define GL_HALF_FLOAT GL_HALF_FLOAT_ARB
+    #endif
 #else
     #include <GL/glew.h>
     #include <GL/glut.h>
@@ -32,6 +50,17 @@ void linkShader(GLuint programHandle, GLuint vertexShaderHandle, GLuint fragment
 // shader. Throws runtime_error on error
 void readAndCompileSingleShader(GLuint shaderHandle, const char* shaderFileName);
 
+// Reads back the color buffer of the bound read framebuffer and writes it to a
+// binary PPM file. Throws runtime_error on error
+void writeFramebufferPPM(const char *fileName, int width, int height);
+
+// Sets the number of vertical blanks a buffer swap of the current window waits
+// for, 0 turns vsync off. Returns false if the platform does not support it
+bool setSwapInterval(int interval);
+
+// Returns whether the current context lists the named extension
+bool hasGlExtension(const char *name);
+
 // Classes inheriting Noncopyable will not have default compiler generated copy
 // constructor and assignment operator
 class Noncopyable {
@@ -137,6 +166,259 @@ public:
 };
 
 
+// GPU time spent in named scopes of a frame, measured with GL_TIME_ELAPSED
+// queries. Every scope owns a ring of query objects, one per frame in flight:
+// the query issued in frame N is only read once GL_QUERY_RESULT_AVAILABLE says
+// it has finished, usually a frame or two later, so timing never waits on the
+// GPU. If all the queries of a scope are still in flight that frame is not
+// measured. Results are kept as a rolling average over the last samples.
+//
+// Timer queries of the same target cannot overlap, so scopes must not nest.
+// Needs a current context from construction to destruction.
+class GpuTimers : Noncopyable {
+public:
+  static const int RING_SIZE = 4;                  // frames a query may be in flight
+  static const int WINDOW_SIZE = 60;               // samples in the rolling average
+
+  GpuTimers();
+  ~GpuTimers();
+
+  // Returns the id of the named scope, creating it on first use
+  int scope(const char *name);
+
+  void begin(int scope);
+  void end(int scope);
+
+  // Reads back every finished query, call once at the end of each frame
+  void endFrame();
+
+  // Disabled timers issue no queries, e.g. while something else times the frame
+  void setEnabled(bool enabled) {
+    enabled_ = enabled;
+  }
+
+  int numScopes() const {
+    return (int)scopes_.size();
+  }
+
+  const char* name(int scope) const {
+    return scopes_[scope].name.c_str();
+  }
+
+  // Rolling average in milliseconds, 0 until the first result came back
+  double averageMilliseconds(int scope) const;
+
+  // Writes one line per scope with its rolling average
+  void dump(std::ostream& os) const;
+
+private:
+  struct Scope {
+    std::string name;
+    GLuint queries[RING_SIZE];
+    bool pending[RING_SIZE];
+    int issuedFrame[RING_SIZE];
+    double samples[WINDOW_SIZE];                   // milliseconds
+    int numSamples;
+    int nextSample;
+    int issued;                                    // ring slot of the open query, -1 if none
+  };
+
+  std::vector<Scope> scopes_;
+  int frame_;
+  bool enabled_;
+  bool active_;                                    // a query is open
+};
+
+// Shadow copy of the GL state the renderer sets: the program, vertex array, buffer
+// and texture bindings, the capabilities and the blend, depth and clear state.
+// Calls setting state to what it already is are dropped before they reach the
+// driver. Every call is counted as issued or elided, and the calls the cache does
+// not shadow (draws, uniforms, attribute pointers) can be added as issued with
+// countCalls(), so the counts cover a whole frame.
+//
+// The element array binding belongs to the vertex array object and is forgotten
+// whenever another one is bound. Code changing any of the state behind the
+// cache's back must call invalidate() afterwards. Knows a single context.
+class GlStateCache : Noncopyable {
+public:
+  static const int MAX_TEXTURE_UNITS = 16;        // units whose 2D texture is tracked
+
+  GlStateCache();
+
+  void useProgram(GLuint program);
+  void bindVertexArray(GLuint vertexArray);
+  void bindBuffer(GLenum target, GLuint buffer);
+  // Binds a range to an indexed binding point, and the buffer to the target
+  void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size);
+  void activeTexture(GLenum unit);
+  void bindTexture(GLenum target, GLuint texture);  // on the active unit
+  void setEnabled(GLenum capability, bool enabled);
+  void blendFunc(GLenum source, GLenum destination);
+  void depthFunc(GLenum func);
+  void depthMask(bool mask);
+  void clearColor(GLfloat r, GLfloat g, GLfloat b, GLfloat a);
+
+  // Adds calls issued around the cache to the counts of this frame
+  void countCalls(int numCalls) {
+    issued_ += numCalls;
+  }
+
+  // Forgets all the state, the next call of every kind reaches the driver
+  void invalidate();
+
+  // Keeps the counts of the frame that ends for lastIssued() and lastElided()
+  void endFrame();
+
+  int lastIssued() const {
+    return lastIssued_;
+  }
+
+  int lastElided() const {
+    return lastElided_;
+  }
+
+private:
+  struct BufferBinding {
+    GLenum target;
+    GLuint buffer;
+  };
+
+  struct IndexedBinding {
+    GLenum target;
+    GLuint index;
+    GLuint buffer;
+    GLintptr offset;
+    GLsizeiptr size;
+  };
+
+  struct Capability {
+    GLenum capability;
+    bool enabled;
+  };
+
+  // Counts the call and returns whether it has to be issued
+  bool changes(bool unchanged);
+
+  static const GLuint UNKNOWN = ~0u;
+
+  GLuint program_;
+  GLuint vertexArray_;
+  std::vector<BufferBinding> buffers_;           // bindings known, one per target
+  std::vector<IndexedBinding> indexedBuffers_;   // ranges known, one per binding point
+  GLenum activeTexture_;
+  GLuint textures_[MAX_TEXTURE_UNITS];           // GL_TEXTURE_2D of every unit
+  std::vector<Capability> capabilities_;         // capabilities known
+  GLenum blendSource_, blendDestination_;
+  GLenum depthFunc_;
+  int depthMask_;                                // -1 unknown
+  GLfloat clearColor_[4];
+  bool clearColorKnown_;
+  int issued_, elided_;
+  int lastIssued_, lastElided_;
+};
+
+// Uniform buffer cycling through RING_SIZE regions, one for every frame in flight,
+// so that the blocks of a frame never overwrite those of a frame the GPU may still
+// be reading. The blocks of a frame are staged at the offset alignment of the
+// driver, uploaded with one call and bound by their offsets.
+class UniformBufferRing : Noncopyable {
+public:
+  static const int RING_SIZE = 3;                  // frames whose blocks may be in flight
+
+  // Has room for numBlocks blocks of frameSize bytes in all every frame
+  UniformBufferRing(GLsizeiptr frameSize, int numBlocks, GlStateCache& state);
+  ~UniformBufferRing();
+
+  // Starts the blocks of a new frame in the next region
+  void beginFrame();
+
+  // Stages a block of this frame, returns its offset in the buffer
+  GLintptr push(const void* data, GLsizeiptr size);
+
+  // Uploads the blocks staged for this frame, before anything is drawn with them
+  void upload();
+
+  // Casts to GLuint so can be used directly by glBindBufferRange and so on
+  operator GLuint() const {
+    return handle_;
+  }
+
+private:
+  GLuint handle_;
+  GlStateCache& state_;
+  GLint alignment_;
+  GLsizeiptr regionSize_;
+  int region_;
+  std::vector<unsigned char> staging_;
+  GLsizeiptr used_;
+};
+
+// Buffer for data written anew every frame, such as the instance data. The buffer
+// is split into RING_SIZE regions written round robin, one per frame, so the CPU
+// fills one region while the GPU still reads the others and does not wait for it
+// unless it gets RING_SIZE - 1 frames ahead.
+//
+// With ARB_buffer_storage the buffer is mapped once, persistently and coherently,
+// and a fence after the draws of a frame tells when its region may be written
+// again. Without it every region is mapped unsynchronized with glMapBufferRange
+// and the whole buffer is orphaned whenever the ring wraps, so that the driver
+// hands out fresh storage instead of waiting. Without map buffer range either the
+// data is staged and written with glBufferSubData into a buffer orphaned every
+// frame. Needs a current context from construction to destruction.
+class StreamingBuffer : Noncopyable {
+public:
+  static const int RING_SIZE = 3;                  // frames whose regions may be in flight
+
+  enum Mode {
+    PERSISTENT_MAPPING,
+    UNSYNCHRONIZED_MAPPING,
+    BUFFER_SUB_DATA
+  };
+
+  StreamingBuffer(GLenum target, GLsizeiptr regionSize, GlStateCache& state);
+  ~StreamingBuffer();
+
+  // Returns where the data of this frame goes, regionSize bytes. Waits only while
+  // the GPU still reads the region from RING_SIZE frames ago
+  void* map();
+
+  // Hands the first size bytes written since map() to the GPU, returns their
+  // offset in the buffer
+  GLintptr commit(GLsizeiptr size);
+
+  // Fences the draws reading this frame's region, call after the last of them
+  void endFrame();
+
+  Mode mode() const {
+    return mode_;
+  }
+
+  const char* modeName() const;
+
+  // Frames map() had to wait for the GPU
+  int numWaits() const {
+    return waits_;
+  }
+
+  // Casts to GLuint so can be used directly by glBindBuffer and so on
+  operator GLuint() const {
+    return buffer_;
+  }
+
+private:
+  GlBufferObject buffer_;
+  GlStateCache& state_;
+  GLenum target_;
+  Mode mode_;
+  GLsizeiptr regionSize_;
+  int region_;
+  unsigned char* persistent_;                      // the whole buffer, PERSISTENT_MAPPING
+  unsigned char* mapped_;                          // region mapped by map()
+  GLsync fences_[RING_SIZE];
+  std::vector<unsigned char> staging_;             // BUFFER_SUB_DATA
+  int waits_;
+};
+
 // Safe versions of various functions that handle GLSL shader attributes
 // and variables: These mainly issue a warning when specified attributes
 // and variables do not exist in the compiled GLSL program (e.g., due to
@@ -0,0 +1,103 @@
+#include <stdexcept>
+
+#include "glsupport.h"
+#include "headless.h"
+
+using namespace std;
+
+#ifdef __APPLE__
+
+void createHeadlessContext(int width, int height) {
+  throw runtime_error("headless rendering needs EGL and is not available on OS X");
+}
+
+void destroyHeadlessContext() {}
+
+#else
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+static EGLContext headlessContext = EGL_NO_CONTEXT;
+static GLuint headlessFramebuffer, headlessColorBuffer, headlessDepthBuffer;
+
+static EGLDisplay getHeadlessDisplay() {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay) {
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY)
+      return display;
+  }
+  return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+void createHeadlessContext(int width, int height) {
+  headlessDisplay = getHeadlessDisplay();
+  if (headlessDisplay == EGL_NO_DISPLAY || !eglInitialize(headlessDisplay, NULL, NULL))
+    throw runtime_error("eglInitialize fails");
+  if (!eglBindAPI(EGL_OPENGL_API))
+    throw runtime_error("EGL does not support desktop OpenGL");
+
+  // No surface is ever created, so any config able to render OpenGL will do. Without
+  // one, fall back to EGL_KHR_no_config_context
+  const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLConfig config = (EGLConfig)0;
+  EGLint numConfigs = 0;
+  eglChooseConfig(headlessDisplay, configAttributes, &config, 1, &numConfigs);
+
+  // Compatibility profile, the shaders still use attribute and varying
+  const EGLint contextAttributes[] = {
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+    EGL_NONE
+  };
+  headlessContext = eglCreateContext(headlessDisplay, numConfigs > 0 ? config : (EGLConfig)0,
+                                     EGL_NO_CONTEXT, contextAttributes);
+  if (headlessContext == EGL_NO_CONTEXT)
+    throw runtime_error("eglCreateContext fails");
+  if (!eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, headlessContext))
+    throw runtime_error("eglMakeCurrent fails");
+
+  // glewInit insists on a GLX display, glewContextInit only loads the entry points
+  glewExperimental = GL_TRUE;
+  if (glewContextInit() != GLEW_OK)
+    throw runtime_error("glewContextInit fails");
+
+  glGenRenderbuffers(1, &headlessColorBuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, headlessColorBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+  glGenRenderbuffers(1, &headlessDepthBuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, headlessDepthBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+  glGenFramebuffers(1, &headlessFramebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, headlessFramebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headlessColorBuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headlessDepthBuffer);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    throw runtime_error("headless framebuffer is incomplete");
+
+  glDrawBuffer(GL_COLOR_ATTACHMENT0);
+  glReadBuffer(GL_COLOR_ATTACHMENT0);
+  glViewport(0, 0, width, height);
+  checkGlErrors(__FILE__, __LINE__);
+}
+
+void destroyHeadlessContext() {
+  if (headlessContext == EGL_NO_CONTEXT)
+    return;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &headlessFramebuffer);
+  glDeleteRenderbuffers(1, &headlessColorBuffer);
+  glDeleteRenderbuffers(1, &headlessDepthBuffer);
+
+  eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(headlessDisplay, headlessContext);
+  eglTerminate(headlessDisplay);
+  headlessContext = EGL_NO_CONTEXT;
+  headlessDisplay = EGL_NO_DISPLAY;
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+// Creates an offscreen OpenGL context for machines without a display server and
+// binds a width x height framebuffer object (RGBA8 color, 24 bit depth) as the
+// draw and read target, so rendering works exactly as with a window. Uses EGL on
+// the surfaceless Mesa platform, which runs on llvmpipe, and falls back to the
+// default EGL display. Throws runtime_error when no context can be created.
+void createHeadlessContext(int width, int height);
+
+// Destroys the framebuffer object and the context made by createHeadlessContext
+void destroyHeadlessContext();
+
+#endif
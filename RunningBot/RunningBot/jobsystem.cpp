@@ -0,0 +1,117 @@
+#include <algorithm>
+
+#include "jobsystem.h"
+
+JobSystem::JobSystem(int numThreads) : body_(NULL), pendingJobs_(0), generation_(0), quit_(false) {
+    if(numThreads < 1)
+        numThreads = 1;
+    for(int i=0; i<numThreads; i++)
+        queues_.push_back(new Queue());
+    for(int i=1; i<numThreads; i++)
+        workers_.push_back(std::thread(&JobSystem::workerLoop, this, i));
+}
+
+JobSystem::~JobSystem() {
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex_);
+        quit_ = true;
+    }
+    wakeCondition_.notify_all();
+    for(size_t i=0; i<workers_.size(); i++)
+        workers_[i].join();
+    for(size_t i=0; i<queues_.size(); i++)
+        delete queues_[i];
+}
+
+/**
+ * Function to get the next job of a thread, the newest of its own queue or else the
+ * oldest of another one, trying the others round robin starting after itself
+ *
+ * Function: popJob
+ */
+bool JobSystem::popJob(int thread, Job &job) {
+    Queue &own = *queues_[thread];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if(!own.jobs.empty()) {
+            job = own.jobs.back();
+            own.jobs.pop_back();
+            return true;
+        }
+    }
+    for(int i=1; i<numThreads(); i++) {
+        Queue &victim = *queues_[(thread + i) % numThreads()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if(!victim.jobs.empty()) {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void JobSystem::runJobs(int thread) {
+    Job job;
+    while(popJob(thread, job)) {
+        (*body_)(job.first, job.last);
+        if(--pendingJobs_ == 0) {
+            // Taking the lock orders the notify after the wait of parallelFor
+            std::lock_guard<std::mutex> lock(wakeMutex_);
+            doneCondition_.notify_all();
+        }
+    }
+}
+
+void JobSystem::workerLoop(int thread) {
+    int seenGeneration = 0;
+    for(;;) {
+        {
+            std::unique_lock<std::mutex> lock(wakeMutex_);
+            wakeCondition_.wait(lock, [&] { return quit_ || generation_ != seenGeneration; });
+            if(quit_)
+                return;
+            seenGeneration = generation_;
+        }
+        runJobs(thread);
+    }
+}
+
+void JobSystem::parallelFor(int count, int grainSize, const RangeJob &body) {
+    if(count <= 0)
+        return;
+    if(grainSize < 1)
+        grainSize = 1;
+    if(numThreads() == 1 || count <= grainSize) {
+        body(0, count);
+        return;
+    }
+
+    // Deal the ranges out in contiguous blocks, so each thread starts on its own part
+    // of the output and only steals once it runs dry
+    const int numJobs = (count + grainSize - 1) / grainSize;
+    const int jobsPerThread = (numJobs + numThreads() - 1) / numThreads();
+    body_ = &body;
+    pendingJobs_ = numJobs;
+    for(int i=0; i<numJobs; i++) {
+        Job job;
+        job.first = i * grainSize;
+        job.last = std::min(count, job.first + grainSize);
+        Queue &queue = *queues_[i / jobsPerThread];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        // the owner pops from the back, so pushing to the front keeps its ranges in order
+        queue.jobs.push_front(job);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(wakeMutex_);
+        generation_++;
+    }
+    wakeCondition_.notify_all();
+
+    runJobs(0);
+
+    std::unique_lock<std::mutex> lock(wakeMutex_);
+    doneCondition_.wait(lock, [&] { return pendingJobs_ == 0; });
+    body_ = NULL;
+}
@@ -0,0 +1,66 @@
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A small work-stealing job system. Every thread owns a queue of jobs: it takes
+ * work from the back of its own queue and, once that is empty, steals from the
+ * front of the others, so threads that finish early help the slow ones instead
+ * of idling. The thread calling parallelFor takes part as thread 0 and the call
+ * returns only once every job has run, which is the join before submission.
+ *
+ * The queues are guarded by a mutex each; jobs are ranges of many bots, so the
+ * locking is small next to the work of a job
+ *
+ * Structure: JobSystem
+ */
+class JobSystem {
+public:
+    typedef std::function<void(int first, int last)> RangeJob;
+
+    // numThreads counts the calling thread, 1 runs everything inline
+    explicit JobSystem(int numThreads);
+    ~JobSystem();
+
+    int numThreads() const {
+        return (int)queues_.size();
+    }
+
+    // Runs body over [0, count) split into ranges of grainSize elements and waits
+    // for all of them. Not reentrant, body must not call parallelFor itself
+    void parallelFor(int count, int grainSize, const RangeJob &body);
+
+private:
+    struct Job {
+        int first, last;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    bool popJob(int thread, Job &job);
+    void runJobs(int thread);
+    void workerLoop(int thread);
+
+    std::vector<Queue*> queues_;
+    std::vector<std::thread> workers_;
+    const RangeJob *body_;
+    std::atomic<int> pendingJobs_;
+
+    std::mutex wakeMutex_;
+    std::condition_variable wakeCondition_;
+    std::condition_variable doneCondition_;
+    int generation_;                        // bumped for every parallelFor
+    bool quit_;
+};
+
+#endif
@@ -1,11 +1,30 @@
 
-#include <glut.h>
 #include "glsupport.h"
 #include "matrix4.h"
 #include "geometrymaker.h"
 #include <vector>
+#include <chrono>
+#include <assert.h>
 #include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "quat.h"
+#include "scenegraph.h"
+#include "bot.h"
+#include "crowd.h"
+#include "partinstance.h"
+#include "camera.h"
+#include "benchmark.h"
+#include "headless.h"
+#include "frameclock.h"
+#include "pipeline.h"
+#include "spherelod.h"
+#include "meshoptimizer.h"
+#include "vertexformat.h"
+#include "uniformblocks.h"
+#include "meshregistry.h"
+#include "selfcheck.h"
 
 GLuint program;
 
@@ -14,41 +33,162 @@ GLuint indexBO;
 GLuint colorBufferObject;
 GLuint normalBufferObject;
 
+// Instance buffer, refilled every frame with the matrices of the body parts in a
+// region of its own, created in init()
+StreamingBuffer *instanceStream = NULL;
+
+// Every mesh, packed into the shared vertex, color and index buffers: the levels of
+// the sphere a part may be drawn with
+MeshRegistry meshRegistry;
+int sphereMeshes[NUM_SPHERE_LODS];
+
+// The draws of a frame go out as one glMultiDrawElementsIndirect where the context
+// has multi draw indirect and base instances, with the draw commands streamed into
+// their own buffer. Otherwise every draw is an instanced call of its own
+bool useMultiDrawIndirect = false;
+StreamingBuffer *drawCommandStream = NULL;
+const int MAX_DRAW_COMMANDS = 64;
+
 GLuint postionAttributeFromVertexShader;
 GLuint colorAttributeFromVertexShader;
 GLuint normalAttributeFromVertexShader;
+GLuint modelViewMatrixAttributeFromVertexShader;
+GLuint normalMatrixAttributeFromVertexShader;
 
 GLuint uColorUniformFromFragmentShader;
 GLuint lightPositionUniformFromFragmentShader;
-GLuint modelViewMatrixUniformFromVertexShader;
-GLuint normalMatrixUniformFromVertexShader;
 GLuint projectionMatrixUniformFromVertexShader;
+GLuint normalEncodingUniformFromVertexShader;
+GLuint positionScaleUniformFromVertexShader;
+
+Camera camera;
+RunningBot bot;
 
-Matrix4 eyeMatrix;
+// GPU time of the passes of a frame, created in init() once there is a context
+GpuTimers *gpuTimers = NULL;
+int clearTimer, botBodyTimer;
+bool showGpuTimings = false;
+
+// Shadow of the GL state that drops redundant state changes and counts the GL
+// calls of a frame, created at the start of init()
+GlStateCache *glState = NULL;
+
+// The uniforms of a frame and of the meshes are kept in uniform buffers where the
+// context has ARB_uniform_buffer_object, and set one by one otherwise. Frames cycle
+// through a ring of uniform buffer regions, every mesh has a block of its own
+bool useUniformBlocks = false;
+UniformBufferRing *frameUniformRing = NULL;
+GLuint meshUniformBufferObject;
 
 float frameSpeed = 10.0f;
+int gait = RUN_GAIT;
+bool wave = false;
 float lightXOffset = -0.5773, lightYOffset = 0.5773, lightZOffset = 10.0;
 float redOffset = 1.0, blueOffset = 1.0, greenOffset = 1.0;
 float botX = 0.0, botY = 0.0, botZ = 0.0;
 float botXDegree = 0.0, botYDegree = 0.0, botZDegree = 0.0;
-int numIndices, timeSinceStart = 0.0;
-
-struct VertexPN {
-    Cvec3f p;
-    Cvec3f n;
-    VertexPN() {}
-    VertexPN(float x, float y, float z, float nx, float ny, float nz) : p(x,y,z), n(nx, ny, nz) {}
-    
-    VertexPN& operator = (const GenericVertex& v) {
-        p = v.pos;
-        n = v.normal;
-        return *this;
+
+// Format the vertices of the sphere are stored in, set with --vertex-format
+int vertexFormat = VERTEX_FORMAT_SNORM16;
+
+// Upper bound of the body parts drawn by a single instanced draw call, raised in
+// init() to fit a crowd
+const int MAX_PART_INSTANCES = 1024;
+int maxPartInstances = MAX_PART_INSTANCES;
+
+// Frames are simulated on their own thread one frame ahead of the GL thread, unless
+// pipelined is turned off with --serial
+bool pipelined = true;
+FramePipeline *pipeline = NULL;
+
+// Instances as the simulation writes them, before they are grouped by the level of
+// the sphere mesh into the snapshot
+std::vector<PartInstance> unsortedInstances;
+SphereLodSorter sphereLodSorter;
+
+// Number of bots of the crowd mode, 0 draws the single bot driven by the keyboard.
+// In crowd mode the keys move the whole crowd
+int crowdSize = 0;
+Crowd crowd;
+const float CROWD_SPACING = 12.0f;
+
+// Frames are capped at frameCap per second (0 renders as fast as possible) and the
+// wait for the next frame sleeps in GLUT's timer instead of spinning in idle().
+// renderTime is the wall time the frames have taken so far
+int frameCap = 60;
+bool vsync = false;
+int lastDisplayTime = -1;
+float renderTime = 0.0f;
+float lastRenderTime = 0.0f;
+double nextFrameTime = 0.0;
+bool frameScheduled = false;
+
+// Bots drawn at every level of detail and what was culled in the last frame
+// submitted, for 'T' and --headless. The distances are set in the crowd with --lod
+DrawCounts lastDrawCounts;
+
+// Threads posing the crowd, 0 uses every core
+int numThreads = 0;
+JobSystem *jobSystem = NULL;
+float cameraDistance = 30.0f, cameraPitch = 0.0f;
+
+// The fixed timestep clock of the animation, fed with the time between the frames,
+// the animation state of the single bot before and after the last step and the
+// gait and wave of the last simulated frame, owned by whichever thread simulates
+FrameClock frameClock;
+GaitState botGait, previousBotGait;
+float lastSimulatedTime = 0.0f;
+int lastSimulatedGait = RUN_GAIT;
+bool lastSimulatedWave = false;
+
+/**
+ * Function to enable a mat4 per instance attribute of the bound vertex array. A
+ * matrix attribute occupies four consecutive attribute locations, one for every
+ * column
+ *
+ * Function: enableInstanceMatrixAttribute
+ *           attribute - Location of the first column of the matrix
+ */
+void enableInstanceMatrixAttribute(GLuint attribute) {
+    for(int i=0; i<4; i++) {
+        glEnableVertexAttribArray(attribute + i);
+        glVertexAttribDivisor(attribute + i, 1);
     }
-};
+}
+
+/**
+ * Function to point a mat4 per instance attribute at the bound array buffer
+ *
+ * Function: bindInstanceMatrixAttribute
+ *           attribute - Location of the first column of the matrix
+ *           offset - Byte offset of the matrix in the buffer
+ */
+void bindInstanceMatrixAttribute(GLuint attribute, size_t offset) {
+    for(int i=0; i<4; i++) {
+        glVertexAttribPointer(attribute + i, 4, GL_FLOAT, GL_FALSE, sizeof(PartInstance),
+                              (void*)(offset + sizeof(GLfloat) * 4 * i));
+    }
+    glState->countCalls(4);
+}
+
+/**
+ * Function to point a per vertex attribute at the bound array buffer in the layout
+ * of a vertex format
+ *
+ * Function: bindVertexAttribute
+ *           attribute - Location of the attribute
+ *           layout - Size, type and offset of the attribute in a vertex
+ *           stride - Bytes from one vertex to the next
+ */
+void bindVertexAttribute(GLuint attribute, const VertexAttributeFormat &layout, GLsizei stride) {
+    glVertexAttribPointer(attribute, layout.size, layout.type, layout.normalized, stride, (void*)(size_t)layout.offset);
+    glEnableVertexAttribArray(attribute);
+}
 
 /**
  * Structure to hold all the attribute, uniform, buffer object locations and bind
- * them to the buffers accordingly
+ * them to the buffers accordingly. The vertex layout of a mesh in its format is
+ * recorded once in a vertex array object
  *
  * Structure: BufferBinder
  */
@@ -56,352 +196,502 @@ struct BufferBinder {
     GLuint vertexBufferObject;
     GLuint colorBufferObject;
     GLuint indexBufferObject;
+    GLuint instanceBufferObject;
     GLuint positionAttribute;
     GLuint colorAttribute;
     GLuint normalAttribute;
-    GLuint modelViewMatrixUniform;
-    GLuint normalMatrixUniform;
-    int numIndices;
+    GLuint modelViewMatrixAttribute;
+    GLuint normalMatrixAttribute;
+    const VertexFormat *format;
+    GLuint vertexArrayObject;
+    GLintptr meshUniformOffset;         // MeshUniforms of the mesh in meshUniformBufferObject
     
-    void draw() {
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBufferObject);
-        glVertexAttribPointer(postionAttributeFromVertexShader, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), (void*)offsetof(VertexPN, p));
-        glEnableVertexAttribArray(postionAttributeFromVertexShader);
+    // Records the vertex, color and index buffers in the layout of the format and
+    // the enabled per instance attributes, once the buffers are filled
+    void createVertexArray() {
+        glGenVertexArrays(1, &vertexArrayObject);
+        glState->bindVertexArray(vertexArrayObject);
         
-        glVertexAttribPointer(normalAttributeFromVertexShader, 3, GL_FLOAT, GL_FALSE, sizeof(VertexPN), (void*)offsetof(VertexPN, n));
-        glEnableVertexAttribArray(normalAttributeFromVertexShader);
+        glState->bindBuffer(GL_ARRAY_BUFFER, vertexBufferObject);
+        bindVertexAttribute(positionAttribute, format->position, format->stride);
+        bindVertexAttribute(normalAttribute, format->normal, format->stride);
         
-        glBindBuffer(GL_ARRAY_BUFFER, colorBufferObject);
-        glVertexAttribPointer(colorAttributeFromVertexShader, 4, GL_FLOAT, GL_FALSE, 0, 0);
-        glEnableVertexAttribArray(colorAttributeFromVertexShader);
+        glState->bindBuffer(GL_ARRAY_BUFFER, colorBufferObject);
+        bindVertexAttribute(colorAttribute, format->color, format->colorStride);
         
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferObject);
+        glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBufferObject);
+        enableInstanceMatrixAttribute(modelViewMatrixAttribute);
+        enableInstanceMatrixAttribute(normalMatrixAttribute);
+    }
+    
+    void draw() {
+        glState->bindVertexArray(vertexArrayObject);
+        if(useUniformBlocks) {
+            glState->bindBufferRange(GL_UNIFORM_BUFFER, MESH_UNIFORMS_BINDING, meshUniformBufferObject,
+                                     meshUniformOffset, sizeof(MeshUniforms));
+        }
+    }
+    
+    // Points the per instance attributes at the instances from the byte offset on.
+    // Without a base instance the offset goes into the attribute pointers, which
+    // change the vertex array for every level
+    void bindInstances(size_t offset) {
+        glState->bindBuffer(GL_ARRAY_BUFFER, instanceBufferObject);
+        bindInstanceMatrixAttribute(modelViewMatrixAttribute, offset + offsetof(PartInstance, modelViewMatrix));
+        bindInstanceMatrixAttribute(normalMatrixAttribute, offset + offsetof(PartInstance, normalMatrix));
     }
 };
 
+// Generic bufferBinder object as the same buffers are used to render all the objects
+// in hierarchy
+BufferBinder genericBufferBinder;
+
 /**
- * Structure to perform the Hierarchical operations on children objects and to issue
- * a draw call via drawElements
+ * Function to pack the accumulated matrices of every node of a scene graph whose
+ * bounding sphere reaches into the frustum into the per instance array
  *
- * Structure: Entity
+ * Function: writeSceneInstances
+ *           graph - Scene graph whose model view matrices are up to date
+ *           frustum - View frustum in eye space
+ *           instances - Destination, must have room for graph.size() entries
  */
-
-struct Entity {
-    Matrix4 objectMatrix;
-    BufferBinder bufferBinder;
-    Matrix4 modelViewMatrix;
-    Entity *parent;
-    
-    void draw(Matrix4 &eyeMatrix) {
-        if(parent == NULL)
-            modelViewMatrix = inv(eyeMatrix) * objectMatrix;
-        else
-            modelViewMatrix = (parent->modelViewMatrix) * (objectMatrix);
-        
-        bufferBinder.draw();
-        
-        GLfloat glmatrix[16];
-        modelViewMatrix.writeToColumnMajorMatrix(glmatrix);
-        glUniformMatrix4fv(modelViewMatrixUniformFromVertexShader, 1, GL_FALSE, glmatrix);
-        
-        Matrix4 normalMatrix = transpose(inv(modelViewMatrix));
-        normalMatrix.writeToColumnMajorMatrix(glmatrix);
-        glUniformMatrix4fv(normalMatrixUniformFromVertexShader, 1, GL_FALSE, glmatrix);
-        
-        Matrix4 projectionMatrix;
-        projectionMatrix = projectionMatrix.makeProjection(45, (1280.0/800.0), -0.5, -1000.0);
-        GLfloat glmatrixProjection[16];
-        projectionMatrix.writeToColumnMajorMatrix(glmatrixProjection);
-        glUniformMatrix4fv(projectionMatrixUniformFromVertexShader, 1, GL_FALSE, glmatrixProjection);
-        
-        glDrawElements(GL_TRIANGLES, bufferBinder.numIndices, GL_UNSIGNED_SHORT, 0);
+int writeSceneInstances(const SceneGraph &graph, const Frustum &frustum, PartInstance *instances) {
+    int numInstances = 0;
+    for(int i=0; i<graph.size(); i++) {
+        const Affine3 &m = graph[i].modelViewMatrix;
+        if(classifySphere(frustum, float(m(0,3)), float(m(1,3)), float(m(2,3)), partBoundingRadius(m)) != SPHERE_OUTSIDE)
+            writePartInstance(m, graph[i].normalMatrix, instances[numInstances++]);
     }
-};
+    return numInstances;
+}
 
 /**
- * Function to issue a draw call to the respective entity object by assigning all the
- * required attributes
+ * Function to gather the state the user controls with the keyboard for the
+ * simulation of a frame. Called on the GL thread, which is the one running keyboard()
  *
- * Function: drawBodyParts
- *           bufferBinder - Structure to bind the resepective attributes and buffer objects
- *           objectMatrix - Object matrix with respect to the object frame
- *           parent - Immediate hierarchical parent
+ * Function: currentControls
+ *           elapsedTime - Animation time of the frame in milliseconds
  */
-Entity *drawBodyParts(BufferBinder bufferBinder, Matrix4 objectMatrix, Entity *parent) {
-    Entity *partEntity = new Entity;
-    partEntity->parent = parent;
-    partEntity->bufferBinder = bufferBinder;
-    partEntity->objectMatrix = objectMatrix;
-    partEntity->draw(eyeMatrix);
-    return partEntity;
+SceneControls currentControls(float elapsedTime) {
+    SceneControls controls;
+    controls.time = elapsedTime;
+    controls.frameSpeed = frameSpeed;
+    controls.gait = gait;
+    controls.wave = wave;
+    controls.frustum = Frustum(camera.projectionMatrix);
+    controls.pixelScale = float(camera.pixelScale);
+    controls.botPosition = Cvec3(botX, botY, botZ);
+    controls.botXDegree = botXDegree;
+    controls.botYDegree = botYDegree;
+    controls.botZDegree = botZDegree;
+    controls.lightPosition = Cvec3f(lightXOffset, lightYOffset, lightZOffset);
+    controls.color = Cvec3f(redOffset, greenOffset, blueOffset);
+    return controls;
 }
 
 /**
- * Function to restrict the motion of a body part to an angle and to perform the rotation
- * cycles continuously rather than a sudden complete switch of the offset angle
+ * Function to simulate a frame on the CPU: poses the bot or the crowd, accumulates
+ * the hierarchy and packs the per instance data. No GL calls are made and no global
+ * the keyboard changes is read, so this can run on the simulation thread
  *
- * Function: calculateTimeAngle
- * anglePerRev - Offset angle after which the motion repeats smoothly
- * timeSinceStart - Variable which is applied as an angle
+ * Function: simulateFrame
+ *           controls - State of the frame
+ *           snapshot - Destination
  */
-float calculateTimeAngle(float anglePerRev, float timeSinceStart) {
-    float timeCrunch = timeSinceStart/anglePerRev;
-    float finalAngle = 0.0;
-    int revolution = floor(timeCrunch);
-    if(revolution%2 == 0)
-        finalAngle = ((timeCrunch) - floor(timeCrunch))*anglePerRev;
-    else
-        finalAngle = (ceil(timeCrunch) - timeCrunch)*anglePerRev;
-    return finalAngle;
-}
-
-void display(void) {
-    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glClearColor(1.0, 1.0, 1.0, 1.0);
-    
-    glUseProgram(program);
-    
-    timeSinceStart = glutGet(GLUT_ELAPSED_TIME);
-    glUniform4f(lightPositionUniformFromFragmentShader, lightXOffset, lightYOffset, lightZOffset, 0.0);
-    glUniform4f(uColorUniformFromFragmentShader, redOffset, greenOffset, blueOffset, 1.0);
+void simulateFrame(const SceneControls &controls, FrameSnapshot &snapshot) {
+    snapshot.controls = controls;
     
     // ------------------------------- EYE -------------------------------
-    eyeMatrix = quatToMatrix(Quat::makeYRotation(40.0)) *
-                quatToMatrix(Quat::makeYRotation(botYDegree)) *
-                quatToMatrix(Quat::makeXRotation(botXDegree)) *
-                quatToMatrix(Quat::makeZRotation(botZDegree));
-    eyeMatrix = eyeMatrix * eyeMatrix.makeTranslation(Cvec3(0.0, 0.0, 30.0));
+    // The eye and its inverse are computed once here and shared by the whole frame
+    Matrix4 eyeMatrix = quatToMatrix(Quat::makeYRotation(40.0)) *
+                        quatToMatrix(Quat::makeYRotation(controls.botYDegree)) *
+                        quatToMatrix(Quat::makeXRotation(controls.botXDegree)) *
+                        quatToMatrix(Quat::makeZRotation(controls.botZDegree)) *
+                        quatToMatrix(Quat::makeXRotation(cameraPitch));
+    snapshot.eyeMatrix = eyeMatrix * Matrix4::makeTranslation(Cvec3(0.0, 0.0, cameraDistance));
+    snapshot.viewMatrix = inv(snapshot.eyeMatrix);
     // ------------------------------- EYE -------------------------------
     
-    // Initialising a Genric bufferBinder object as the same buffers are used to
-    // render all the objects in hierarchy
-    BufferBinder genericBufferBinder;
-    genericBufferBinder.vertexBufferObject = vertexPositionVBO;
-    genericBufferBinder.colorBufferObject = colorBufferObject;
-    genericBufferBinder.indexBufferObject = indexBO;
-    genericBufferBinder.numIndices = numIndices;
-    genericBufferBinder.positionAttribute = postionAttributeFromVertexShader;
-    genericBufferBinder.colorAttribute = colorAttributeFromVertexShader;
-    genericBufferBinder.normalAttribute = normalAttributeFromVertexShader;
-    
-    // ------------------------------- TRUNK -------------------------------
-    Matrix4 trunkMatrix = Matrix4::makeTranslation(Cvec3(botX, botY, botZ)) *
-                          Matrix4::makeScale(Cvec3(2.0, 3.0, 1.0));
-    
-    Entity *trunkEntity = drawBodyParts(genericBufferBinder, trunkMatrix, NULL);
-    // ------------------------------- TRUNK -------------------------------
+    // The time since the last simulated frame is used up in fixed animation steps, so
+    // the fades and cycles move on the same however long the frames take and a new
+    // frameSpeed changes the pace without making the pose jump. The frame is posed
+    // between the state before and after the last step by what is left of a step
+    const int steps = frameClock.advance(controls.time - lastSimulatedTime);
+    const float stepTime = float(frameClock.stepMs), interpolation = frameClock.interpolation();
+    lastSimulatedTime = controls.time;
+    const bool gaitChanged = controls.gait != lastSimulatedGait;
+    const bool waveChanged = controls.wave != lastSimulatedWave;
+    lastSimulatedGait = controls.gait;
+    lastSimulatedWave = controls.wave;
     
-    // ------------------------------- HEAD -------------------------------
-    Matrix4 axisShiftMatrix;
-    
-    Matrix4 headMatrix = Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
-                         Matrix4::makeTranslation(Cvec3(0.0, 4.8, 0.0)) *
-                         quatToMatrix(Quat::makeYRotation(45-calculateTimeAngle(90, timeSinceStart/frameSpeed))) *
-                         Matrix4::makeScale(Cvec3(1.0, 1.2, 1.0));
-    
-    Entity *headEntity = drawBodyParts(genericBufferBinder, headMatrix, trunkEntity);
-    // ------------------------------- HEAD -------------------------------
-    
-    // ------------------------------ EYES -------------------------------
-    for(int i=0; i<2; i++) {
-        Matrix4 botEyeMatrix = Matrix4::makeScale(Cvec3(1.0/1.0, 1.0/1.2, 1.0/1.0)) *
-                               Matrix4::makeTranslation(Cvec3(0.7 - (1.4*i), 0.4, 1.0)) *
-                               Matrix4::makeScale(Cvec3(1.0/5.0, 1.0/5.0, 1.0/5.0));
+    const Affine3 viewMatrix(snapshot.viewMatrix);
+    int numInstances;
+    if(crowd.size() > 0) {
+        if(gaitChanged)
+            crowd.setGait(controls.gait);
+        if(waveChanged)
+            crowd.setAdditive(controls.wave);
+        // Every bot in view is animated and posed from the skeleton template straight
+        // into its instances, spread over the threads of the job system, at a level
+        // of detail picked by its distance from the eye
+        const Cvec3 eyePosition(snapshot.eyeMatrix(0,3), snapshot.eyeMatrix(1,3), snapshot.eyeMatrix(2,3));
+        numInstances = crowd.update(*jobSystem, bot, steps, stepTime, interpolation, controls.botPosition,
+                                    eyePosition, viewMatrix, normalMatrix(viewMatrix), controls.frustum,
+                                    &unsortedInstances[0]);
+        snapshot.counts = crowd.counts;
+    }
+    else {
+        botGait.setGait(controls.gait);
+        botGait.additive = controls.wave;
+        for(int step=0; step<steps; step++) {
+            previousBotGait = botGait;
+            bot.animation.advance(botGait, stepTime, controls.frameSpeed);
+        }
         
-        drawBodyParts(genericBufferBinder, botEyeMatrix, headEntity);
-    }    
-    
-    // ------------------------------- RIGHT ARM -------------------------------
-    Matrix4 rightArmMatrix = Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
-    Matrix4::makeTranslation(Cvec3(2.8, 5.0, 0.0)) *
-    quatToMatrix(Quat::makeXRotation(180.0) *
-                 Quat::makeXRotation(45-calculateTimeAngle(90,timeSinceStart/frameSpeed))) *
-    Matrix4::makeScale(Cvec3(1.0/1.8, 1.5, 1.0));
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, -1.0, 0.0));
-    rightArmMatrix = axisShiftMatrix * rightArmMatrix * inv(axisShiftMatrix);
-    Entity *rightArmEntity = drawBodyParts(genericBufferBinder, rightArmMatrix, trunkEntity);
-    // ------------------------------- RIGHT ARM -------------------------------
-    
-    // ------------------------------- RIGHT ELBOW -------------------------------
-    Matrix4 rightElbowMatrix = Matrix4::makeScale(Cvec3(1.8, 1.0/1.5, 1.0)) *
-    Matrix4::makeTranslation(Cvec3(0.001, 3.0, 0.0)) *
-    quatToMatrix(Quat::makeXRotation(-45.0)) *
-    Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0));
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, -1.0, 0.0));
-    rightElbowMatrix = axisShiftMatrix * rightElbowMatrix * inv(axisShiftMatrix);
-    Entity *rightElbowEntity = drawBodyParts(genericBufferBinder, rightElbowMatrix, rightArmEntity);
-    // ------------------------------- RIGHT ELBOW -------------------------------
-    
-    // ------------------------------- RIGHT HAND FINGERS -------------------------------
-    for(int i=0; i<4; i++) {
-        Matrix4 rightFingerMatrix = Matrix4::makeScale(Cvec3(2.0, 1.0/1.5, 1.0)) *
-        Matrix4::makeTranslation(Cvec3(0.0, 1.6, 0.7-(0.5*i))) *
-        Matrix4::makeScale(Cvec3(1.0/5.0, 1.0/2.0, 1.0/5.0));
+        // Only the trunk position and the joint angles change from frame to frame, the
+        // body parts themselves were created once in init()
+        float rotations[4][MAX_CLIP_JOINTS];
+        const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+        Cvec3 rootTranslation;
+        bot.evaluateBlendedPose(previousBotGait, botGait, interpolation, rotationArrays, rootTranslation);
+        bot.pose(rotationArrays, rootTranslation, controls.botPosition);
+        bot.skeleton.update(viewMatrix, normalMatrix(viewMatrix));
         
-        drawBodyParts(genericBufferBinder, rightFingerMatrix, rightElbowEntity);
+        numInstances = writeSceneInstances(bot.skeleton, controls.frustum, &unsortedInstances[0]);
+        snapshot.counts.reset();
+        snapshot.counts.drawnParts = numInstances;
+        snapshot.counts.culledParts = bot.skeleton.size() - numInstances;
+        if(numInstances > 0)
+            snapshot.counts.lodCounts[FULL_BOT_LOD] = 1;
+        else
+            snapshot.counts.culledBots = 1;
     }
-    // ------------------------------- RIGHT HAND FINGERS -------------------------------
     
-    // ------------------------------- RIGHT THIGH -------------------------------
-    Matrix4 rightThighMatrix = Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
-                               Matrix4::makeTranslation(Cvec3(-1.5, -6.0, 0.0)) *
-                               quatToMatrix(Quat::makeXRotation(45-calculateTimeAngle(90,timeSinceStart/frameSpeed)))*
-                               Matrix4::makeScale(Cvec3(1.0/1.5, 1.5, 1.0));
+    // Every level of the sphere mesh is drawn by a draw call of its own
+    snapshot.numInstances = sphereLodSorter.sort(jobSystem, &unsortedInstances[0], numInstances, controls.pixelScale,
+                                                 &snapshot.instances[0], snapshot.counts.sphereLodCounts);
+}
+
+/**
+ * Function to issue the GL calls drawing a simulated frame into the bound framebuffer
+ *
+ * Function: submitFrame
+ *           snapshot - Frame to draw
+ */
+void submitFrame(const FrameSnapshot &snapshot) {
+    gpuTimers->begin(clearTimer);
+    glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
+    glState->countCalls(1);
+    gpuTimers->end(clearTimer);
+    glState->setEnabled(GL_BLEND, true);
+    glState->blendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glState->clearColor(1.0, 1.0, 1.0, 1.0);
     
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, 1.0, 0.0));
+    glState->useProgram(program);
     
-    rightThighMatrix = axisShiftMatrix * rightThighMatrix * inv(axisShiftMatrix);
+    const SceneControls &controls = snapshot.controls;
+    if(useUniformBlocks) {
+        // Everything the draws of the frame share goes out in one upload
+        FrameUniforms frameUniforms;
+        memcpy(frameUniforms.projectionMatrix, camera.glProjectionMatrix, sizeof(frameUniforms.projectionMatrix));
+        for(int i=0; i<3; i++) {
+            frameUniforms.lightPosition[i] = controls.lightPosition[i];
+            frameUniforms.color[i] = controls.color[i];
+        }
+        frameUniforms.lightPosition[3] = 0.0f;
+        frameUniforms.color[3] = 1.0f;
+        frameUniformRing->beginFrame();
+        const GLintptr offset = frameUniformRing->push(&frameUniforms, sizeof(frameUniforms));
+        frameUniformRing->upload();
+        glState->bindBufferRange(GL_UNIFORM_BUFFER, FRAME_UNIFORMS_BINDING, *frameUniformRing, offset,
+                                 sizeof(frameUniforms));
+    } else {
+        // Uniform values live in the program object, so the projection only has to be
+        // uploaded again after reshape() changed it
+        if(camera.projectionChanged) {
+            glUniformMatrix4fv(projectionMatrixUniformFromVertexShader, 1, GL_FALSE, camera.glProjectionMatrix);
+            glState->countCalls(1);
+            camera.projectionChanged = false;
+        }
+        glUniform4f(lightPositionUniformFromFragmentShader, controls.lightPosition[0], controls.lightPosition[1], controls.lightPosition[2], 0.0);
+        glUniform4f(uColorUniformFromFragmentShader, controls.color[0], controls.color[1], controls.color[2], 1.0);
+        glState->countCalls(2);
+    }
     
-    Entity *rightThighEntity = drawBodyParts(genericBufferBinder, rightThighMatrix, trunkEntity);
-    // ------------------------------- RIGHT THIGH -------------------------------
+    // All the meshes share the same buffers, so the parts drawn with every level of
+    // the sphere mesh are a single instanced draw, with the per part matrices in the
+    // instance buffer grouped level after level
+    const size_t instanceBytes = sizeof(PartInstance) * snapshot.numInstances;
+    memcpy(instanceStream->map(), &snapshot.instances[0], instanceBytes);
+    const size_t instanceOffset = instanceStream->commit(instanceBytes);
     
-    // ------------------------------- RIGHT KNEE -------------------------------
-    Matrix4 rightKneeMatrix = Matrix4::makeScale(Cvec3(1.5, 1.0/1.5, 1.0)) *
-                              Matrix4::makeTranslation(Cvec3(0.001, -3.0, 0.0)) *
-                              quatToMatrix(Quat::makeXRotation(45-calculateTimeAngle(45,timeSinceStart/frameSpeed)))*
-                              Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0));
+    // One command for every mesh of the registry that has instances in this frame,
+    // the instances of the meshes following each other in the order of the meshes
+    const int numMeshes = meshRegistry.meshes.size();
+    assert(numMeshes <= MAX_DRAW_COMMANDS);
+    int meshInstances[MAX_DRAW_COMMANDS] = {0};
+    for(int i=0; i<NUM_SPHERE_LODS; i++)
+        meshInstances[sphereMeshes[i]] = snapshot.counts.sphereLodCounts[i];
     
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, 1.0, 0.0));
+    DrawElementsIndirectCommand commands[MAX_DRAW_COMMANDS];
+    int numCommands = 0, firstInstance = 0;
+    for(int mesh=0; mesh<numMeshes; mesh++) {
+        if(meshInstances[mesh] == 0)
+            continue;
+        commands[numCommands++] = meshRegistry.drawCommand(mesh, meshInstances[mesh], firstInstance);
+        firstInstance += meshInstances[mesh];
+    }
     
-    rightKneeMatrix = axisShiftMatrix * rightKneeMatrix * inv(axisShiftMatrix);
+    gpuTimers->begin(botBodyTimer);
+    genericBufferBinder.draw();
+    if(useMultiDrawIndirect && numCommands > 0) {
+        // The base instance of every command finds its instances, so the attribute
+        // pointers stay at the start of the frame's instances
+        genericBufferBinder.bindInstances(instanceOffset);
+        const size_t commandBytes = sizeof(DrawElementsIndirectCommand) * numCommands;
+        memcpy(drawCommandStream->map(), commands, commandBytes);
+        const size_t commandOffset = drawCommandStream->commit(commandBytes);
+        glState->bindBuffer(GL_DRAW_INDIRECT_BUFFER, *drawCommandStream);
+#ifndef __APPLE__
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_SHORT, (void*)commandOffset, numCommands, 0);
+#endif
+        glState->countCalls(1);
+        drawCommandStream->endFrame();
+    } else {
+        for(int i=0; i<numCommands; i++) {
+            const DrawElementsIndirectCommand &command = commands[i];
+            genericBufferBinder.bindInstances(instanceOffset + sizeof(PartInstance) * command.baseInstance);
+            glDrawElementsInstanced(GL_TRIANGLES, command.count, GL_UNSIGNED_SHORT,
+                                    (void*)(sizeof(unsigned short) * command.firstIndex), command.instanceCount);
+            glState->countCalls(1);
+        }
+    }
+    instanceStream->endFrame();
+    gpuTimers->end(botBodyTimer);
+}
 
-    Entity *rightKneeEntity = drawBodyParts(genericBufferBinder, rightKneeMatrix, rightThighEntity);
-    // ------------------------------- RIGHT KNEE -------------------------------
-    
-    // ------------------------------- RIGHT FOOT FINGERS -------------------------------
-    for(int i=0; i<3; i++) {
-        Matrix4 rightFootFingerMatrix =  Matrix4::makeScale(Cvec3(2.0, 1/1.5, 1.0)) *
-                                         Matrix4::makeTranslation(Cvec3(0.4-(0.4*i), -1.8, 0.8)) *
-                                         Matrix4::makeScale(Cvec3(1.0/8.0, 1.0/8.0, 1.0/2.0));
-        drawBodyParts(genericBufferBinder, rightFootFingerMatrix, rightKneeEntity);
+/**
+ * Function to render one frame of the bot into the bound framebuffer. The frame is
+ * taken from the pipeline, which simulated it while the previous frame was being
+ * submitted, and the simulation of the next frame is started before this one is
+ * submitted
+ *
+ * Function: renderFrame
+ *           elapsedTime - Animation time of this frame in milliseconds
+ *           nextElapsedTime - Expected animation time of the next frame
+ */
+void renderFrame(float elapsedTime, float nextElapsedTime) {
+    // Nothing is in flight before the first frame
+    static bool started = false;
+    if(!started) {
+        pipeline->request(currentControls(elapsedTime));
+        started = true;
     }
-    // ------------------------------- RIGHT FOOT FINGERS -------------------------------
-    
-    // ------------------------------- LEFT ARM -------------------------------
-    Matrix4 leftArmMatrix = Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
-                            Matrix4::makeTranslation(Cvec3(-2.8, 5.0, 0.0)) *
-                            quatToMatrix(Quat::makeXRotation(180.0) *
-                                         Quat::makeXRotation(calculateTimeAngle(90, timeSinceStart/frameSpeed)-45)) *
-                            Matrix4::makeScale(Cvec3(1.0/1.8, 1.5, 1.0));
-    
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, -1.0, 0.0));
+    FrameSnapshot &snapshot = pipeline->acquire();
+    pipeline->request(currentControls(nextElapsedTime));
     
-    leftArmMatrix = axisShiftMatrix * leftArmMatrix * inv(axisShiftMatrix);
-    
-    Entity *leftArmEntity = drawBodyParts(genericBufferBinder, leftArmMatrix, trunkEntity);
-    // ------------------------------- LEFT ARM -------------------------------
+    lastDrawCounts = snapshot.counts;
+    submitFrame(snapshot);
+    gpuTimers->endFrame();
+    glState->endFrame();
+}
 
-    // ------------------------------- LEFT ELBOW -------------------------------
-    Matrix4 leftElbowMatrix = Matrix4::makeScale(Cvec3(1.8, 1.0/1.5, 1.0)) *
-                              Matrix4::makeTranslation(Cvec3(0.001, 3.0, 0.0)) *
-                              quatToMatrix(Quat::makeXRotation(-45.0)) *
-                              Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0));
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, -1.0, 0.0));
-    leftElbowMatrix = axisShiftMatrix * leftElbowMatrix * inv(axisShiftMatrix);
-    Entity *leftElbowEntity = drawBodyParts(genericBufferBinder, leftElbowMatrix, leftArmEntity);
-    // ------------------------------- LEFT ELBOW -------------------------------
-    
-    // ------------------------------- LEFT HAND FINGERS -------------------------------
-    for(int i=0; i<4; i++) {
-        Matrix4 leftFingerMatrix = Matrix4::makeScale(Cvec3(2.0, 1.0/1.5, 1.0)) *
-                                   Matrix4::makeTranslation(Cvec3(0.0, 1.6, 0.7-(0.5*i))) *
-                                   Matrix4::makeScale(Cvec3(1.0/5.0, 1.0/2.0, 1.0/5.0));
-        
-        drawBodyParts(genericBufferBinder, leftFingerMatrix, leftElbowEntity);
+/**
+ * Function to print how many bots were drawn at every level of detail in the last
+ * frame submitted, how many bots and parts the frustum culling left out, and how
+ * many GL calls the frame issued and how many redundant ones the state cache elided,
+ * and how the instance buffer is streamed and the draws submitted
+ *
+ * Function: dumpDrawCounts
+ */
+void dumpDrawCounts() {
+    const DrawCounts &counts = lastDrawCounts;
+    printf("bots: %d full, %d reduced, %d low rate, %d impostor, %d culled\n",
+           counts.lodCounts[FULL_BOT_LOD], counts.lodCounts[REDUCED_BOT_LOD],
+           counts.lodCounts[LOW_RATE_BOT_LOD], counts.lodCounts[IMPOSTOR_BOT_LOD], counts.culledBots);
+    printf("parts: %d drawn, %d culled\n", counts.drawnParts, counts.culledParts);
+    int numTriangles = 0;
+    printf("sphere levels:");
+    for(int i=0; i<NUM_SPHERE_LODS; i++) {
+        printf(" %d %dx%d%s", counts.sphereLodCounts[i], SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks,
+               i + 1 < NUM_SPHERE_LODS ? "," : "");
+        numTriangles += counts.sphereLodCounts[i] * SPHERE_LODS[i].slices * SPHERE_LODS[i].stacks * 2;
     }
-    // ------------------------------- LEFT HAND FINGERS -------------------------------
-    
-    // ------------------------------- LEFT THIGH -------------------------------
-    Matrix4 leftThighMatrix = Matrix4::makeScale(Cvec3(1.0/2.0, 1.0/3.0, 1.0)) *
-    Matrix4::makeTranslation(Cvec3(1.5, -6.0, 0.0)) *
-    quatToMatrix(Quat::makeXRotation(calculateTimeAngle(90,timeSinceStart/frameSpeed)-45)) *
-    Matrix4::makeScale(Cvec3(1.0/1.5, 1.5, 1.0));
-    
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, 1.0, 0.0));
-    
-    leftThighMatrix = axisShiftMatrix * leftThighMatrix * inv(axisShiftMatrix);
-    
-    Entity *leftThighEntity = drawBodyParts(genericBufferBinder, leftThighMatrix, trunkEntity);
-    // ------------------------------- LEFT THIGH -------------------------------
-    
-    // ------------------------------- LEFT KNEE -------------------------------
-    Matrix4 leftKneeMatrix = Matrix4::makeScale(Cvec3(1.5, 1.0/1.5, 1.0)) *
-    Matrix4::makeTranslation(Cvec3(0.001, -3.0, 0.0)) *
-    quatToMatrix(Quat::makeXRotation(45-calculateTimeAngle(45, timeSinceStart/frameSpeed)))*
-    Matrix4::makeScale(Cvec3(1.0/2.0, 1.5, 1.0));
-    
-    axisShiftMatrix = axisShiftMatrix.makeTranslation(Cvec3(0.0, 1.0, 0.0));
-    leftKneeMatrix = axisShiftMatrix * leftKneeMatrix * inv(axisShiftMatrix);
-    
-    Entity *leftKneeEntity = drawBodyParts(genericBufferBinder, leftKneeMatrix, leftThighEntity);
-    // ------------------------------- LEFT KNEE -------------------------------
+    printf(", %d triangles\n", numTriangles);
+    printf("GL calls: %d issued, %d elided\n", glState->lastIssued(), glState->lastElided());
+    printf("instance stream: %s, %d frames waited for the GPU\n", instanceStream->modeName(), instanceStream->numWaits());
+    printf("draws: %s\n", useMultiDrawIndirect ? "one multi draw indirect call" : "one instanced call per mesh");
+}
+
+/**
+ * Function to read the distances of the levels of detail of the crowd from an
+ * option value of the form D1,D2,D3
+ *
+ * Function: parseLodDistances
+ */
+bool parseLodDistances(const char *value) {
+    float distances[NUM_BOT_LODS - 1];
+    if(sscanf(value, "%f,%f,%f", &distances[0], &distances[1], &distances[2]) != NUM_BOT_LODS - 1) {
+        fprintf(stderr, "--lod expects three distances, e.g. --lod 150,400,1000\n");
+        return false;
+    }
+    for(int i=0; i<NUM_BOT_LODS - 1; i++)
+        crowd.lodDistances[i] = distances[i];
+    return true;
+}
+
+/**
+ * Function to read the vertex format of the meshes from an option value, one of
+ * the names in VERTEX_FORMATS
+ *
+ * Function: parseVertexFormat
+ */
+bool parseVertexFormat(const char *value) {
+    const int format = findVertexFormat(value);
+    if(format < 0) {
+        fprintf(stderr, "--vertex-format expects one of");
+        for(int i=0; i<NUM_VERTEX_FORMATS; i++)
+            fprintf(stderr, " %s", VERTEX_FORMATS[i].name);
+        fprintf(stderr, "\n");
+        return false;
+    }
+    vertexFormat = format;
+    return true;
+}
+
+/**
+ * Function to print the rolling GPU time of every timer scope in the top left
+ * corner of the window, with the fixed function pipeline and GLUT bitmap fonts
+ *
+ * Function: drawGpuTimings
+ */
+void drawGpuTimings() {
+    glState->useProgram(0);
+    glColor3f(0.0f, 0.0f, 0.0f);
     
-    // ------------------------------- LEFT FOOT FINGERS -------------------------------
-    for(int i=0; i<3; i++) {
-        Matrix4 leftFootFingerMatrix =  Matrix4::makeScale(Cvec3(2.0, 1/1.5, 1.0)) *
-        Matrix4::makeTranslation(Cvec3(0.4-(i*0.4), -1.8, 0.8)) *
-        Matrix4::makeScale(Cvec3(1.0/8.0, 1.0/8.0, 1.0/2.0));
-        drawBodyParts(genericBufferBinder, leftFootFingerMatrix, leftKneeEntity);
+    int viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    for(int i=0; i<gpuTimers->numScopes(); i++) {
+        char line[128];
+        snprintf(line, sizeof(line), "%s: %.3f ms", gpuTimers->name(i), gpuTimers->averageMilliseconds(i));
+        glWindowPos2i(10, viewport[3] - 20 * (i+1));
+        for(const char *c = line; *c; c++)
+            glutBitmapCharacter(GLUT_BITMAP_HELVETICA_12, *c);
     }
-    // ------------------------------- LEFT FOOT FINGERS -------------------------------
+}
+
+void nextFrame(int) {
+    frameScheduled = false;
+    glutPostRedisplay();
+}
+
+void display(void) {
+    // The simulation takes the wall time since the last frame in fixed steps, see
+    // simulateFrame()
+    int now = glutGet(GLUT_ELAPSED_TIME);
+    renderTime += lastDisplayTime < 0 ? 0 : now - lastDisplayTime;
+    lastDisplayTime = now;
     
-    // Disabled all vertex attributes
-    glDisableVertexAttribArray(postionAttributeFromVertexShader);
-    glDisableVertexAttribArray(colorAttributeFromVertexShader);
-    glDisableVertexAttribArray(normalAttributeFromVertexShader);
+    // The next frame is expected to come as long after this one as this one did
+    // after the previous
+    renderFrame(renderTime, 2 * renderTime - lastRenderTime);
+    lastRenderTime = renderTime;
+    if(showGpuTimings)
+        drawGpuTimings();
     glutSwapBuffers();
+    
+    // Frames due in the past are dropped rather than rendered back to back. Redraws
+    // GLUT asks for itself (expose, reshape) must not start a second chain of timers
+    if(frameCap > 0 && !frameScheduled) {
+        now = glutGet(GLUT_ELAPSED_TIME);
+        nextFrameTime = std::max(nextFrameTime + 1000.0 / frameCap, (double)now);
+        glutTimerFunc((unsigned int)(nextFrameTime - now), nextFrame, 0);
+        frameScheduled = true;
+    }
 }
 
 void init() {
+    glState = new GlStateCache();
     glClearDepth(0.0f);
     glCullFace(GL_BACK);
-    glEnable(GL_CULL_FACE);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_GREATER);
-    glReadBuffer(GL_BACK);
+    glState->setEnabled(GL_CULL_FACE, true);
+    glState->setEnabled(GL_DEPTH_TEST, true);
+    glState->depthFunc(GL_GREATER);
     
     program = glCreateProgram();
     readAndCompileShader(program, "vertex.glsl", "fragment.glsl");
     
-    glUseProgram(program);
+    glState->useProgram(program);
     
     // Shader Atrributes
     postionAttributeFromVertexShader = glGetAttribLocation(program, "position");
     colorAttributeFromVertexShader = glGetAttribLocation(program, "color");
     normalAttributeFromVertexShader = glGetAttribLocation(program, "normal");
+    modelViewMatrixAttributeFromVertexShader = glGetAttribLocation(program, "instanceModelViewMatrix");
+    normalMatrixAttributeFromVertexShader = glGetAttribLocation(program, "instanceNormalMatrix");
     
     // Normal Uniforms
     uColorUniformFromFragmentShader = glGetUniformLocation(program, "uColor");
     lightPositionUniformFromFragmentShader = glGetUniformLocation(program, "lightPosition");
     
     //Matrix Uniforms
-    modelViewMatrixUniformFromVertexShader = glGetUniformLocation(program, "modelViewMatrix");
-    normalMatrixUniformFromVertexShader = glGetUniformLocation(program, "normalMatrix");
     projectionMatrixUniformFromVertexShader = glGetUniformLocation(program, "projectionMatrix");
+    normalEncodingUniformFromVertexShader = glGetUniformLocation(program, "normalEncoding");
+    positionScaleUniformFromVertexShader = glGetUniformLocation(program, "positionScale");
+    
+    // Uniform blocks are bound to fixed binding points, the shaders declare them
+    // when the extension is there
+    useUniformBlocks = hasGlExtension("GL_ARB_uniform_buffer_object");
+    if(useUniformBlocks) {
+        glUniformBlockBinding(program, glGetUniformBlockIndex(program, "FrameUniforms"), FRAME_UNIFORMS_BINDING);
+        glUniformBlockBinding(program, glGetUniformBlockIndex(program, "MeshUniforms"), MESH_UNIFORMS_BINDING);
+        frameUniformRing = new UniformBufferRing(sizeof(FrameUniforms), 1, *glState);
+    }
     
     
-    // Initialize Sphere
+    // Initialize the levels of the sphere one after the other in the same buffers.
+    // The registry moves the vertices of every mesh for the vertex fetch, so the
+    // colors look up where the vertices the geometry maker made went
     int ibLen, vbLen;
-    getSphereVbIbLen(12, 12, vbLen, ibLen);
-    std::vector<VertexPN> vtx(vbLen);
-    std::vector<unsigned short> idx(ibLen);
-    makeSphere(1.3, 12, 12, vtx.begin(), idx.begin());
-    numIndices = ibLen;
+    for(int i=0; i<NUM_SPHERE_LODS; i++) {
+        getSphereVbIbLen(SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, vbLen, ibLen);
+        std::vector<GenericVertex> levelVtx(vbLen);
+        std::vector<unsigned short> levelIdx(ibLen);
+        makeSphere(BOT_PART_RADIUS, SPHERE_LODS[i].slices, SPHERE_LODS[i].stacks, levelVtx.begin(), levelIdx.begin());
+        sphereMeshes[i] = meshRegistry.add(levelVtx, levelIdx);
+    }
+    const std::vector<GenericVertex> &vtx = meshRegistry.vertices;
+    const std::vector<unsigned short> &idx = meshRegistry.indices;
+    
+    // Bind the respective vertex, color and index buffers. The vertices are encoded in
+    // the chosen format, the shader told how to decode the normals and by how much to
+    // scale normalized positions back
+    const VertexFormat &format = VERTEX_FORMATS[vertexFormat];
+    const float positionScale = vertexPositionScale(format, vtx.data(), vtx.size());
+    std::vector<unsigned char> vertexData(format.stride * vtx.size());
+    encodeVertices(format, vtx.data(), vtx.size(), positionScale, vertexData.data());
+    if(useUniformBlocks) {
+        MeshUniforms meshUniforms = {positionScale, format.normalEncoding, {0, 0}};
+        glGenBuffers(1, &meshUniformBufferObject);
+        glState->bindBuffer(GL_UNIFORM_BUFFER, meshUniformBufferObject);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(meshUniforms), &meshUniforms, GL_STATIC_DRAW);
+        genericBufferBinder.meshUniformOffset = 0;
+    } else {
+        glUniform1i(normalEncodingUniformFromVertexShader, format.normalEncoding);
+        glUniform1f(positionScaleUniformFromVertexShader, positionScale);
+    }
     
-    // Bind the respective vertex, color and index buffers
     glGenBuffers(1, &vertexPositionVBO);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexPositionVBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexPN) * vtx.size(), vtx.data(), GL_STATIC_DRAW);
+    glState->bindBuffer(GL_ARRAY_BUFFER, vertexPositionVBO);
+    glBufferData(GL_ARRAY_BUFFER, vertexData.size(), vertexData.data(), GL_STATIC_DRAW);
     
     glGenBuffers(1, &indexBO);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBO);
+    glState->bindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBO);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned short) * idx.size(), idx.data(), GL_STATIC_DRAW);
 
     
     glGenBuffers(1, &colorBufferObject);
-    glBindBuffer(GL_ARRAY_BUFFER, colorBufferObject);
+    glState->bindBuffer(GL_ARRAY_BUFFER, colorBufferObject);
     GLfloat cubeColors[144] = {
         0.583f,  0.771f,  0.014f, 1.0f,
         0.609f,  0.115f,  0.436f, 1.0f,
@@ -441,20 +731,80 @@ void init() {
         0.982f,  0.099f,  0.879f, 1.0f
     };
     
-    GLfloat heavyColorArray[1440];
-    int k=0;
-    for(int i=0; i<10; i++) {
-        for(int j=0; j<144; j++) {
-            heavyColorArray[k] = cubeColors[j];
-            k++;
+    // The colors were laid out over the vertices of the 12x12 sphere, repeating every
+    // 36 vertices. Every level samples that layout at the longitude and latitude of
+    // its vertices, so all the levels look alike and the 12x12 one looks as before
+    const int baseSlices = 12, baseStacks = 12;
+    auto baseColor = [&](int slice, int stack, int c) {
+        return cubeColors[4 * ((slice * (baseStacks + 1) + stack) % 36) + c];
+    };
+    std::vector<GLfloat> heavyColorArray(4 * vtx.size());
+    for(int l=0; l<NUM_SPHERE_LODS; l++) {
+        const int slices = SPHERE_LODS[l].slices, stacks = SPHERE_LODS[l].stacks;
+        for(int i=0; i<=slices; i++) {
+            for(int j=0; j<=stacks; j++) {
+                const float u = float(i * baseSlices) / slices, v = float(j * baseStacks) / stacks;
+                const int i0 = (int)u, j0 = (int)v;
+                const int i1 = std::min(i0 + 1, baseSlices), j1 = std::min(j0 + 1, baseStacks);
+                const float fu = u - i0, fv = v - j0;
+                GLfloat *color = &heavyColorArray[4 * meshRegistry.packedVertex(sphereMeshes[l], i * (stacks + 1) + j)];
+                for(int c=0; c<4; c++) {
+                    color[c] = (baseColor(i0, j0, c) * (1 - fv) + baseColor(i0, j1, c) * fv) * (1 - fu) +
+                               (baseColor(i1, j0, c) * (1 - fv) + baseColor(i1, j1, c) * fv) * fu;
+                }
+            }
         }
     }
-    glBufferData(GL_ARRAY_BUFFER, sizeof(heavyColorArray), heavyColorArray, GL_STATIC_DRAW);
+    std::vector<unsigned char> colorData(format.colorStride * vtx.size());
+    encodeColors(format, heavyColorArray.data(), vtx.size(), colorData.data());
+    glBufferData(GL_ARRAY_BUFFER, colorData.size(), colorData.data(), GL_STATIC_DRAW);
+    
+    // Build the bot hierarchy once, display() only poses it
+    bot.build();
+    
+    // A crowd shares the sphere and the skeleton of the bot, only the instance
+    // data grows with it. The camera backs off and looks down on the whole crowd
+    if(crowdSize > 0) {
+        crowd.spawn(bot, std::min(crowdSize, MAX_CROWD_SIZE), CROWD_SPACING, 1);
+        maxPartInstances = std::max(MAX_PART_INSTANCES, crowd.size() * bot.skeleton.size());
+        cameraDistance = 30.0f + crowd.extent;
+        cameraPitch = -30.0f;
+        jobSystem = new JobSystem(numThreads > 0 ? numThreads : std::thread::hardware_concurrency());
+        camera.zFar = -(cameraDistance + crowd.extent);
+    }
+    
+    instanceStream = new StreamingBuffer(GL_ARRAY_BUFFER, sizeof(PartInstance) * maxPartInstances, *glState);
+#ifndef __APPLE__
+    useMultiDrawIndirect = hasGlExtension("GL_ARB_multi_draw_indirect") && hasGlExtension("GL_ARB_base_instance");
+#endif
+    if(useMultiDrawIndirect) {
+        drawCommandStream = new StreamingBuffer(GL_DRAW_INDIRECT_BUFFER,
+                                                sizeof(DrawElementsIndirectCommand) * MAX_DRAW_COMMANDS, *glState);
+    }
     
+    unsortedInstances.resize(maxPartInstances);
+    pipeline = new FramePipeline(simulateFrame, maxPartInstances, pipelined);
+    
+    genericBufferBinder.vertexBufferObject = vertexPositionVBO;
+    genericBufferBinder.colorBufferObject = colorBufferObject;
+    genericBufferBinder.indexBufferObject = indexBO;
+    genericBufferBinder.instanceBufferObject = *instanceStream;
+    genericBufferBinder.positionAttribute = postionAttributeFromVertexShader;
+    genericBufferBinder.colorAttribute = colorAttributeFromVertexShader;
+    genericBufferBinder.normalAttribute = normalAttributeFromVertexShader;
+    genericBufferBinder.modelViewMatrixAttribute = modelViewMatrixAttributeFromVertexShader;
+    genericBufferBinder.normalMatrixAttribute = normalMatrixAttributeFromVertexShader;
+    genericBufferBinder.format = &format;
+    genericBufferBinder.createVertexArray();
+    
+    gpuTimers = new GpuTimers();
+    clearTimer = gpuTimers->scope("clear");
+    botBodyTimer = gpuTimers->scope("bot body");
 }
 
 void reshape(int w, int h) {
     glViewport(0, 0, w, h);
+    camera.setViewport(w, h);
 }
 
 void idle(void) {
@@ -499,6 +849,16 @@ void keyboard(unsigned char key, int x, int y) {
             break;
         // ------------------------------- BOT MOVEMENT -------------------------------
             
+        // ------------------------------- GPU TIMINGS -------------------------------
+        case 't':
+            showGpuTimings = !showGpuTimings;
+            break;
+        case 'T':
+            gpuTimers->dump(std::cout);
+            dumpDrawCounts();
+            break;
+        // ------------------------------- GPU TIMINGS -------------------------------
+            
         // ------------------------------- COLOR SHADING -------------------------------
         case 'r':
             if (redOffset <= 1.0)
@@ -550,6 +910,21 @@ void keyboard(unsigned char key, int x, int y) {
             break;
         // ------------------------------- FRAME SPEED -------------------------------
             
+        // ------------------------------- GAIT -------------------------------
+        case '1':
+            gait = IDLE_GAIT;
+            break;
+        case '2':
+            gait = WALK_GAIT;
+            break;
+        case '3':
+            gait = RUN_GAIT;
+            break;
+        case 'h':
+            wave = !wave;
+            break;
+        // ------------------------------- GAIT -------------------------------
+            
         // ------------------------------- LIGHT LOCATION -------------------------------
         case 'k':
             lightZOffset += 2.0;
@@ -573,15 +948,288 @@ void keyboard(unsigned char key, int x, int y) {
     }
 }
 
+/**
+ * Function to render frames without a window or display server, e.g. on Linux boxes
+ * without a GPU. The animation advances by a fixed 1/60 s per frame, every frame can
+ * be written out as a PPM file and the achieved throughput is printed at the end
+ *
+ * Function: runHeadless
+ * RunningBot --headless [--frames N] [--size WIDTHxHEIGHT] [--crowd N] [--threads N] [--lod D1,D2,D3] [--serial]
+ *                       [--vertex-format FORMAT] [--output PREFIX]
+ *           frames - Number of frames to render, 60 by default
+ *           size - Size of the framebuffer, 1280x800 by default
+ *           crowd - Number of bots of a crowd, a single bot by default
+ *           threads - Threads posing the crowd, every core by default
+ *           lod - Distances beyond which the bots of a crowd drop to the reduced,
+ *                 low rate and impostor levels of detail
+ *           serial - Simulates every frame on the GL thread instead of a thread of its own
+ *           vertex-format - float, half, snorm16 or qtangent, snorm16 by default
+ *           output - Frames are written to PREFIX0000.ppm, PREFIX0001.ppm, ...
+ *                    nothing is written without it
+ */
+int runHeadless(int argc, char **argv) {
+    int numFrames = 60, width = 1280, height = 800;
+    const char *outputPrefix = NULL;
+    for(int i=2; i<argc; i++) {
+        if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+            numFrames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--size") == 0 && i+1 < argc)
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        else if(strcmp(argv[i], "--crowd") == 0 && i+1 < argc)
+            crowdSize = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            numThreads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--lod") == 0 && i+1 < argc) {
+            if(!parseLodDistances(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--vertex-format") == 0 && i+1 < argc) {
+            if(!parseVertexFormat(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--serial") == 0)
+            pipelined = false;
+        else if(strcmp(argv[i], "--output") == 0 && i+1 < argc)
+            outputPrefix = argv[++i];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    try {
+        createHeadlessContext(width, height);
+        printf("Renderer: %s, %s\n", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+        printf("Simulation %s\n", pipelined ? "pipelined on its own thread" : "serial on the GL thread");
+        
+        init();
+        reshape(width, height);
+        
+        // GLUT is never initialised here, so the wall clock comes from chrono
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for(int i=0; i<numFrames; i++) {
+            renderFrame(i * 1000.0f / 60, (i+1) * 1000.0f / 60);
+            if(outputPrefix) {
+                char fileName[1024];
+                snprintf(fileName, sizeof(fileName), "%s%04d.ppm", outputPrefix, i);
+                writeFramebufferPPM(fileName, width, height);
+            }
+        }
+        glFinish();
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        printf("%d frames in %.1f ms, %.1f frames/s\n", numFrames, elapsed,
+               elapsed > 0 ? numFrames * 1000.0 / elapsed : 0.0);
+        gpuTimers->endFrame();
+        gpuTimers->dump(std::cout);
+        dumpDrawCounts();
+        
+        delete pipeline;
+        delete gpuTimers;
+        delete frameUniformRing;
+        delete instanceStream;
+        delete drawCommandStream;
+        delete glState;
+        destroyHeadlessContext();
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Function to benchmark the renderer offscreen. The animation is driven by a fixed
+ * synthetic clock, so every run renders exactly the same frames, and each frame is
+ * timed in three stages: the CPU scene update, the CPU submission of the GL calls
+ * and the GPU time of those calls from a GL_TIME_ELAPSED query. The query result is
+ * waited for after every frame, which serialises CPU and GPU but keeps the stages
+ * apart. The statistics of every stage are written as JSON
+ *
+ * Function: runBenchmark
+ * RunningBot --bench [--frames N] [--warmup N] [--size WIDTHxHEIGHT] [--crowd N] [--threads N] [--lod D1,D2,D3]
+ *                    [--vertex-format FORMAT] [--output FILE]
+ *           frames - Number of frames to time, 600 by default
+ *           warmup - Number of frames rendered before timing starts, 60 by default
+ *           size - Size of the framebuffer, 1280x800 by default
+ *           crowd - Number of bots of a crowd, a single bot by default
+ *           threads - Threads posing the crowd, every core by default
+ *           lod - Distances beyond which the bots of a crowd drop to the reduced,
+ *                 low rate and impostor levels of detail
+ *           vertex-format - Format of the vertices of the meshes, snorm16 by default
+ *           output - JSON file to write, stdout by default
+ */
+int runBenchmark(int argc, char **argv) {
+    int numFrames = 600, numWarmupFrames = 60, width = 1280, height = 800;
+    const char *outputFile = NULL;
+    for(int i=2; i<argc; i++) {
+        if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+            numFrames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--warmup") == 0 && i+1 < argc)
+            numWarmupFrames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--size") == 0 && i+1 < argc)
+            sscanf(argv[++i], "%dx%d", &width, &height);
+        else if(strcmp(argv[i], "--crowd") == 0 && i+1 < argc)
+            crowdSize = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            numThreads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--lod") == 0 && i+1 < argc) {
+            if(!parseLodDistances(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--vertex-format") == 0 && i+1 < argc) {
+            if(!parseVertexFormat(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--output") == 0 && i+1 < argc)
+            outputFile = argv[++i];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    
+    // Each frame advances the animation by one 60 Hz refresh, as in --headless
+    const double frameTime = 1000.0 / 60.0;
+    
+    std::vector<StageTimings> stages(4);
+    stages[0].name = "cpu_update";
+    stages[1].name = "cpu_submit";
+    stages[2].name = "gpu";
+    stages[3].name = "frame";
+    
+    try {
+        createHeadlessContext(width, height);
+        
+        // The stages are timed one after the other, so the frames are simulated in
+        // place on this thread instead of going through the pipeline
+        pipelined = false;
+        init();
+        reshape(width, height);
+        FrameSnapshot snapshot;
+        snapshot.instances.resize(maxPartInstances);
+        
+        // The whole submission is timed with a blocking query below, and timer
+        // queries cannot overlap
+        gpuTimers->setEnabled(false);
+        GLuint query;
+        glGenQueries(1, &query);
+        
+        for(int i=0; i<numWarmupFrames + numFrames; i++) {
+            const float elapsedTime = float(i * frameTime);
+            
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            simulateFrame(currentControls(elapsedTime), snapshot);
+            std::chrono::steady_clock::time_point updated = std::chrono::steady_clock::now();
+            glBeginQuery(GL_TIME_ELAPSED, query);
+            submitFrame(snapshot);
+            glState->endFrame();
+            glEndQuery(GL_TIME_ELAPSED);
+            std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+            
+            // Blocks until the GPU is done with the frame
+            GLuint64 gpuTime = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &gpuTime);
+            std::chrono::steady_clock::time_point finished = std::chrono::steady_clock::now();
+            
+            if(i < numWarmupFrames)
+                continue;
+            stages[0].milliseconds.push_back(std::chrono::duration<double, std::milli>(updated - start).count());
+            stages[1].milliseconds.push_back(std::chrono::duration<double, std::milli>(submitted - updated).count());
+            stages[2].milliseconds.push_back(gpuTime / 1000000.0);
+            stages[3].milliseconds.push_back(std::chrono::duration<double, std::milli>(finished - start).count());
+        }
+        checkGlErrors(__FILE__, __LINE__);
+        
+        FILE *file = outputFile ? fopen(outputFile, "w") : stdout;
+        if(!file)
+            throw std::runtime_error(std::string("Cannot open ") + outputFile);
+        writeBenchmarkJson(file, (const char *)glGetString(GL_RENDERER), width, height, frameTime, stages);
+        if(file != stdout)
+            fclose(file);
+        
+        glDeleteQueries(1, &query);
+        delete pipeline;
+        delete gpuTimers;
+        delete frameUniformRing;
+        delete instanceStream;
+        delete drawCommandStream;
+        delete glState;
+        destroyHeadlessContext();
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
+    // RunningBot --bench-matrix runs the matrix microbenchmarks without opening a window
+    if(argc > 1 && strcmp(argv[1], "--bench-matrix") == 0)
+        return runMatrixBenchmarks();
+    
+    // RunningBot --bench-crowd [N] measures how the crowd update scales with threads
+    if(argc > 1 && strcmp(argv[1], "--bench-crowd") == 0)
+        return runCrowdScalingBenchmark(argc > 2 ? atoi(argv[2]) : 10000);
+    
+    // RunningBot --bench-mesh prints the vertex cache statistics of the generated meshes
+    // and the size and error of the vertex formats
+    if(argc > 1 && strcmp(argv[1], "--bench-mesh") == 0)
+        return runMeshBenchmark();
+    
+    // RunningBot --check compares the propagated normal matrices of the posed bot with
+    // direct inverses and fails with a nonzero exit code when they drift apart
+    if(argc > 1 && strcmp(argv[1], "--check") == 0)
+        return runNormalMatrixCheck();
+    
+    if(argc > 1 && strcmp(argv[1], "--headless") == 0)
+        return runHeadless(argc, argv);
+    
+    if(argc > 1 && strcmp(argv[1], "--bench") == 0)
+        return runBenchmark(argc, argv);
+    
     glutInit(&argc, argv);
+    // RunningBot [--crowd N] [--threads N] [--lod D1,D2,D3] [--serial] [--fps N] [--vsync] [--vertex-format FORMAT]
+    //           crowd - Opens the window on a crowd of N bots
+    //           lod - Distances of the levels of detail of the crowd
+    //           serial - Simulates every frame on the GL thread
+    //           fps - Frame cap, 60 by default, 0 renders as fast as possible
+    //           vsync - Waits for the vertical blank on every swap
+    //           vertex-format - Format of the vertices of the meshes, snorm16 by default
+    for(int i=1; i<argc; i++) {
+        if(strcmp(argv[i], "--crowd") == 0 && i+1 < argc)
+            crowdSize = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+            numThreads = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--lod") == 0 && i+1 < argc) {
+            if(!parseLodDistances(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--vertex-format") == 0 && i+1 < argc) {
+            if(!parseVertexFormat(argv[++i]))
+                return 1;
+        }
+        else if(strcmp(argv[i], "--fps") == 0 && i+1 < argc)
+            frameCap = atoi(argv[++i]);
+        else if(strcmp(argv[i], "--vsync") == 0)
+            vsync = true;
+        else if(strcmp(argv[i], "--serial") == 0)
+            pipelined = false;
+    }
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH);
     glutInitWindowSize(1280, 800);
     glutCreateWindow("Running Bot");
+#ifndef __APPLE__
+    glewInit();
+#endif
+    glReadBuffer(GL_BACK);
+    if(vsync && !setSwapInterval(1))
+        fprintf(stderr, "vsync is not supported\n");
     
     glutDisplayFunc(display);
     glutReshapeFunc(reshape);
-    glutIdleFunc(idle);
+    // Without a cap the next frame is requested as soon as GLUT is idle
+    if(frameCap <= 0)
+        glutIdleFunc(idle);
     
     glutKeyboardFunc(keyboard);
     
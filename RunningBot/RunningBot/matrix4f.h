@@ -0,0 +1,330 @@
+#ifndef MATRIX4F_H
+#define MATRIX4F_H
+
+#include <cassert>
+#include <cmath>
+
+#include "cvec.h"
+#include "matrix4.h"
+
+// SSE2 is part of every x86-64 target, AVX is used for the multiply when the
+// compiler is allowed to emit it (-mavx). Define MATRIX4F_NO_SIMD to force the
+// scalar fallback, which is also used on every other architecture.
+#if !defined(MATRIX4F_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+  #define MATRIX4F_SSE2
+  #include <emmintrin.h>
+  #if defined(__AVX__)
+    #define MATRIX4F_AVX
+    #include <immintrin.h>
+  #endif
+#endif
+
+// Forward declaration of Matrix4f and transpose since those are used below
+class Matrix4f;
+Matrix4f transpose(const Matrix4f& m);
+
+// A single precision 4x4 matrix. Unlike Matrix4 the layout is column-major and
+// 16 byte aligned, so every column is one SSE register and the data can be
+// handed to glUniformMatrix4fv or an instance buffer as is.
+// To get the element at ith row and jth column, use a(i,j)
+class Matrix4f {
+  alignas(16) float d_[16]; // layout is column-major
+
+public:
+  float &operator () (const int row, const int col) {
+    return d_[(col << 2) + row];
+  }
+
+  const float &operator () (const int row, const int col) const {
+    return d_[(col << 2) + row];
+  }
+
+  // Raw access in column-major order
+  float& operator [] (const int i) {
+    return d_[i];
+  }
+
+  const float& operator [] (const int i) const {
+    return d_[i];
+  }
+
+  const float* data() const {
+    return d_;
+  }
+
+  Matrix4f() {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] = 0;
+    }
+    for (int i = 0; i < 4; ++i) {
+      (*this)(i,i) = 1;
+    }
+  }
+
+  explicit Matrix4f(const float a) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] = a;
+    }
+  }
+
+  // Narrowing conversion from the double precision, row-major Matrix4
+  explicit Matrix4f(const Matrix4& m) {
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        (*this)(i,j) = float(m(i,j));
+      }
+    }
+  }
+
+  Matrix4 toMatrix4() const {
+    Matrix4 r;
+    for (int i = 0; i < 4; ++i) {
+      for (int j = 0; j < 4; ++j) {
+        r(i,j) = (*this)(i,j);
+      }
+    }
+    return r;
+  }
+
+  template <class T>
+  Matrix4f& readFromColumnMajorMatrix(const T m[]) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] = float(m[i]);
+    }
+    return *this;
+  }
+
+  template <class T>
+  void writeToColumnMajorMatrix(T m[]) const {
+    for (int i = 0; i < 16; ++i) {
+      m[i] = T(d_[i]);
+    }
+  }
+
+  Matrix4f& operator += (const Matrix4f& m) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] += m.d_[i];
+    }
+    return *this;
+  }
+
+  Matrix4f& operator -= (const Matrix4f& m) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] -= m.d_[i];
+    }
+    return *this;
+  }
+
+  Matrix4f& operator *= (const float a) {
+    for (int i = 0; i < 16; ++i) {
+      d_[i] *= a;
+    }
+    return *this;
+  }
+
+  Matrix4f& operator *= (const Matrix4f& a) {
+    return *this = *this * a;
+  }
+
+  Matrix4f operator + (const Matrix4f& a) const {
+    return Matrix4f(*this) += a;
+  }
+
+  Matrix4f operator - (const Matrix4f& a) const {
+    return Matrix4f(*this) -= a;
+  }
+
+  Matrix4f operator * (const float a) const {
+    return Matrix4f(*this) *= a;
+  }
+
+  Cvec4f operator * (const Cvec4f& v) const {
+    Cvec4f r(0);
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 4; ++i) {
+        r[i] += (*this)(i,j) * v(j);
+      }
+    }
+    return r;
+  }
+
+  // Column j of the product is a linear combination of the columns of this
+  // matrix, weighted by the entries of column j of m
+  Matrix4f operator * (const Matrix4f& m) const {
+    Matrix4f r;
+#if defined(MATRIX4F_AVX)
+    // two columns of the result per iteration, one in each 128 bit lane
+    const __m256 a0 = _mm256_broadcast_ps((const __m128*)&d_[0]);
+    const __m256 a1 = _mm256_broadcast_ps((const __m128*)&d_[4]);
+    const __m256 a2 = _mm256_broadcast_ps((const __m128*)&d_[8]);
+    const __m256 a3 = _mm256_broadcast_ps((const __m128*)&d_[12]);
+    for (int j = 0; j < 16; j += 8) {
+      const __m256 b = _mm256_loadu_ps(&m.d_[j]);
+      __m256 c = _mm256_mul_ps(a0, _mm256_permute_ps(b, 0x00));
+      c = _mm256_add_ps(c, _mm256_mul_ps(a1, _mm256_permute_ps(b, 0x55)));
+      c = _mm256_add_ps(c, _mm256_mul_ps(a2, _mm256_permute_ps(b, 0xAA)));
+      c = _mm256_add_ps(c, _mm256_mul_ps(a3, _mm256_permute_ps(b, 0xFF)));
+      _mm256_storeu_ps(&r.d_[j], c);
+    }
+#elif defined(MATRIX4F_SSE2)
+    const __m128 a0 = _mm_load_ps(&d_[0]);
+    const __m128 a1 = _mm_load_ps(&d_[4]);
+    const __m128 a2 = _mm_load_ps(&d_[8]);
+    const __m128 a3 = _mm_load_ps(&d_[12]);
+    for (int j = 0; j < 16; j += 4) {
+      const __m128 b = _mm_load_ps(&m.d_[j]);
+      __m128 c = _mm_mul_ps(a0, _mm_shuffle_ps(b, b, _MM_SHUFFLE(0,0,0,0)));
+      c = _mm_add_ps(c, _mm_mul_ps(a1, _mm_shuffle_ps(b, b, _MM_SHUFFLE(1,1,1,1))));
+      c = _mm_add_ps(c, _mm_mul_ps(a2, _mm_shuffle_ps(b, b, _MM_SHUFFLE(2,2,2,2))));
+      c = _mm_add_ps(c, _mm_mul_ps(a3, _mm_shuffle_ps(b, b, _MM_SHUFFLE(3,3,3,3))));
+      _mm_store_ps(&r.d_[j], c);
+    }
+#else
+    for (int j = 0; j < 4; ++j) {
+      for (int i = 0; i < 4; ++i) {
+        r(i,j) = (*this)(i,0) * m(0,j) + (*this)(i,1) * m(1,j) +
+                 (*this)(i,2) * m(2,j) + (*this)(i,3) * m(3,j);
+      }
+    }
+#endif
+    return r;
+  }
+};
+
+inline bool isAffine(const Matrix4f& m) {
+  return std::abs(m(3,3)-1) + std::abs(m(3,2)) + std::abs(m(3,1)) + std::abs(m(3,0)) < CS175_EPS;
+}
+
+inline float norm2(const Matrix4f& m) {
+  float r = 0;
+  for (int i = 0; i < 16; ++i) {
+    r += m[i]*m[i];
+  }
+  return r;
+}
+
+#if defined(MATRIX4F_SSE2)
+// a x b of the xyz parts, the w component of the result is 0 for finite inputs
+inline __m128 crossSse(const __m128 a, const __m128 b) {
+  const __m128 aYzx = _mm_shuffle_ps(a, a, _MM_SHUFFLE(3,0,2,1));
+  const __m128 bYzx = _mm_shuffle_ps(b, b, _MM_SHUFFLE(3,0,2,1));
+  const __m128 c = _mm_sub_ps(_mm_mul_ps(a, bYzx), _mm_mul_ps(aYzx, b));
+  return _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,0,2,1));
+}
+
+// dot product of the xyz parts, broadcast to all four components
+inline __m128 dot3Sse(const __m128 a, const __m128 b) {
+  const __m128 m = _mm_mul_ps(a, b);
+  const __m128 s = _mm_add_ss(_mm_add_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1,1,1,1))),
+                              _mm_shuffle_ps(m, m, _MM_SHUFFLE(2,2,2,2)));
+  return _mm_shuffle_ps(s, s, _MM_SHUFFLE(0,0,0,0));
+}
+#endif
+
+// Rows of the inverse of the upper left 3x3 block of m are the cross products
+// of its columns divided by the determinant. Both inv and normalMatrix are
+// built from these, normalMatrix just skips the transpose.
+// computes inverse of affine matrix. assumes last row is [0,0,0,1]
+inline Matrix4f inv(const Matrix4f& m) {
+  assert(isAffine(m));
+  Matrix4f r;
+#if defined(MATRIX4F_SSE2)
+  const __m128 c0 = _mm_load_ps(&m[0]), c1 = _mm_load_ps(&m[4]), c2 = _mm_load_ps(&m[8]);
+  const __m128 t = _mm_load_ps(&m[12]);
+  __m128 r0 = crossSse(c1, c2), r1 = crossSse(c2, c0), r2 = crossSse(c0, c1);
+  const __m128 det = dot3Sse(c0, r0);
+
+  // check non-singular matrix
+  assert(std::abs(_mm_cvtss_f32(det)) > CS175_EPS3);
+
+  const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+  r0 = _mm_mul_ps(r0, invDet);
+  r1 = _mm_mul_ps(r1, invDet);
+  r2 = _mm_mul_ps(r2, invDet);
+  __m128 r3 = _mm_setzero_ps();
+  _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+  // "translation part" - multiply the translation (on the left) by the inverse linear part
+  __m128 rt = _mm_mul_ps(r0, _mm_shuffle_ps(t, t, _MM_SHUFFLE(0,0,0,0)));
+  rt = _mm_add_ps(rt, _mm_mul_ps(r1, _mm_shuffle_ps(t, t, _MM_SHUFFLE(1,1,1,1))));
+  rt = _mm_add_ps(rt, _mm_mul_ps(r2, _mm_shuffle_ps(t, t, _MM_SHUFFLE(2,2,2,2))));
+  rt = _mm_sub_ps(_mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f), rt);
+
+  _mm_store_ps(&r[0], r0);
+  _mm_store_ps(&r[4], r1);
+  _mm_store_ps(&r[8], r2);
+  _mm_store_ps(&r[12], rt);
+#else
+  const float det = m(0,0)*(m(1,1)*m(2,2) - m(1,2)*m(2,1)) +
+                    m(0,1)*(m(1,2)*m(2,0) - m(1,0)*m(2,2)) +
+                    m(0,2)*(m(1,0)*m(2,1) - m(1,1)*m(2,0));
+
+  // check non-singular matrix
+  assert(std::abs(det) > CS175_EPS3);
+  const float invDet = 1.0f / det;
+
+  // "rotation part"
+  r(0,0) =  (m(1,1) * m(2,2) - m(1,2) * m(2,1)) * invDet;
+  r(1,0) = -(m(1,0) * m(2,2) - m(1,2) * m(2,0)) * invDet;
+  r(2,0) =  (m(1,0) * m(2,1) - m(1,1) * m(2,0)) * invDet;
+  r(0,1) = -(m(0,1) * m(2,2) - m(0,2) * m(2,1)) * invDet;
+  r(1,1) =  (m(0,0) * m(2,2) - m(0,2) * m(2,0)) * invDet;
+  r(2,1) = -(m(0,0) * m(2,1) - m(0,1) * m(2,0)) * invDet;
+  r(0,2) =  (m(0,1) * m(1,2) - m(0,2) * m(1,1)) * invDet;
+  r(1,2) = -(m(0,0) * m(1,2) - m(0,2) * m(1,0)) * invDet;
+  r(2,2) =  (m(0,0) * m(1,1) - m(0,1) * m(1,0)) * invDet;
+
+  // "translation part" - multiply the translation (on the left) by the inverse linear part
+  r(0,3) = -(m(0,3) * r(0,0) + m(1,3) * r(0,1) + m(2,3) * r(0,2));
+  r(1,3) = -(m(0,3) * r(1,0) + m(1,3) * r(1,1) + m(2,3) * r(1,2));
+  r(2,3) = -(m(0,3) * r(2,0) + m(1,3) * r(2,1) + m(2,3) * r(2,2));
+#endif
+  return r;
+}
+
+inline Matrix4f transpose(const Matrix4f& m) {
+  Matrix4f r;
+#if defined(MATRIX4F_SSE2)
+  __m128 c0 = _mm_load_ps(&m[0]), c1 = _mm_load_ps(&m[4]);
+  __m128 c2 = _mm_load_ps(&m[8]), c3 = _mm_load_ps(&m[12]);
+  _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+  _mm_store_ps(&r[0], c0);
+  _mm_store_ps(&r[4], c1);
+  _mm_store_ps(&r[8], c2);
+  _mm_store_ps(&r[12], c3);
+#else
+  for (int i = 0; i < 4; ++i) {
+    for (int j = 0; j < 4; ++j) {
+      r(i,j) = m(j,i);
+    }
+  }
+#endif
+  return r;
+}
+
+// Same as normalMatrix(const Matrix4&): the transposed inverse of the linear
+// part, with no translation
+inline Matrix4f normalMatrix(const Matrix4f& m) {
+#if defined(MATRIX4F_SSE2)
+  assert(isAffine(m));
+  Matrix4f r;
+  const __m128 c0 = _mm_load_ps(&m[0]), c1 = _mm_load_ps(&m[4]), c2 = _mm_load_ps(&m[8]);
+  const __m128 r0 = crossSse(c1, c2), r1 = crossSse(c2, c0), r2 = crossSse(c0, c1);
+  const __m128 det = dot3Sse(c0, r0);
+
+  // check non-singular matrix
+  assert(std::abs(_mm_cvtss_f32(det)) > CS175_EPS3);
+
+  const __m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+  _mm_store_ps(&r[0], _mm_mul_ps(r0, invDet));
+  _mm_store_ps(&r[4], _mm_mul_ps(r1, invDet));
+  _mm_store_ps(&r[8], _mm_mul_ps(r2, invDet));
+  return r;
+#else
+  Matrix4f invm = inv(m);
+  invm(0, 3) = invm(1, 3) = invm(2, 3) = 0;
+  return transpose(invm);
+#endif
+}
+
+#endif
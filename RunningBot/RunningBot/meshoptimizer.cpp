@@ -0,0 +1,309 @@
+#include <math.h>
+#include <algorithm>
+#include "meshoptimizer.h"
+#include "cvec.h"
+
+/**
+ * Function to measure the vertex cache efficiency of an index buffer by running it
+ * through a FIFO cache of the given size
+ *
+ * Function: analyzeVertexCache
+ *           indices - Triangle list
+ *           numVertices - Vertices the indices refer to
+ *           cacheSize - Entries of the simulated cache
+ */
+VertexCacheStats analyzeVertexCache(const unsigned short *indices, int numIndices, int numVertices, int cacheSize) {
+    // A vertex is in the cache while fewer than cacheSize others were loaded after it
+    std::vector<int> loadTimes(numVertices, -cacheSize);
+    std::vector<bool> used(numVertices, false);
+    int numMisses = 0, numUsed = 0;
+    for(int i=0; i<numIndices; i++) {
+        const int v = indices[i];
+        if(numMisses - loadTimes[v] >= cacheSize)
+            loadTimes[v] = numMisses++;
+        if(!used[v]) {
+            used[v] = true;
+            numUsed++;
+        }
+    }
+    VertexCacheStats stats;
+    stats.acmr = numIndices > 0 ? numMisses / (numIndices / 3.0) : 0.0;
+    stats.atvr = numUsed > 0 ? double(numMisses) / numUsed : 0.0;
+    return stats;
+}
+
+namespace {
+
+// Scores of Tom Forsyth's "Linear-Speed Vertex Cache Optimisation". A vertex scores
+// by how recently it was used, the three of the last triangle a fixed amount so
+// that the order does not favour one of them, and by how few triangles still use
+// it, so that vertices are finished off instead of left to be loaded again
+const float FORSYTH_CACHE_DECAY = 1.5f;
+const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75f;
+const float FORSYTH_VALENCE_SCALE = 2.0f;
+const float FORSYTH_VALENCE_POWER = 0.5f;
+const int FORSYTH_MAX_VALENCE = 32;
+
+struct ForsythScores {
+    float cache[FORSYTH_CACHE_SIZE];
+    float valence[FORSYTH_MAX_VALENCE];
+
+    ForsythScores() {
+        for(int i=0; i<FORSYTH_CACHE_SIZE; i++) {
+            cache[i] = i < 3 ? FORSYTH_LAST_TRIANGLE_SCORE :
+                               powf(1.0f - float(i - 3) / (FORSYTH_CACHE_SIZE - 3), FORSYTH_CACHE_DECAY);
+        }
+        valence[0] = 0.0f;
+        for(int i=1; i<FORSYTH_MAX_VALENCE; i++)
+            valence[i] = FORSYTH_VALENCE_SCALE * powf(float(i), -FORSYTH_VALENCE_POWER);
+    }
+
+    float vertex(int cachePosition, int remainingTriangles) const {
+        if(remainingTriangles == 0)
+            return -1.0f;
+        return (cachePosition >= 0 ? cache[cachePosition] : 0.0f) +
+               valence[std::min(remainingTriangles, FORSYTH_MAX_VALENCE - 1)];
+    }
+};
+
+}
+
+/**
+ * Function to reorder the triangles of a mesh for the post-transform vertex cache
+ * with Tom Forsyth's greedy algorithm: the next triangle is always the one with the
+ * best scoring vertices among the triangles of the vertices in a simulated LRU
+ * cache. Runs in time linear in the triangles
+ *
+ * Function: optimizeVertexCache
+ *           indices - Triangle list, reordered in place
+ *           numVertices - Vertices the indices refer to
+ */
+void optimizeVertexCache(unsigned short *indices, int numIndices, int numVertices) {
+    static const ForsythScores scores;
+    const int numTriangles = numIndices / 3;
+
+    // The triangles of every vertex, as a compressed adjacency list
+    std::vector<int> remaining(numVertices, 0), firstTriangle(numVertices + 1, 0);
+    for(int i=0; i<numIndices; i++)
+        remaining[indices[i]]++;
+    for(int v=0; v<numVertices; v++)
+        firstTriangle[v + 1] = firstTriangle[v] + remaining[v];
+    std::vector<int> vertexTriangles(numIndices), filled(firstTriangle.begin(), firstTriangle.end() - 1);
+    for(int i=0; i<numIndices; i++)
+        vertexTriangles[filled[indices[i]]++] = i / 3;
+
+    std::vector<float> vertexScores(numVertices);
+    for(int v=0; v<numVertices; v++)
+        vertexScores[v] = scores.vertex(-1, remaining[v]);
+    std::vector<float> triangleScores(numTriangles);
+    std::vector<bool> emitted(numTriangles, false);
+    for(int t=0; t<numTriangles; t++) {
+        triangleScores[t] = vertexScores[indices[3*t]] + vertexScores[indices[3*t + 1]] +
+                            vertexScores[indices[3*t + 2]];
+    }
+
+    std::vector<unsigned short> sorted(numIndices);
+    int cache[FORSYTH_CACHE_SIZE + 3], numCached = 0;
+    int bestTriangle = numTriangles > 0 ? int(std::max_element(triangleScores.begin(), triangleScores.end()) -
+                                              triangleScores.begin()) : -1;
+    int nextUnemitted = 0;
+    for(int n=0; n<numTriangles; n++) {
+        // Nothing in the cache leads anywhere, the next triangle not drawn yet starts over
+        if(bestTriangle < 0) {
+            while(emitted[nextUnemitted])
+                nextUnemitted++;
+            bestTriangle = nextUnemitted;
+        }
+        const int t = bestTriangle;
+        emitted[t] = true;
+        for(int k=0; k<3; k++) {
+            const int v = indices[3*t + k];
+            sorted[3*n + k] = (unsigned short)v;
+            remaining[v]--;
+            // the triangle is taken out of the list of its vertex
+            int *triangles = &vertexTriangles[firstTriangle[v]];
+            std::remove(triangles, triangles + remaining[v] + 1, t);
+        }
+
+        // The vertices of the triangle move to the front of the cache, in order
+        int newCache[FORSYTH_CACHE_SIZE + 3], numNew = 0;
+        for(int k=0; k<3; k++)
+            newCache[numNew++] = indices[3*t + k];
+        for(int i=0; i<numCached; i++) {
+            const int v = cache[i];
+            if(v != newCache[0] && v != newCache[1] && v != newCache[2])
+                newCache[numNew++] = v;
+        }
+
+        // Rescore the vertices that moved, those pushed out of the cache included,
+        // and the triangles around them, picking the best of those triangles
+        float bestScore = -1.0f;
+        bestTriangle = -1;
+        for(int i=0; i<numNew; i++) {
+            const int v = newCache[i];
+            const int position = i < FORSYTH_CACHE_SIZE ? i : -1;
+            const float delta = scores.vertex(position, remaining[v]) - vertexScores[v];
+            vertexScores[v] += delta;
+            for(int j=0; j<remaining[v]; j++) {
+                const int u = vertexTriangles[firstTriangle[v] + j];
+                triangleScores[u] += delta;
+            }
+        }
+        for(int i=0; i<std::min(numNew, FORSYTH_CACHE_SIZE); i++) {
+            const int v = newCache[i];
+            for(int j=0; j<remaining[v]; j++) {
+                const int u = vertexTriangles[firstTriangle[v] + j];
+                if(triangleScores[u] > bestScore) {
+                    bestScore = triangleScores[u];
+                    bestTriangle = u;
+                }
+            }
+        }
+        numCached = std::min(numNew, FORSYTH_CACHE_SIZE);
+        std::copy(newCache, newCache + numCached, cache);
+    }
+    std::copy(sorted.begin(), sorted.end(), indices);
+}
+
+/**
+ * Function to reorder the triangles of a mesh, already ordered for the vertex
+ * cache, so that the parts of the mesh facing outwards are drawn first and hide
+ * the ones behind them, after Sander, Nehab and Barczak's "Fast Triangle
+ * Reordering for Vertex Locality and Reduced Overdraw". The triangles are split
+ * into clusters where the cache order starts over with three new vertices, so the
+ * cache efficiency barely changes, and the clusters are sorted by how far they lie
+ * out along their own normal from the center of the mesh
+ *
+ * Function: optimizeOverdraw
+ *           indices - Triangle list, reordered in place
+ *           positions - Position of the first vertex, three floats
+ *           positionStride - Bytes from one position to the next
+ *           numVertices - Vertices the indices refer to
+ *           cacheSize - Entries of the FIFO cache the clusters are split by
+ */
+void optimizeOverdraw(unsigned short *indices, int numIndices, const float *positions, size_t positionStride,
+                      int numVertices, int cacheSize) {
+    const int numTriangles = numIndices / 3;
+    if(numTriangles == 0)
+        return;
+    auto position = [&](int v) {
+        const float *p = (const float*)((const char*)positions + v * positionStride);
+        return Cvec3f(p[0], p[1], p[2]);
+    };
+
+    // Clusters start at the triangles that miss the cache with all three vertices
+    std::vector<int> clusterStarts;
+    std::vector<int> loadTimes(numVertices, -cacheSize);
+    int numMisses = 0;
+    for(int t=0; t<numTriangles; t++) {
+        int triangleMisses = 0;
+        for(int k=0; k<3; k++) {
+            const int v = indices[3*t + k];
+            if(numMisses - loadTimes[v] >= cacheSize) {
+                loadTimes[v] = numMisses++;
+                triangleMisses++;
+            }
+        }
+        if(t == 0 || triangleMisses == 3)
+            clusterStarts.push_back(t);
+    }
+    clusterStarts.push_back(numTriangles);
+    const int numClusters = (int)clusterStarts.size() - 1;
+
+    // Area weighted centroids and normals of the clusters and of the whole mesh
+    std::vector<Cvec3f> centroids(numClusters), normals(numClusters);
+    std::vector<float> areas(numClusters, 0.0f);
+    Cvec3f meshCentroid;
+    float meshArea = 0.0f;
+    for(int c=0; c<numClusters; c++) {
+        for(int t=clusterStarts[c]; t<clusterStarts[c + 1]; t++) {
+            const Cvec3f a = position(indices[3*t]), b = position(indices[3*t + 1]), d = position(indices[3*t + 2]);
+            const Cvec3f normal = cross(b - a, d - a);
+            const float area = 0.5f * sqrtf(float(norm2(normal)));
+            centroids[c] += (a + b + d) * (area / 3.0f);
+            normals[c] += normal;
+            areas[c] += area;
+        }
+        meshCentroid += centroids[c];
+        meshArea += areas[c];
+    }
+    if(meshArea > 0.0f)
+        meshCentroid /= meshArea;
+
+    std::vector<float> keys(numClusters, 0.0f);
+    for(int c=0; c<numClusters; c++) {
+        const float length = sqrtf(float(norm2(normals[c])));
+        if(areas[c] > 0.0f && length > 0.0f)
+            keys[c] = float(dot(centroids[c] / areas[c] - meshCentroid, normals[c] / length));
+    }
+    std::vector<int> order(numClusters);
+    for(int c=0; c<numClusters; c++)
+        order[c] = c;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return keys[a] > keys[b]; });
+
+    std::vector<unsigned short> sorted;
+    sorted.reserve(numIndices);
+    for(int i=0; i<numClusters; i++) {
+        const int c = order[i];
+        sorted.insert(sorted.end(), indices + 3 * clusterStarts[c], indices + 3 * clusterStarts[c + 1]);
+    }
+    std::copy(sorted.begin(), sorted.end(), indices);
+}
+
+/**
+ * Function to renumber the vertices of a mesh in the order the triangles first use
+ * them, so that the vertex fetch walks through the vertex buffer instead of
+ * jumping around it. Vertices no triangle uses go last. The vertices themselves
+ * are moved with remapVertices()
+ *
+ * Function: optimizeVertexFetch
+ *           indices - Triangle list, renumbered in place
+ *           numVertices - Vertices the indices refer to
+ *           remap - Destination, the new index of every vertex
+ */
+void optimizeVertexFetch(unsigned short *indices, int numIndices, int numVertices, std::vector<int> &remap) {
+    remap.assign(numVertices, -1);
+    int next = 0;
+    for(int i=0; i<numIndices; i++) {
+        if(remap[indices[i]] < 0)
+            remap[indices[i]] = next++;
+        indices[i] = (unsigned short)remap[indices[i]];
+    }
+    for(int v=0; v<numVertices; v++) {
+        if(remap[v] < 0)
+            remap[v] = next++;
+    }
+}
+
+/**
+ * Function to run the optimizations on a mesh from the geometry makers: the
+ * triangles are ordered for the vertex cache, unless the order they came in is
+ * already better, then optionally for overdraw, and the vertices for the fetch.
+ * Meshes that are convex, like the sphere and the cube, never overdraw themselves
+ * with back face culling and gain nothing from the overdraw order
+ *
+ * Function: optimizeMesh
+ *           indices - Triangle list, reordered and renumbered in place
+ *           positions - Position of the first vertex, three floats
+ *           positionStride - Bytes from one position to the next
+ *           numVertices - Vertices the indices refer to
+ *           reduceOverdraw - Whether to order the triangles for overdraw too
+ *           remap - Destination, the new index of every vertex for remapVertices()
+ */
+MeshOptimizationReport optimizeMesh(unsigned short *indices, int numIndices, const float *positions,
+                                    size_t positionStride, int numVertices, bool reduceOverdraw,
+                                    std::vector<int> &remap) {
+    MeshOptimizationReport report;
+    report.before = analyzeVertexCache(indices, numIndices, numVertices);
+
+    const std::vector<unsigned short> original(indices, indices + numIndices);
+    optimizeVertexCache(indices, numIndices, numVertices);
+    if(analyzeVertexCache(indices, numIndices, numVertices).acmr >= report.before.acmr)
+        std::copy(original.begin(), original.end(), indices);
+    if(reduceOverdraw)
+        optimizeOverdraw(indices, numIndices, positions, positionStride, numVertices);
+    optimizeVertexFetch(indices, numIndices, numVertices, remap);
+
+    report.after = analyzeVertexCache(indices, numIndices, numVertices);
+    return report;
+}
@@ -0,0 +1,68 @@
+#ifndef MESHOPTIMIZER_H
+#define MESHOPTIMIZER_H
+
+#include <cstddef>
+#include <vector>
+
+// Size of the LRU cache the vertex cache optimization models. It is larger than the
+// post-transform caches of most GPUs, which the order still suits as they evict the
+// oldest vertices first too
+const int FORSYTH_CACHE_SIZE = 32;
+
+// Size of the FIFO cache the statistics are measured with
+const int DEFAULT_STATS_CACHE_SIZE = 16;
+
+/**
+ * How well an index buffer reuses the post-transform vertex cache. ACMR is the
+ * average number of vertices transformed per triangle, between 0.5 for an ideal
+ * order of a large regular mesh and 3, ATVR the average number of times every
+ * vertex is transformed, 1 at best
+ *
+ * Structure: VertexCacheStats
+ */
+struct VertexCacheStats {
+    double acmr;
+    double atvr;
+};
+
+/**
+ * Vertex cache efficiency of a mesh before and after optimizeMesh()
+ *
+ * Structure: MeshOptimizationReport
+ */
+struct MeshOptimizationReport {
+    VertexCacheStats before;
+    VertexCacheStats after;
+};
+
+VertexCacheStats analyzeVertexCache(const unsigned short *indices, int numIndices, int numVertices,
+                                    int cacheSize = DEFAULT_STATS_CACHE_SIZE);
+void optimizeVertexCache(unsigned short *indices, int numIndices, int numVertices);
+void optimizeOverdraw(unsigned short *indices, int numIndices, const float *positions, size_t positionStride,
+                      int numVertices, int cacheSize = DEFAULT_STATS_CACHE_SIZE);
+void optimizeVertexFetch(unsigned short *indices, int numIndices, int numVertices, std::vector<int> &remap);
+MeshOptimizationReport optimizeMesh(unsigned short *indices, int numIndices, const float *positions,
+                                    size_t positionStride, int numVertices, bool reduceOverdraw,
+                                    std::vector<int> &remap);
+
+/**
+ * Function to move the vertices of a mesh to the places optimizeVertexFetch() gave
+ * them. Every vertex may be several consecutive elements, e.g. the four floats of a
+ * color
+ *
+ * Function: remapVertices
+ *           vertices - Vertices to reorder
+ *           remap - New index of every vertex
+ *           elementsPerVertex - Elements of vertices making up one vertex
+ */
+template<typename T>
+void remapVertices(std::vector<T> &vertices, const std::vector<int> &remap, int elementsPerVertex = 1) {
+    std::vector<T> remapped(vertices.size());
+    for(size_t i=0; i<remap.size(); i++) {
+        for(int j=0; j<elementsPerVertex; j++)
+            remapped[remap[i] * elementsPerVertex + j] = vertices[i * elementsPerVertex + j];
+    }
+    vertices.swap(remapped);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include "meshregistry.h"
+#include "meshoptimizer.h"
+
+/**
+ * Function to add a mesh after the ones already packed. Returns the id of the mesh
+ *
+ * Function: add
+ *           meshVertices - Vertices as the geometry maker made them
+ *           meshIndices - Triangle list of the mesh, indexing its own vertices
+ */
+int MeshRegistry::add(std::vector<GenericVertex> meshVertices, std::vector<unsigned short> meshIndices) {
+    const int numVertices = meshVertices.size(), numIndices = meshIndices.size();
+    std::vector<int> remap;
+    optimizeMesh(&meshIndices[0], numIndices, &meshVertices[0].pos[0], sizeof(GenericVertex), numVertices, false,
+                 remap);
+    remapVertices(meshVertices, remap);
+
+    MeshRange range;
+    range.firstIndex = indices.size();
+    range.numIndices = numIndices;
+    range.firstVertex = vertices.size();
+    range.numVertices = numVertices;
+    assert(range.firstVertex + numVertices <= 65536);
+
+    vertices.insert(vertices.end(), meshVertices.begin(), meshVertices.end());
+    for(int i=0; i<numIndices; i++)
+        indices.push_back(meshIndices[i] + range.firstVertex);
+    for(int i=0; i<numVertices; i++)
+        vertexRemap.push_back(range.firstVertex + remap[i]);
+    meshes.push_back(range);
+    return meshes.size() - 1;
+}
+
+/**
+ * Function to make the command drawing instances of a mesh. The indices already
+ * point at the vertices of the mesh, so the base vertex stays 0
+ *
+ * Function: drawCommand
+ *           numInstances - Instances to draw
+ *           firstInstance - Index of the first of them in the instance buffer
+ */
+DrawElementsIndirectCommand MeshRegistry::drawCommand(int mesh, int numInstances, int firstInstance) const {
+    DrawElementsIndirectCommand command;
+    command.count = meshes[mesh].numIndices;
+    command.instanceCount = numInstances;
+    command.firstIndex = meshes[mesh].firstIndex;
+    command.baseVertex = 0;
+    command.baseInstance = firstInstance;
+    return command;
+}
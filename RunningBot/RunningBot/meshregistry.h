@@ -0,0 +1,62 @@
+#ifndef MESHREGISTRY_H
+#define MESHREGISTRY_H
+
+#include <vector>
+
+#include "glsupport.h"
+#include "geometrymaker.h"
+
+/**
+ * Where a mesh of the registry lies in the shared vertex and index buffers
+ *
+ * Structure: MeshRange
+ */
+struct MeshRange {
+    int firstIndex, numIndices;
+    int firstVertex, numVertices;
+};
+
+/**
+ * One draw of glMultiDrawElementsIndirect, laid out as GL reads it from the
+ * indirect buffer
+ *
+ * Structure: DrawElementsIndirectCommand
+ */
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+/**
+ * Every mesh drawn, packed one after the other into one vertex and one index array
+ * that go into the shared buffers, so that meshes of all kinds can be drawn without
+ * binding other buffers. Every mesh is ordered for the vertex cache and the vertex
+ * fetch when it is added and its indices are offset to its vertices, which keeps
+ * them 16 bit as long as all the meshes have at most 65536 vertices
+ *
+ * Structure: MeshRegistry
+ */
+struct MeshRegistry {
+    std::vector<GenericVertex> vertices;
+    std::vector<unsigned short> indices;
+    std::vector<MeshRange> meshes;
+    std::vector<int> vertexRemap;       // where every vertex of every mesh as it was made went
+
+    int add(std::vector<GenericVertex> meshVertices, std::vector<unsigned short> meshIndices);
+
+    const MeshRange& operator [] (int mesh) const {
+        return meshes[mesh];
+    }
+
+    // Index in vertices of the given vertex of a mesh as the geometry maker made it
+    int packedVertex(int mesh, int vertex) const {
+        return vertexRemap[meshes[mesh].firstVertex + vertex];
+    }
+
+    DrawElementsIndirectCommand drawCommand(int mesh, int numInstances, int firstInstance) const;
+};
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef PARTINSTANCE_H
+#define PARTINSTANCE_H
+
+#include "affine3.h"
+
+/**
+ * Per instance data read by the vertex shader, one entry for every body part drawn
+ * by the instanced draw call. Both matrices are stored column-major
+ *
+ * Structure: PartInstance
+ */
+struct PartInstance {
+    float modelViewMatrix[16];
+    float normalMatrix[16];
+};
+
+/**
+ * Function to pack the accumulated matrices of one body part into its instance
+ *
+ * Function: writePartInstance
+ *           modelViewMatrix - Eye space transform of the part
+ *           normalMatrix - normalMatrix(modelViewMatrix)
+ *           instance - Destination
+ */
+inline void writePartInstance(const Affine3 &modelViewMatrix, const Affine3 &normalMatrix, PartInstance &instance) {
+    modelViewMatrix.writeToColumnMajorMatrix(instance.modelViewMatrix);
+    normalMatrix.writeToColumnMajorMatrix(instance.normalMatrix);
+    
+    // The shading was tuned with the full transpose(inv(modelViewMatrix)), whose last
+    // row is the translation of the inverse, -transpose(normalMatrix) * translation.
+    // It is rebuilt from the propagated normal matrix so that the look stays the same
+    for(int j=0; j<3; j++) {
+        instance.normalMatrix[4*j + 3] = -(normalMatrix(0,j) * modelViewMatrix(0,3) +
+                                           normalMatrix(1,j) * modelViewMatrix(1,3) +
+                                           normalMatrix(2,j) * modelViewMatrix(2,3));
+    }
+}
+
+#endif
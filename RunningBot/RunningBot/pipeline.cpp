@@ -0,0 +1,69 @@
+#include <assert.h>
+#include "pipeline.h"
+
+FramePipeline::FramePipeline(const SimulateFunction &simulate, int maxInstances, bool threaded)
+    : simulate_(simulate), front_(0), pending_(false), requested_(false), quit_(false) {
+    for(int i=0; i<2; i++) {
+        snapshots_[i].instances.resize(maxInstances);
+        snapshots_[i].numInstances = 0;
+    }
+    if(threaded)
+        thread_ = std::thread(&FramePipeline::simulationLoop, this);
+}
+
+FramePipeline::~FramePipeline() {
+    if(!threaded())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    requestCondition_.notify_one();
+    thread_.join();
+}
+
+void FramePipeline::simulationLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for(;;) {
+        requestCondition_.wait(lock, [&] { return quit_ || requested_; });
+        if(quit_)
+            return;
+        const SceneControls controls = requestedControls_;
+        FrameSnapshot &back = snapshots_[1 - front_];
+        
+        // The GL thread does not touch the back snapshot until the request is done
+        lock.unlock();
+        simulate_(controls, back);
+        lock.lock();
+        
+        requested_ = false;
+        doneCondition_.notify_one();
+    }
+}
+
+void FramePipeline::request(const SceneControls &controls) {
+    assert(!pending_);
+    pending_ = true;
+    if(!threaded()) {
+        simulate_(controls, snapshots_[1 - front_]);
+        return;
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        requestedControls_ = controls;
+        requested_ = true;
+    }
+    requestCondition_.notify_one();
+}
+
+FrameSnapshot &FramePipeline::acquire() {
+    assert(pending_);
+    pending_ = false;
+    if(threaded()) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        doneCondition_.wait(lock, [&] { return !requested_; });
+    }
+    front_ = 1 - front_;
+    return snapshots_[front_];
+}
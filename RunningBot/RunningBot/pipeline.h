@@ -0,0 +1,100 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cvec.h"
+#include "matrix4.h"
+#include "partinstance.h"
+#include "bot.h"
+#include "frustum.h"
+
+/**
+ * Everything the simulation of a frame depends on that the user can change. It is
+ * copied from the globals on the GL thread when the frame is requested, so the
+ * keyboard callback never races the simulation thread
+ *
+ * Structure: SceneControls
+ */
+struct SceneControls {
+    float time;                         // animation time in milliseconds
+    float frameSpeed;
+    int gait;                           // gait the bots fade into
+    bool wave;                          // whether the additive wave is on
+    Frustum frustum;                    // eye space planes of the projection
+    float pixelScale;                   // Camera::pixelScale, for the sphere mesh levels
+    Cvec3 botPosition;
+    float botXDegree, botYDegree, botZDegree;
+    Cvec3f lightPosition;
+    Cvec3f color;
+};
+
+/**
+ * The simulated state of one frame, everything the GL thread needs to draw it
+ *
+ * Structure: FrameSnapshot
+ */
+struct FrameSnapshot {
+    SceneControls controls;             // the light and color uniforms come from here
+    Matrix4 eyeMatrix;
+    Matrix4 viewMatrix;                 // inv(eyeMatrix)
+    std::vector<PartInstance> instances;
+    int numInstances;
+    DrawCounts counts;
+};
+
+/**
+ * Double buffered hand over of frames from a simulation thread to the GL thread.
+ * The GL thread draws the front snapshot while the simulation fills the back one
+ * with the next frame, so simulating frame N+1 overlaps submitting frame N and the
+ * frame time approaches the larger of the two instead of their sum. The price is
+ * one frame of latency between the controls and the picture.
+ *
+ * Every frame the GL thread calls acquire(), which waits for the frame requested
+ * last and swaps it to the front, then request() for the next one. Without a
+ * thread request() simulates in place, which is the plain serial loop
+ *
+ * Structure: FramePipeline
+ */
+class FramePipeline {
+public:
+    typedef std::function<void(const SceneControls &controls, FrameSnapshot &snapshot)> SimulateFunction;
+
+    FramePipeline(const SimulateFunction &simulate, int maxInstances, bool threaded);
+    ~FramePipeline();
+
+    bool threaded() const {
+        return thread_.joinable();
+    }
+
+    // Starts simulating the next frame into the back snapshot
+    void request(const SceneControls &controls);
+
+    // Waits for the requested frame and returns it as the front snapshot, which stays
+    // valid until the next call
+    FrameSnapshot &acquire();
+
+private:
+    FramePipeline(const FramePipeline&);
+    FramePipeline& operator = (const FramePipeline&);
+
+    void simulationLoop();
+
+    SimulateFunction simulate_;
+    FrameSnapshot snapshots_[2];
+    int front_;
+    SceneControls requestedControls_;
+    bool pending_;                      // a frame was requested and not acquired yet
+    bool requested_;                    // a request is waiting for or in simulation
+    bool quit_;
+    std::mutex mutex_;
+    std::condition_variable requestCondition_;
+    std::condition_variable doneCondition_;
+    std::thread thread_;
+};
+
+#endif
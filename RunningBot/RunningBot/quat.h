@@ -208,7 +208,7 @@ inline Quat interpolateCatmullRom(const Quat& q0,
 	const Quat& g = slerp(d, e, t);
 	const Quat& h = slerp(e, q2, t);
 	const Quat& m = slerp(f, g, t);
-	const Quat& n = slerp(h, h, t);
+	const Quat& n = slerp(g, h, t);
 
 	return slerp(m, n, t);
 }
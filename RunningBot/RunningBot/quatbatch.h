@@ -0,0 +1,323 @@
+#ifndef QUATBATCH_H
+#define QUATBATCH_H
+
+#include <algorithm>
+#include <cmath>
+
+#include "quat.h"
+
+// SSE2 evaluates 4 quaternions at once, AVX 8 when the compiler is allowed to emit
+// it (-mavx). Define QUATBATCH_NO_SIMD to force the scalar code, which is also
+// used on every other architecture and for the tail of an array.
+#if !defined(QUATBATCH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+  #define QUATBATCH_SSE2
+  #include <emmintrin.h>
+  #if defined(__AVX__)
+    #define QUATBATCH_AVX
+    #include <immintrin.h>
+  #endif
+#endif
+
+// Quaternions per SIMD operation. Arrays padded to a multiple of it never take the
+// scalar path
+#if defined(QUATBATCH_AVX)
+const int QUAT_BATCH_WIDTH = 8;
+#elif defined(QUATBATCH_SSE2)
+const int QUAT_BATCH_WIDTH = 4;
+#else
+const int QUAT_BATCH_WIDTH = 1;
+#endif
+
+// Cosine of the half angle between two unit quaternions above which nlerp is used
+// instead of slerp. Up to rotations of 20 degrees nlerp strays at most 0.01
+// degrees from the slerp path, well below anything visible.
+const float QUAT_NLERP_THRESHOLD = 0.985f;
+
+// n quaternions stored as structure of arrays, one float stream per component,
+// so that consecutive quaternions fill the lanes of a SIMD register
+struct QuatArrays {
+  float *w, *x, *y, *z;
+};
+
+struct ConstQuatArrays {
+  const float *w, *x, *y, *z;
+
+  ConstQuatArrays() : w(0), x(0), y(0), z(0) {}
+  ConstQuatArrays(const float *w, const float *x, const float *y, const float *z) : w(w), x(x), y(y), z(z) {}
+  ConstQuatArrays(const QuatArrays& q) : w(q.w), x(q.x), y(q.y), z(q.z) {}
+
+  // The arrays starting at the ith quaternion
+  ConstQuatArrays operator + (const int i) const {
+    return ConstQuatArrays(w + i, x + i, y + i, z + i);
+  }
+
+  Quat operator [] (const int i) const {
+    return Quat(w[i], x[i], y[i], z[i]);
+  }
+};
+
+inline void storeQuat(const QuatArrays& out, const int i, const Quat& q) {
+  out.w[i] = float(q[0]);
+  out.x[i] = float(q[1]);
+  out.y[i] = float(q[2]);
+  out.z[i] = float(q[3]);
+}
+
+// Interpolates unit quaternions a and b along the great arc, through the shorter
+// of the two arcs. Exact slerp, with nlerp once the quaternions are close
+inline void slerpQuat(const float a[4], const float b[4], const float t, float r[4]) {
+  float d = a[0]*b[0] + a[1]*b[1] + a[2]*b[2] + a[3]*b[3];
+  const float sign = d < 0 ? -1.0f : 1.0f;
+  d *= sign;
+  float wa = 1 - t, wb = t;
+  if (d < QUAT_NLERP_THRESHOLD) {
+    const float angle = std::acos(std::min(d, 1.0f));
+    const float invSin = 1 / std::sin(angle);
+    wa = std::sin((1 - t) * angle) * invSin;
+    wb = std::sin(t * angle) * invSin;
+  }
+  wb *= sign;
+  float n2 = 0;
+  for (int i = 0; i < 4; ++i) {
+    r[i] = wa * a[i] + wb * b[i];
+    n2 += r[i] * r[i];
+  }
+  // slerp keeps unit length by itself, nlerp needs the normalization
+  const float invLength = 1 / std::sqrt(n2);
+  for (int i = 0; i < 4; ++i) {
+    r[i] *= invLength;
+  }
+}
+
+// Scalar slerp of the ith quaternions, the fallback of the batched versions
+inline void slerpQuatAt(const ConstQuatArrays& a, const ConstQuatArrays& b, const float t, const QuatArrays& out, const int i) {
+  const float qa[4] = {a.w[i], a.x[i], a.y[i], a.z[i]};
+  const float qb[4] = {b.w[i], b.x[i], b.y[i], b.z[i]};
+  float r[4];
+  slerpQuat(qa, qb, t, r);
+  out.w[i] = r[0];
+  out.x[i] = r[1];
+  out.y[i] = r[2];
+  out.z[i] = r[3];
+}
+
+// out[i] = slerp(a[i], b[i], t) for n unit quaternions. The lanes are blended with
+// nlerp, which only costs a few multiply-adds and one square root per 4 (or 8)
+// quaternions. Groups with a pair further apart than QUAT_NLERP_THRESHOLD redo
+// those pairs with the exact slerp. out may alias a or b
+inline void slerpQuats(const ConstQuatArrays& a, const ConstQuatArrays& b, const float t, const QuatArrays& out, const int n) {
+  int i = 0;
+#if defined(QUATBATCH_AVX)
+  const __m256 vt8 = _mm256_set1_ps(t), vs8 = _mm256_set1_ps(1 - t);
+  const __m256 signMask8 = _mm256_set1_ps(-0.0f), threshold8 = _mm256_set1_ps(QUAT_NLERP_THRESHOLD);
+  for (; i + 8 <= n; i += 8) {
+    const __m256 aw = _mm256_loadu_ps(a.w + i), ax = _mm256_loadu_ps(a.x + i);
+    const __m256 ay = _mm256_loadu_ps(a.y + i), az = _mm256_loadu_ps(a.z + i);
+    const __m256 bw = _mm256_loadu_ps(b.w + i), bx = _mm256_loadu_ps(b.x + i);
+    const __m256 by = _mm256_loadu_ps(b.y + i), bz = _mm256_loadu_ps(b.z + i);
+    const __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(aw, bw), _mm256_mul_ps(ax, bx)),
+                                   _mm256_add_ps(_mm256_mul_ps(ay, by), _mm256_mul_ps(az, bz)));
+    // flip b where the dot product is negative to take the shorter arc
+    const __m256 sign = _mm256_and_ps(d, signMask8);
+    const int slerpLanes = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_xor_ps(d, sign), threshold8, _CMP_LT_OQ));
+    const __m256 wb = _mm256_xor_ps(vt8, sign);
+    const __m256 rw = _mm256_add_ps(_mm256_mul_ps(vs8, aw), _mm256_mul_ps(wb, bw));
+    const __m256 rx = _mm256_add_ps(_mm256_mul_ps(vs8, ax), _mm256_mul_ps(wb, bx));
+    const __m256 ry = _mm256_add_ps(_mm256_mul_ps(vs8, ay), _mm256_mul_ps(wb, by));
+    const __m256 rz = _mm256_add_ps(_mm256_mul_ps(vs8, az), _mm256_mul_ps(wb, bz));
+    const __m256 n2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rw, rw), _mm256_mul_ps(rx, rx)),
+                                    _mm256_add_ps(_mm256_mul_ps(ry, ry), _mm256_mul_ps(rz, rz)));
+    const __m256 invLength = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(n2));
+    if (slerpLanes) {
+      // the exact slerp reads a and b, which out may alias
+      float lanes[4][8];
+      _mm256_storeu_ps(lanes[0], _mm256_mul_ps(rw, invLength));
+      _mm256_storeu_ps(lanes[1], _mm256_mul_ps(rx, invLength));
+      _mm256_storeu_ps(lanes[2], _mm256_mul_ps(ry, invLength));
+      _mm256_storeu_ps(lanes[3], _mm256_mul_ps(rz, invLength));
+      for (int j = 0; j < 8; ++j) {
+        if (slerpLanes & (1 << j)) {
+          slerpQuatAt(a, b, t, out, i + j);
+        }
+        else {
+          out.w[i + j] = lanes[0][j];
+          out.x[i + j] = lanes[1][j];
+          out.y[i + j] = lanes[2][j];
+          out.z[i + j] = lanes[3][j];
+        }
+      }
+      continue;
+    }
+    _mm256_storeu_ps(out.w + i, _mm256_mul_ps(rw, invLength));
+    _mm256_storeu_ps(out.x + i, _mm256_mul_ps(rx, invLength));
+    _mm256_storeu_ps(out.y + i, _mm256_mul_ps(ry, invLength));
+    _mm256_storeu_ps(out.z + i, _mm256_mul_ps(rz, invLength));
+  }
+#endif
+#if defined(QUATBATCH_SSE2)
+  const __m128 vt = _mm_set1_ps(t), vs = _mm_set1_ps(1 - t);
+  const __m128 signMask = _mm_set1_ps(-0.0f), threshold = _mm_set1_ps(QUAT_NLERP_THRESHOLD);
+  for (; i + 4 <= n; i += 4) {
+    const __m128 aw = _mm_loadu_ps(a.w + i), ax = _mm_loadu_ps(a.x + i);
+    const __m128 ay = _mm_loadu_ps(a.y + i), az = _mm_loadu_ps(a.z + i);
+    const __m128 bw = _mm_loadu_ps(b.w + i), bx = _mm_loadu_ps(b.x + i);
+    const __m128 by = _mm_loadu_ps(b.y + i), bz = _mm_loadu_ps(b.z + i);
+    const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bw), _mm_mul_ps(ax, bx)),
+                                _mm_add_ps(_mm_mul_ps(ay, by), _mm_mul_ps(az, bz)));
+    // flip b where the dot product is negative to take the shorter arc
+    const __m128 sign = _mm_and_ps(d, signMask);
+    const int slerpLanes = _mm_movemask_ps(_mm_cmplt_ps(_mm_xor_ps(d, sign), threshold));
+    const __m128 wb = _mm_xor_ps(vt, sign);
+    const __m128 rw = _mm_add_ps(_mm_mul_ps(vs, aw), _mm_mul_ps(wb, bw));
+    const __m128 rx = _mm_add_ps(_mm_mul_ps(vs, ax), _mm_mul_ps(wb, bx));
+    const __m128 ry = _mm_add_ps(_mm_mul_ps(vs, ay), _mm_mul_ps(wb, by));
+    const __m128 rz = _mm_add_ps(_mm_mul_ps(vs, az), _mm_mul_ps(wb, bz));
+    const __m128 n2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rw, rw), _mm_mul_ps(rx, rx)),
+                                 _mm_add_ps(_mm_mul_ps(ry, ry), _mm_mul_ps(rz, rz)));
+    const __m128 invLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(n2));
+    if (slerpLanes) {
+      // the exact slerp reads a and b, which out may alias
+      float lanes[4][4];
+      _mm_storeu_ps(lanes[0], _mm_mul_ps(rw, invLength));
+      _mm_storeu_ps(lanes[1], _mm_mul_ps(rx, invLength));
+      _mm_storeu_ps(lanes[2], _mm_mul_ps(ry, invLength));
+      _mm_storeu_ps(lanes[3], _mm_mul_ps(rz, invLength));
+      for (int j = 0; j < 4; ++j) {
+        if (slerpLanes & (1 << j)) {
+          slerpQuatAt(a, b, t, out, i + j);
+        }
+        else {
+          out.w[i + j] = lanes[0][j];
+          out.x[i + j] = lanes[1][j];
+          out.y[i + j] = lanes[2][j];
+          out.z[i + j] = lanes[3][j];
+        }
+      }
+      continue;
+    }
+    _mm_storeu_ps(out.w + i, _mm_mul_ps(rw, invLength));
+    _mm_storeu_ps(out.x + i, _mm_mul_ps(rx, invLength));
+    _mm_storeu_ps(out.y + i, _mm_mul_ps(ry, invLength));
+    _mm_storeu_ps(out.z + i, _mm_mul_ps(rz, invLength));
+  }
+#endif
+  for (; i < n; ++i) {
+    slerpQuatAt(a, b, t, out, i);
+  }
+}
+
+// sum[i] += weight * q[i] for n quaternions, with q[i] flipped into the hemisphere
+// of sum[i] first. Normalizing the sum after all the poses went in blends them with
+// the weighted nlerp, which does not depend on their order
+inline void accumulateQuats(const ConstQuatArrays& q, const float weight, const QuatArrays& sum, const int n) {
+  int i = 0;
+#if defined(QUATBATCH_SSE2)
+  const __m128 vw = _mm_set1_ps(weight), signMask = _mm_set1_ps(-0.0f);
+  for (; i + 4 <= n; i += 4) {
+    const __m128 qw = _mm_loadu_ps(q.w + i), qx = _mm_loadu_ps(q.x + i);
+    const __m128 qy = _mm_loadu_ps(q.y + i), qz = _mm_loadu_ps(q.z + i);
+    const __m128 sw = _mm_loadu_ps(sum.w + i), sx = _mm_loadu_ps(sum.x + i);
+    const __m128 sy = _mm_loadu_ps(sum.y + i), sz = _mm_loadu_ps(sum.z + i);
+    const __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qw, sw), _mm_mul_ps(qx, sx)),
+                                _mm_add_ps(_mm_mul_ps(qy, sy), _mm_mul_ps(qz, sz)));
+    const __m128 w = _mm_xor_ps(vw, _mm_and_ps(d, signMask));
+    _mm_storeu_ps(sum.w + i, _mm_add_ps(sw, _mm_mul_ps(w, qw)));
+    _mm_storeu_ps(sum.x + i, _mm_add_ps(sx, _mm_mul_ps(w, qx)));
+    _mm_storeu_ps(sum.y + i, _mm_add_ps(sy, _mm_mul_ps(w, qy)));
+    _mm_storeu_ps(sum.z + i, _mm_add_ps(sz, _mm_mul_ps(w, qz)));
+  }
+#endif
+  for (; i < n; ++i) {
+    const float d = q.w[i] * sum.w[i] + q.x[i] * sum.x[i] + q.y[i] * sum.y[i] + q.z[i] * sum.z[i];
+    const float w = d < 0 ? -weight : weight;
+    sum.w[i] += w * q.w[i];
+    sum.x[i] += w * q.x[i];
+    sum.y[i] += w * q.y[i];
+    sum.z[i] += w * q.z[i];
+  }
+}
+
+// Scales n quaternions to unit length
+inline void normalizeQuats(const QuatArrays& q, const int n) {
+  int i = 0;
+#if defined(QUATBATCH_SSE2)
+  for (; i + 4 <= n; i += 4) {
+    const __m128 qw = _mm_loadu_ps(q.w + i), qx = _mm_loadu_ps(q.x + i);
+    const __m128 qy = _mm_loadu_ps(q.y + i), qz = _mm_loadu_ps(q.z + i);
+    const __m128 n2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(qw, qw), _mm_mul_ps(qx, qx)),
+                                 _mm_add_ps(_mm_mul_ps(qy, qy), _mm_mul_ps(qz, qz)));
+    const __m128 invLength = _mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(n2));
+    _mm_storeu_ps(q.w + i, _mm_mul_ps(qw, invLength));
+    _mm_storeu_ps(q.x + i, _mm_mul_ps(qx, invLength));
+    _mm_storeu_ps(q.y + i, _mm_mul_ps(qy, invLength));
+    _mm_storeu_ps(q.z + i, _mm_mul_ps(qz, invLength));
+  }
+#endif
+  for (; i < n; ++i) {
+    const float invLength = 1 / std::sqrt(q.w[i] * q.w[i] + q.x[i] * q.x[i] + q.y[i] * q.y[i] + q.z[i] * q.z[i]);
+    q.w[i] *= invLength;
+    q.x[i] *= invLength;
+    q.y[i] *= invLength;
+    q.z[i] *= invLength;
+  }
+}
+
+// out[i] = a[i] * b[i] for n quaternions. out may alias a or b
+inline void multiplyQuats(const ConstQuatArrays& a, const ConstQuatArrays& b, const QuatArrays& out, const int n) {
+  int i = 0;
+#if defined(QUATBATCH_SSE2)
+  for (; i + 4 <= n; i += 4) {
+    const __m128 aw = _mm_loadu_ps(a.w + i), ax = _mm_loadu_ps(a.x + i);
+    const __m128 ay = _mm_loadu_ps(a.y + i), az = _mm_loadu_ps(a.z + i);
+    const __m128 bw = _mm_loadu_ps(b.w + i), bx = _mm_loadu_ps(b.x + i);
+    const __m128 by = _mm_loadu_ps(b.y + i), bz = _mm_loadu_ps(b.z + i);
+    const __m128 rw = _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(aw, bw), _mm_mul_ps(ax, bx)),
+                                 _mm_add_ps(_mm_mul_ps(ay, by), _mm_mul_ps(az, bz)));
+    const __m128 rx = _mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bx), _mm_mul_ps(ax, bw)),
+                                 _mm_sub_ps(_mm_mul_ps(ay, bz), _mm_mul_ps(az, by)));
+    const __m128 ry = _mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, by), _mm_mul_ps(ay, bw)),
+                                 _mm_sub_ps(_mm_mul_ps(az, bx), _mm_mul_ps(ax, bz)));
+    const __m128 rz = _mm_add_ps(_mm_add_ps(_mm_mul_ps(aw, bz), _mm_mul_ps(az, bw)),
+                                 _mm_sub_ps(_mm_mul_ps(ax, by), _mm_mul_ps(ay, bx)));
+    _mm_storeu_ps(out.w + i, rw);
+    _mm_storeu_ps(out.x + i, rx);
+    _mm_storeu_ps(out.y + i, ry);
+    _mm_storeu_ps(out.z + i, rz);
+  }
+#endif
+  for (; i < n; ++i) {
+    const float aw = a.w[i], ax = a.x[i], ay = a.y[i], az = a.z[i];
+    const float bw = b.w[i], bx = b.x[i], by = b.y[i], bz = b.z[i];
+    out.w[i] = aw * bw - ax * bx - ay * by - az * bz;
+    out.x[i] = aw * bx + ax * bw + ay * bz - az * by;
+    out.y[i] = aw * by + ay * bw + az * bx - ax * bz;
+    out.z[i] = aw * bz + az * bw + ax * by - ay * bx;
+  }
+}
+
+// Control points of the Catmull-Rom segment from q1 to q2 as a cubic Bezier curve
+// q1, d, e, q2 (the quaternion version of d = q1 + (q2 - q0)/6, e = q2 - (q3 - q1)/6).
+// They only depend on the keys, so they are computed once per key and not per sample
+inline void catmullRomControlPoints(const Quat& q0, const Quat& q1, const Quat& q2, const Quat& q3, Quat& d, Quat& e) {
+  d = pow(shortRotation(q2 * inv(q0)), 1/6.0) * q1;
+  e = inv(pow(shortRotation(q3 * inv(q1)), 1/6.0)) * q2;
+}
+
+// out[i] = the cubic Bezier curve with control points q1[i], d[i], e[i], q2[i] at t,
+// evaluated with de Casteljau's construction out of six batched slerps. With the
+// control points of catmullRomControlPoints this is the Catmull-Rom spline through
+// the keys. scratch needs room for 3 * n quaternions
+inline void bezierQuats(const ConstQuatArrays& q1, const ConstQuatArrays& d, const ConstQuatArrays& e, const ConstQuatArrays& q2,
+                        const float t, const QuatArrays& out, const QuatArrays& scratch, const int n) {
+  const QuatArrays f = scratch;
+  const QuatArrays g = {scratch.w + n, scratch.x + n, scratch.y + n, scratch.z + n};
+  const QuatArrays h = {scratch.w + 2*n, scratch.x + 2*n, scratch.y + 2*n, scratch.z + 2*n};
+  slerpQuats(q1, d, t, f, n);
+  slerpQuats(d, e, t, g, n);
+  slerpQuats(e, q2, t, h, n);
+  slerpQuats(f, g, t, f, n);                              // m
+  slerpQuats(g, h, t, g, n);                              // n
+  slerpQuats(f, g, t, out, n);
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef SCENEGRAPH_H
+#define SCENEGRAPH_H
+
+#include <cassert>
+#include <vector>
+
+#include "affine3.h"
+
+// A single node of a transform hierarchy. objectMatrix is relative to the
+// parent node (or to the world for a root) and modelViewMatrix is the
+// accumulated eye-space transform filled in by SceneGraph::update. Both are
+// affine, so they are kept as Affine3 and only expanded to 4x4 for upload.
+//
+// The normal matrices are carried alongside: since the inverse transpose of a
+// product is the product of the inverse transposes, the normal matrix of a node
+// is its parent's times objectNormalMatrix, and no node ever needs an inverse.
+struct SceneNode {
+  Affine3 objectMatrix;
+  Affine3 objectNormalMatrix;                             // normalMatrix(objectMatrix)
+  Affine3 modelViewMatrix;
+  Affine3 normalMatrix;                                   // normalMatrix(modelViewMatrix)
+  int parent;                                             // index of the parent node, -1 for a root
+};
+
+// Largest difference between the linear parts of two affine matrices, relative to
+// the size of the expected entry
+inline float linearPartError(const Affine3& expected, const Affine3& actual) {
+  float error = 0;
+  for (int i = 0; i < 3; ++i) {
+    for (int j = 0; j < 3; ++j) {
+      const float d = std::abs(expected(i,j) - actual(i,j)) / std::max(1.0f, std::abs(expected(i,j)));
+      error = std::max(error, d);
+    }
+  }
+  return error;
+}
+
+// Largest difference between the propagated normal matrix of a node and the one
+// computed directly from its model view matrix, relative to the size of the entry
+inline float normalMatrixError(const SceneNode& node) {
+  return linearPartError(normalMatrix(node.modelViewMatrix), node.normalMatrix);
+}
+
+// A transform hierarchy stored as a flat, contiguous array of nodes. Nodes are
+// kept in parent-before-child order so that a single forward pass over the
+// array computes every model view matrix. The graph is meant to be built once;
+// afterwards only the object matrices are changed and update is called each
+// frame, so no memory is allocated while rendering.
+class SceneGraph {
+  std::vector<SceneNode> nodes_;
+
+public:
+  // Appends a node below parent (-1 for a root) and returns its index. The
+  // parent has to be added before its children.
+  int addNode(const int parent, const Affine3& objectMatrix = Affine3()) {
+    assert(parent < (int)nodes_.size());
+    SceneNode node;
+    node.objectMatrix = objectMatrix;
+    node.objectNormalMatrix = normalMatrix(objectMatrix);
+    node.parent = parent;
+    nodes_.push_back(node);
+    return (int)nodes_.size() - 1;
+  }
+
+  int size() const {
+    return (int)nodes_.size();
+  }
+
+  SceneNode& operator [] (const int i) {
+    return nodes_[i];
+  }
+
+  const SceneNode& operator [] (const int i) const {
+    return nodes_[i];
+  }
+
+  // Changes the transform of a node relative to its parent. The caller provides
+  // the matching normal matrix, which it can usually build from the factors of
+  // objectMatrix without inverting anything (rotations are their own normal
+  // matrix, a scale by s has a normal matrix scaling by 1/s).
+  void setObjectMatrix(const int i, const Affine3& objectMatrix, const Affine3& objectNormalMatrix) {
+    nodes_[i].objectMatrix = objectMatrix;
+    nodes_[i].objectNormalMatrix = objectNormalMatrix;
+  }
+
+  // Recomputes the model view and normal matrix of every node, viewMatrix being
+  // the inverse of the eye matrix and viewNormalMatrix normalMatrix(viewMatrix)
+  void update(const Affine3& viewMatrix, const Affine3& viewNormalMatrix) {
+    for (int i = 0; i < (int)nodes_.size(); ++i) {
+      SceneNode& node = nodes_[i];
+      if (node.parent < 0) {
+        node.modelViewMatrix = viewMatrix * node.objectMatrix;
+        node.normalMatrix = viewNormalMatrix * node.objectNormalMatrix;
+      }
+      else {
+        node.modelViewMatrix = nodes_[node.parent].modelViewMatrix * node.objectMatrix;
+        node.normalMatrix = nodes_[node.parent].normalMatrix * node.objectNormalMatrix;
+      }
+#ifdef DEBUG
+      // debug builds check the propagated normal matrix against a direct inverse,
+      // RunningBot --check does the same in any build
+      assert(normalMatrixError(node) < 1e-5f);
+#endif
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "selfcheck.h"
+#include "bot.h"
+#include "partinstance.h"
+#include "quat.h"
+#include "scenegraph.h"
+
+// Gait times the bot is posed at, one frame of 60Hz apart, with the gait switched
+// every GAIT_STEPS frames so that the fades between the clips are covered too
+static const int GAIT_STEPS = 240;
+static const float CHECK_FRAME_TIME = 1000.0f / 60.0f;
+static const float CHECK_FRAME_SPEED = 10.0f;
+
+/**
+ * Function to read back the affine part of a column-major matrix of an instance
+ *
+ * Function: affineFromColumnMajor
+ */
+static Affine3 affineFromColumnMajor(const float m[16]) {
+    Affine3 a;
+    for(int i=0; i<3; i++) {
+        for(int j=0; j<4; j++)
+            a(i,j) = m[4*j + i];
+    }
+    return a;
+}
+
+int runNormalMatrixCheck() {
+    RunningBot bot;
+    bot.build();
+
+    // A view that is neither axis aligned nor at the origin, like the camera's
+    const Affine3 eyeMatrix = Affine3::makeRotation(Quat::makeYRotation(40.0)) *
+                              Affine3::makeRotation(Quat::makeXRotation(-20.0)) *
+                              Affine3::makeTranslation(Cvec3(0.0, 0.0, 30.0));
+    const Affine3 viewMatrix = inv(eyeMatrix);
+    const Affine3 viewNormalMatrix = normalMatrix(viewMatrix);
+    const Cvec3 position(1.5, 0.0, -2.0);
+
+    static const int gaits[] = {RUN_GAIT, WALK_GAIT, IDLE_GAIT, RUN_GAIT, IDLE_GAIT, WALK_GAIT};
+    const int numGaits = sizeof(gaits) / sizeof(gaits[0]);
+    GaitState state;
+    PartInstance instances[MAX_BOT_NODES];
+    float sceneError = 0, instanceError = 0, pathError = 0;
+    int numPoses = 0;
+    for(int g=0; g<numGaits; g++) {
+        state.setGait(gaits[g]);
+        for(int step=0; step<GAIT_STEPS; step++) {
+            // The wave of the additive layer fades in and out within every gait
+            state.additive = step < GAIT_STEPS / 2;
+            bot.animation.advance(state, CHECK_FRAME_TIME, CHECK_FRAME_SPEED);
+
+            bot.pose(state, position);
+            bot.skeleton.update(viewMatrix, viewNormalMatrix);
+            for(int i=0; i<bot.skeleton.size(); i++)
+                sceneError = std::max(sceneError, normalMatrixError(bot.skeleton[i]));
+
+            float rotations[4][MAX_CLIP_JOINTS];
+            const QuatArrays rotationArrays = {rotations[0], rotations[1], rotations[2], rotations[3]};
+            Cvec3 rootTranslation;
+            bot.evaluatePose(state, rotationArrays, rootTranslation);
+            const int numInstances = bot.writePoseInstances(rotationArrays, rootTranslation, position, viewMatrix,
+                                                            viewNormalMatrix, true, NULL, instances);
+            for(int i=0; i<numInstances; i++) {
+                const Affine3 modelViewMatrix = affineFromColumnMajor(instances[i].modelViewMatrix);
+                const Affine3 propagated = affineFromColumnMajor(instances[i].normalMatrix);
+                instanceError = std::max(instanceError, linearPartError(normalMatrix(modelViewMatrix), propagated));
+                // Both paths pose the same skeleton the same way
+                pathError = std::max(pathError, linearPartError(bot.skeleton[i].normalMatrix, propagated));
+            }
+            numPoses++;
+        }
+    }
+
+    const bool passed = sceneError < NORMAL_MATRIX_TOLERANCE && instanceError < NORMAL_MATRIX_TOLERANCE &&
+                        pathError < NORMAL_MATRIX_TOLERANCE;
+    printf("normal matrices of %d poses of %d parts, largest relative error (tolerance %g)\n",
+           numPoses, bot.skeleton.size(), NORMAL_MATRIX_TOLERANCE);
+    printf("  %-28s %.3g\n", "SceneGraph::update", sceneError);
+    printf("  %-28s %.3g\n", "writePoseInstances", instanceError);
+    printf("  %-28s %.3g\n", "between the two", pathError);
+    printf("%s\n", passed ? "passed" : "FAILED");
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,19 @@
+#ifndef SELFCHECK_H
+#define SELFCHECK_H
+
+// Largest relative error allowed between a propagated normal matrix and the one
+// computed from the model view matrix
+const float NORMAL_MATRIX_TOLERANCE = 1e-5f;
+
+/**
+ * Self-test of the normal matrices the renderer propagates instead of inverting:
+ * poses the bot over a sweep of gait times, fades and the additive layer, both
+ * through SceneGraph::update and through RunningBot::writePoseInstances, and
+ * compares every normal matrix with normalMatrix() of its model view matrix. Prints
+ * the largest errors and returns the process exit code, nonzero on failure
+ *
+ * Function: runNormalMatrixCheck
+ */
+int runNormalMatrixCheck();
+
+#endif
@@ -1,8 +1,19 @@
+#extension GL_ARB_uniform_buffer_object : enable
+
 varying vec4 varyingColor;
 varying vec4 varyingNormal;
 
+// The same FrameUniforms block as in vertex.glsl
+#ifdef GL_ARB_uniform_buffer_object
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec4 lightPosition;
+    vec4 uColor;
+};
+#else
 uniform vec4 uColor;
 uniform vec4 lightPosition;
+#endif
 
 void main() {
     gl_FragColor = varyingColor;
@@ -1,17 +1,59 @@
+#extension GL_ARB_uniform_buffer_object : enable
+
 attribute vec4 position;
 attribute vec4 color;
 attribute vec4 normal;
 
+// Per instance matrices of the body part being drawn
+attribute mat4 instanceModelViewMatrix;
+attribute mat4 instanceNormalMatrix;
+
 uniform vec4 timeUniform;
-uniform mat4 modelViewMatrix;
+
+// Uniforms of the frame and of the mesh being drawn, in uniform buffers laid out
+// as FrameUniforms and MeshUniforms in uniformblocks.h where they are supported.
+// The members of the blocks are used by name either way
+#ifdef GL_ARB_uniform_buffer_object
+layout(std140) uniform FrameUniforms {
+    mat4 projectionMatrix;
+    vec4 lightPosition;
+    vec4 uColor;
+};
+
+layout(std140) uniform MeshUniforms {
+    // Normalized positions are scaled back to the size of the mesh, 1 otherwise
+    float positionScale;
+    // How the normal attribute is encoded, see NormalEncoding in vertexformat.h: 0
+    // as x, y and z, 1 folded on an octahedron, 2 as a tangent frame quaternion
+    int normalEncoding;
+};
+#else
 uniform mat4 projectionMatrix;
-uniform mat4 normalMatrix;
+uniform float positionScale;
+uniform int normalEncoding;
+#endif
 
 varying vec4 varyingColor;
 varying vec4 varyingNormal;
 
+vec3 decodeNormal() {
+    if(normalEncoding == 1) {
+        vec3 n = vec3(normal.xy, 1.0 - abs(normal.x) - abs(normal.y));
+        if(n.z < 0.0) {
+            vec2 signs = vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+            n.xy = (1.0 - abs(n.yx)) * signs;
+        }
+        return normalize(n);
+    }
+    if(normalEncoding == 2) {
+        vec4 q = normalize(normal);
+        return vec3(2.0 * (q.x * q.z + q.w * q.y), 2.0 * (q.y * q.z - q.w * q.x), 1.0 - 2.0 * (q.x * q.x + q.y * q.y));
+    }
+    return normal.xyz;
+}
+
 void main() {
-    varyingNormal = normalize(normalMatrix * normal);
+    varyingNormal = normalize(instanceNormalMatrix * vec4(decodeNormal(), 1.0));
     varyingColor = color;
-    gl_Position = projectionMatrix * modelViewMatrix * position;
-}
\ No newline at end of file
+    gl_Position = projectionMatrix * instanceModelViewMatrix * vec4(position.xyz * positionScale, 1.0);
+}
@@ -0,0 +1,72 @@
+#include <math.h>
+#include <algorithm>
+#include "spherelod.h"
+#include "bot.h"
+
+/**
+ * Function to sort the instances of a frame by level. The level of a part is
+ * picked by the projected radius of its sphere, the mesh radius scaled by the
+ * longest axis of its model view matrix over its distance from the eye. Parts
+ * reaching behind the eye get the finest level. Returns the number of instances
+ *
+ * Function: sort
+ *           jobSystem - Threads to spread the blocks over, NULL sorts on this thread
+ *           instances - Instances in the order they were written
+ *           pixelScale - Pixels per unit of eye space at a distance of 1 from the eye
+ *           sorted - Destination, level after level, finest first
+ *           lodCounts - Destination, the number of instances of every level
+ */
+int SphereLodSorter::sort(JobSystem *jobSystem, const PartInstance *instances, int numInstances, float pixelScale,
+                          PartInstance *sorted, int lodCounts[NUM_SPHERE_LODS]) {
+    const int numBlocks = (numInstances + SPHERE_LOD_BLOCK_SIZE - 1) / SPHERE_LOD_BLOCK_SIZE;
+    if((int)lods.size() < numInstances)
+        lods.resize(numInstances);
+    blockOffsets.assign(numBlocks * NUM_SPHERE_LODS, 0);
+
+    // A job may be handed several blocks when it runs inline
+    auto forEachBlock = [&](const std::function<void(int block, int first, int last)> &body) {
+        auto blocks = [&](int first, int last) {
+            for(int i=first; i<last; i+=SPHERE_LOD_BLOCK_SIZE)
+                body(i / SPHERE_LOD_BLOCK_SIZE, i, std::min(last, i + SPHERE_LOD_BLOCK_SIZE));
+        };
+        if(jobSystem)
+            jobSystem->parallelFor(numInstances, SPHERE_LOD_BLOCK_SIZE, blocks);
+        else
+            blocks(0, numInstances);
+    };
+
+    forEachBlock([&](int block, int first, int last) {
+        int *counts = &blockOffsets[block * NUM_SPHERE_LODS];
+        for(int i=first; i<last; i++) {
+            const float *m = instances[i].modelViewMatrix;
+            float squaredScale = 0.0f;
+            for(int j=0; j<3; j++)
+                squaredScale = std::max(squaredScale, m[4*j] * m[4*j] + m[4*j + 1] * m[4*j + 1] + m[4*j + 2] * m[4*j + 2]);
+            const float radius = BOT_PART_RADIUS * sqrtf(squaredScale);
+            const float distance = -m[14];
+            const int lod = distance > radius ? selectSphereLod(radius * pixelScale / distance) : 0;
+            lods[i] = (unsigned char)lod;
+            counts[lod]++;
+        }
+    });
+
+    // Every level starts after the finer ones, and every block's share of a level
+    // after the share of the blocks before it
+    int numSorted = 0;
+    for(int l=0; l<NUM_SPHERE_LODS; l++) {
+        lodCounts[l] = 0;
+        for(int b=0; b<numBlocks; b++) {
+            const int count = blockOffsets[b * NUM_SPHERE_LODS + l];
+            blockOffsets[b * NUM_SPHERE_LODS + l] = numSorted;
+            numSorted += count;
+            lodCounts[l] += count;
+        }
+    }
+
+    forEachBlock([&](int block, int first, int last) {
+        int *offsets = &blockOffsets[block * NUM_SPHERE_LODS];
+        for(int i=first; i<last; i++)
+            sorted[offsets[lods[i]]++] = instances[i];
+    });
+    return numSorted;
+}
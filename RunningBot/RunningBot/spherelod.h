@@ -0,0 +1,63 @@
+#ifndef SPHERELOD_H
+#define SPHERELOD_H
+
+#include <vector>
+
+#include "partinstance.h"
+#include "jobsystem.h"
+
+/**
+ * One level of the chain of sphere meshes the body parts are drawn with
+ *
+ * Structure: SphereLod
+ */
+struct SphereLod {
+    int slices, stacks;
+    float minPixels;                    // projected radius in pixels from which the level is used
+};
+
+// Levels of the sphere mesh, finest first. A level is used down to where the flattest
+// facet of the next coarser one, 1 - cos(pi / slices) of the radius, is off by about
+// half a pixel. The 12x12 level is the mesh every part used to be drawn with
+const int NUM_SPHERE_LODS = 5;
+const SphereLod SPHERE_LODS[NUM_SPHERE_LODS] = {
+    {32, 32, 40.0f},
+    {20, 16, 15.0f},
+    {12, 12, 6.5f},
+    {8, 6, 3.5f},
+    {6, 4, 0.0f}
+};
+
+// Instances counted and scattered by one job of SphereLodSorter::sort
+const int SPHERE_LOD_BLOCK_SIZE = 4096;
+
+/**
+ * Function to pick the level of the sphere mesh for a part by its projected size
+ *
+ * Function: selectSphereLod
+ *           projectedRadius - Radius of the part on the screen in pixels
+ */
+inline int selectSphereLod(float projectedRadius) {
+    int lod = 0;
+    while(lod < NUM_SPHERE_LODS - 1 && projectedRadius < SPHERE_LODS[lod].minPixels)
+        lod++;
+    return lod;
+}
+
+/**
+ * Groups the instances of a frame by the level of the sphere mesh they are drawn
+ * with, so that every level goes out as one instanced draw call. The instances are
+ * split into blocks of SPHERE_LOD_BLOCK_SIZE that are counted and then scattered
+ * to their levels in parallel, and stay in their order within a level
+ *
+ * Structure: SphereLodSorter
+ */
+struct SphereLodSorter {
+    std::vector<unsigned char> lods;    // level of every instance
+    std::vector<int> blockOffsets;      // instances of every level in every block, then where they go
+
+    int sort(JobSystem *jobSystem, const PartInstance *instances, int numInstances, float pixelScale,
+             PartInstance *sorted, int lodCounts[NUM_SPHERE_LODS]);
+};
+
+#endif
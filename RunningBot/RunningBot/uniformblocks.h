@@ -0,0 +1,34 @@
+#ifndef UNIFORMBLOCKS_H
+#define UNIFORMBLOCKS_H
+
+#include "glsupport.h"
+
+// Binding points the uniform blocks of the shaders are bound to
+const GLuint FRAME_UNIFORMS_BINDING = 0;
+const GLuint MESH_UNIFORMS_BINDING = 1;
+
+/**
+ * Uniforms that are the same for everything drawn in a frame, in the std140
+ * layout of the FrameUniforms block of the shaders
+ *
+ * Structure: FrameUniforms
+ */
+struct FrameUniforms {
+    GLfloat projectionMatrix[16];       // column-major
+    GLfloat lightPosition[4];
+    GLfloat color[4];                   // uColor
+};
+
+/**
+ * Uniforms of one mesh in its vertex format, in the std140 layout of the
+ * MeshUniforms block of the vertex shader, padded to the size of a vec4
+ *
+ * Structure: MeshUniforms
+ */
+struct MeshUniforms {
+    GLfloat positionScale;
+    GLint normalEncoding;
+    GLint padding[2];
+};
+
+#endif
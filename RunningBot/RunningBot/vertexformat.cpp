@@ -0,0 +1,332 @@
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+#include "vertexformat.h"
+
+// Quantized formats take 12 or 16 bytes for a position and normal instead of 24 and
+// 4 bytes for a color instead of 16. Positions keep a fourth component so that every
+// attribute stays 4 byte aligned
+const VertexFormat VERTEX_FORMATS[NUM_VERTEX_FORMATS] = {
+    {"float", 24, {3, GL_FLOAT, GL_FALSE, 0}, {3, GL_FLOAT, GL_FALSE, 12}, NORMAL_XYZ, false,
+        {4, GL_FLOAT, GL_FALSE, 0}, 16},
+    {"half", 12, {4, GL_HALF_FLOAT, GL_FALSE, 0}, {2, GL_SHORT, GL_TRUE, 8}, NORMAL_OCTAHEDRAL, false,
+        {4, GL_UNSIGNED_BYTE, GL_TRUE, 0}, 4},
+    {"snorm16", 12, {4, GL_SHORT, GL_TRUE, 0}, {2, GL_SHORT, GL_TRUE, 8}, NORMAL_OCTAHEDRAL, true,
+        {4, GL_UNSIGNED_BYTE, GL_TRUE, 0}, 4},
+    {"qtangent", 16, {4, GL_SHORT, GL_TRUE, 0}, {4, GL_SHORT, GL_TRUE, 8}, NORMAL_QUATERNION, true,
+        {4, GL_UNSIGNED_BYTE, GL_TRUE, 0}, 4}
+};
+
+/**
+ * Function to look a vertex format up by its name. Returns -1 for an unknown name
+ *
+ * Function: findVertexFormat
+ */
+int findVertexFormat(const char *name) {
+    for(int i=0; i<NUM_VERTEX_FORMATS; i++) {
+        if(strcmp(VERTEX_FORMATS[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * Function to convert a float to the nearest half float, rounding ties to even
+ *
+ * Function: floatToHalf
+ */
+unsigned short floatToHalf(float f) {
+    unsigned int bits;
+    memcpy(&bits, &f, sizeof(bits));
+    const unsigned int sign = (bits >> 16) & 0x8000;
+    const unsigned int floatExponent = (bits >> 23) & 0xff;
+    unsigned int mantissa = bits & 0x7fffff;
+    if(floatExponent == 0xff)
+        return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+
+    const int exponent = int(floatExponent) - 127 + 15;
+    if(exponent >= 31)
+        return sign | 0x7c00;
+    if(exponent <= 0) {
+        // Subnormal, the implicit leading bit is shifted in with the mantissa
+        if(exponent < -10)
+            return sign;
+        mantissa |= 0x800000;
+        const int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        const unsigned int rest = mantissa & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if(rest > halfway || (rest == halfway && (half & 1)))
+            half++;
+        return sign | half;
+    }
+    // A carry out of the mantissa rounds up into the exponent, as it should
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+    const unsigned int rest = mantissa & 0x1fff;
+    if(rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return half;
+}
+
+/**
+ * Function to convert a half float to a float
+ *
+ * Function: halfToFloat
+ */
+float halfToFloat(unsigned short h) {
+    const float sign = (h & 0x8000) ? -1.0f : 1.0f;
+    const int exponent = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+    if(exponent == 0)
+        return sign * ldexpf(float(mantissa), -24);
+    if(exponent == 31)
+        return mantissa ? NAN : sign * INFINITY;
+    return sign * ldexpf(float(mantissa + 1024), exponent - 25);
+}
+
+static short floatToSnorm16(float v) {
+    return (short)lrintf(std::max(-1.0f, std::min(1.0f, v)) * 32767.0f);
+}
+
+static float snorm16ToFloat(short s) {
+    return std::max(s / 32767.0f, -1.0f);
+}
+
+static float signNotZero(float v) {
+    return v >= 0.0f ? 1.0f : -1.0f;
+}
+
+/**
+ * Function to encode a unit normal in two 16 bit components. The normal is
+ * projected on the octahedron |x| + |y| + |z| = 1, whose lower half is folded
+ * over the upper one into the square [-1, 1]^2
+ *
+ * Function: encodeOctahedral
+ *           n - Unit normal
+ *           out - Destination, x and y on the square
+ */
+void encodeOctahedral(const Cvec3f &n, short out[2]) {
+    const float l1 = fabsf(n[0]) + fabsf(n[1]) + fabsf(n[2]);
+    float x = n[0] / l1, y = n[1] / l1;
+    if(n[2] < 0.0f) {
+        const float foldedX = (1.0f - fabsf(y)) * signNotZero(x);
+        const float foldedY = (1.0f - fabsf(x)) * signNotZero(y);
+        x = foldedX;
+        y = foldedY;
+    }
+    out[0] = floatToSnorm16(x);
+    out[1] = floatToSnorm16(y);
+}
+
+/**
+ * Function to decode a normal encodeOctahedral() made, as vertex.glsl does
+ *
+ * Function: decodeOctahedral
+ */
+Cvec3f decodeOctahedral(const short in[2]) {
+    const float x = snorm16ToFloat(in[0]), y = snorm16ToFloat(in[1]);
+    Cvec3f n(x, y, 1.0f - fabsf(x) - fabsf(y));
+    if(n[2] < 0.0f) {
+        n[0] = (1.0f - fabsf(y)) * signNotZero(x);
+        n[1] = (1.0f - fabsf(x)) * signNotZero(y);
+    }
+    return normalize(n);
+}
+
+/**
+ * Function to encode a tangent frame as a unit quaternion in four 16 bit
+ * components. The frame is made orthonormal around the normal first. The
+ * quaternion is flipped to w > 0 and a mirrored frame, whose binormal points
+ * against cross(normal, tangent), is flagged by a negative w
+ *
+ * Function: encodeTangentFrame
+ *           out - Destination, x, y, z and w of the quaternion
+ */
+void encodeTangentFrame(const Cvec3f &tangent, const Cvec3f &binormal, const Cvec3f &normal, short out[4]) {
+    const Cvec3f n = normalize(normal);
+    const Cvec3f t = normalize(tangent - n * dot(tangent, n));
+    const Cvec3f b = cross(n, t);
+
+    // Rotation whose columns are the tangent, binormal and normal
+    const float m[3][3] = {
+        {t[0], b[0], n[0]},
+        {t[1], b[1], n[1]},
+        {t[2], b[2], n[2]}
+    };
+    float q[4];
+    const float trace = m[0][0] + m[1][1] + m[2][2];
+    if(trace > 0.0f) {
+        const float s = 2.0f * sqrtf(trace + 1.0f);
+        q[0] = (m[2][1] - m[1][2]) / s;
+        q[1] = (m[0][2] - m[2][0]) / s;
+        q[2] = (m[1][0] - m[0][1]) / s;
+        q[3] = 0.25f * s;
+    } else if(m[0][0] > m[1][1] && m[0][0] > m[2][2]) {
+        const float s = 2.0f * sqrtf(1.0f + m[0][0] - m[1][1] - m[2][2]);
+        q[0] = 0.25f * s;
+        q[1] = (m[0][1] + m[1][0]) / s;
+        q[2] = (m[0][2] + m[2][0]) / s;
+        q[3] = (m[2][1] - m[1][2]) / s;
+    } else if(m[1][1] > m[2][2]) {
+        const float s = 2.0f * sqrtf(1.0f + m[1][1] - m[0][0] - m[2][2]);
+        q[0] = (m[0][1] + m[1][0]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (m[1][2] + m[2][1]) / s;
+        q[3] = (m[0][2] - m[2][0]) / s;
+    } else {
+        const float s = 2.0f * sqrtf(1.0f + m[2][2] - m[0][0] - m[1][1]);
+        q[0] = (m[0][2] + m[2][0]) / s;
+        q[1] = (m[1][2] + m[2][1]) / s;
+        q[2] = 0.25f * s;
+        q[3] = (m[1][0] - m[0][1]) / s;
+    }
+
+    // w must not round to 0 or the flag would be lost
+    const float sign = q[3] < 0.0f ? -1.0f : 1.0f;
+    for(int i=0; i<4; i++)
+        q[i] *= sign;
+    const float minW = 1.0f / 32767.0f;
+    if(q[3] < minW) {
+        const float scale = sqrtf(1.0f - minW * minW);
+        for(int i=0; i<3; i++)
+            q[i] *= scale;
+        q[3] = minW;
+    }
+    const float handedness = dot(binormal, b) < 0.0f ? -1.0f : 1.0f;
+    for(int i=0; i<4; i++)
+        out[i] = floatToSnorm16(q[i] * handedness);
+}
+
+/**
+ * Function to get the normal back from a tangent frame encodeTangentFrame() made,
+ * the third column of the rotation of the quaternion, as vertex.glsl does
+ *
+ * Function: decodeTangentFrameNormal
+ */
+Cvec3f decodeTangentFrameNormal(const short in[4]) {
+    float q[4], length = 0.0f;
+    for(int i=0; i<4; i++) {
+        q[i] = snorm16ToFloat(in[i]);
+        length += q[i] * q[i];
+    }
+    length = sqrtf(length);
+    for(int i=0; i<4; i++)
+        q[i] /= length;
+    return Cvec3f(2.0f * (q[0] * q[2] + q[3] * q[1]),
+                  2.0f * (q[1] * q[2] - q[3] * q[0]),
+                  1.0f - 2.0f * (q[0] * q[0] + q[1] * q[1]));
+}
+
+/**
+ * Function to get the scale the positions of a mesh are divided by to fit the
+ * range of a normalized format, the largest coordinate. Formats storing the
+ * positions as they are get 1
+ *
+ * Function: vertexPositionScale
+ */
+float vertexPositionScale(const VertexFormat &format, const GenericVertex *vertices, int numVertices) {
+    if(!format.normalizedPositions)
+        return 1.0f;
+    float scale = 0.0f;
+    for(int i=0; i<numVertices; i++) {
+        for(int j=0; j<3; j++)
+            scale = std::max(scale, fabsf(vertices[i].pos[j]));
+    }
+    return scale > 0.0f ? scale : 1.0f;
+}
+
+/**
+ * Function to write the positions and normals of vertices in the layout of a format.
+ * Formats only differ by the types of their attributes and the encoding of their
+ * normals, so a new one only needs its entry in VERTEX_FORMATS
+ *
+ * Function: encodeVertices
+ *           vertices - Vertices as the geometry makers fill them
+ *           positionScale - Scale of the mesh from vertexPositionScale()
+ *           out - Destination, format.stride bytes for every vertex
+ */
+void encodeVertices(const VertexFormat &format, const GenericVertex *vertices, int numVertices, float positionScale,
+                    unsigned char *out) {
+    for(int i=0; i<numVertices; i++) {
+        const GenericVertex &v = vertices[i];
+        unsigned char *vertex = out + format.stride * i;
+
+        const float position[4] = {v.pos[0], v.pos[1], v.pos[2], 1.0f};
+        for(int j=0; j<format.position.size; j++) {
+            unsigned char *component = vertex + format.position.offset;
+            if(format.position.type == GL_FLOAT) {
+                memcpy(component + sizeof(float) * j, &position[j], sizeof(float));
+            } else if(format.position.type == GL_HALF_FLOAT) {
+                const unsigned short half = floatToHalf(position[j]);
+                memcpy(component + sizeof(half) * j, &half, sizeof(half));
+            } else {
+                const short snorm = floatToSnorm16(j < 3 ? position[j] / positionScale : 1.0f);
+                memcpy(component + sizeof(snorm) * j, &snorm, sizeof(snorm));
+            }
+        }
+
+        unsigned char *normal = vertex + format.normal.offset;
+        if(format.normalEncoding == NORMAL_XYZ) {
+            memcpy(normal, &v.normal[0], sizeof(float) * 3);
+        } else if(format.normalEncoding == NORMAL_OCTAHEDRAL) {
+            short encoded[2];
+            encodeOctahedral(v.normal, encoded);
+            memcpy(normal, encoded, sizeof(encoded));
+        } else {
+            short encoded[4];
+            encodeTangentFrame(v.tangent, v.binormal, v.normal, encoded);
+            memcpy(normal, encoded, sizeof(encoded));
+        }
+    }
+}
+
+/**
+ * Function to get the position and normal of a vertex back the way the vertex
+ * shader does, to measure what the encoding loses
+ *
+ * Function: decodeVertex
+ */
+void decodeVertex(const VertexFormat &format, const unsigned char *vertex, float positionScale,
+                  Cvec3f &position, Cvec3f &normal) {
+    const unsigned char *component = vertex + format.position.offset;
+    for(int j=0; j<3; j++) {
+        if(format.position.type == GL_FLOAT) {
+            memcpy(&position[j], component + sizeof(float) * j, sizeof(float));
+        } else if(format.position.type == GL_HALF_FLOAT) {
+            unsigned short half;
+            memcpy(&half, component + sizeof(half) * j, sizeof(half));
+            position[j] = halfToFloat(half);
+        } else {
+            short snorm;
+            memcpy(&snorm, component + sizeof(snorm) * j, sizeof(snorm));
+            position[j] = snorm16ToFloat(snorm) * positionScale;
+        }
+    }
+
+    const unsigned char *encoded = vertex + format.normal.offset;
+    if(format.normalEncoding == NORMAL_XYZ) {
+        memcpy(&normal[0], encoded, sizeof(float) * 3);
+    } else if(format.normalEncoding == NORMAL_OCTAHEDRAL) {
+        short octahedral[2];
+        memcpy(octahedral, encoded, sizeof(octahedral));
+        normal = decodeOctahedral(octahedral);
+    } else {
+        short quaternion[4];
+        memcpy(quaternion, encoded, sizeof(quaternion));
+        normal = decodeTangentFrameNormal(quaternion);
+    }
+}
+
+/**
+ * Function to write RGBA colors in the layout of a format
+ *
+ * Function: encodeColors
+ *           colors - Four floats for every vertex
+ *           out - Destination, format.colorStride bytes for every vertex
+ */
+void encodeColors(const VertexFormat &format, const float *colors, int numVertices, unsigned char *out) {
+    if(format.color.type == GL_FLOAT) {
+        memcpy(out, colors, sizeof(float) * 4 * numVertices);
+        return;
+    }
+    for(int i=0; i<4 * numVertices; i++)
+        out[i] = (unsigned char)lrintf(std::max(0.0f, std::min(1.0f, colors[i])) * 255.0f);
+}
@@ -0,0 +1,71 @@
+#ifndef VERTEXFORMAT_H
+#define VERTEXFORMAT_H
+
+#include "glsupport.h"
+#include "geometrymaker.h"
+
+// Formats the vertices of the meshes can be stored in. All but the first quantize
+// the colors to 8 bits per channel and the normals to 16 bits per component
+enum VertexFormatType {
+    VERTEX_FORMAT_FLOAT,                // float position and normal, float colors
+    VERTEX_FORMAT_HALF,                 // half float position, octahedral normal
+    VERTEX_FORMAT_SNORM16,              // 16 bit normalized position, octahedral normal
+    VERTEX_FORMAT_QTANGENT,             // 16 bit normalized position, tangent frame as a quaternion
+    NUM_VERTEX_FORMATS
+};
+
+// How the vertex shader gets the normal back from the normal attribute, matching
+// normalEncoding in vertex.glsl
+enum NormalEncoding {
+    NORMAL_XYZ = 0,
+    NORMAL_OCTAHEDRAL = 1,
+    NORMAL_QUATERNION = 2
+};
+
+/**
+ * Layout of one attribute as glVertexAttribPointer takes it
+ *
+ * Structure: VertexAttributeFormat
+ */
+struct VertexAttributeFormat {
+    GLint size;
+    GLenum type;
+    GLboolean normalized;
+    GLsizei offset;                     // bytes from the start of the vertex
+};
+
+/**
+ * Layout of the vertices of a format. Positions and normals are interleaved in the
+ * vertex buffer, the colors are tightly packed in a buffer of their own
+ *
+ * Structure: VertexFormat
+ */
+struct VertexFormat {
+    const char *name;
+    GLsizei stride;
+    VertexAttributeFormat position;
+    VertexAttributeFormat normal;
+    NormalEncoding normalEncoding;
+    bool normalizedPositions;           // positions are divided by the positionScale of the mesh
+    VertexAttributeFormat color;
+    GLsizei colorStride;
+};
+
+extern const VertexFormat VERTEX_FORMATS[NUM_VERTEX_FORMATS];
+
+int findVertexFormat(const char *name);
+float vertexPositionScale(const VertexFormat &format, const GenericVertex *vertices, int numVertices);
+void encodeVertices(const VertexFormat &format, const GenericVertex *vertices, int numVertices, float positionScale,
+                    unsigned char *out);
+void encodeColors(const VertexFormat &format, const float *colors, int numVertices, unsigned char *out);
+void decodeVertex(const VertexFormat &format, const unsigned char *vertex, float positionScale,
+                  Cvec3f &position, Cvec3f &normal);
+
+unsigned short floatToHalf(float f);
+float halfToFloat(unsigned short h);
+void encodeOctahedral(const Cvec3f &n, short out[2]);
+Cvec3f decodeOctahedral(const short in[2]);
+void encodeTangentFrame(const Cvec3f &tangent, const Cvec3f &binormal, const Cvec3f &normal, short out[4]);
+Cvec3f decodeTangentFrameNormal(const short in[4]);
+
+#endif